@@ -0,0 +1,217 @@
+#include "pool.h"
+#include "thread.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+  void (*fun)(void *arg, int worker);
+  void *arg;
+} Task;
+
+// A double-ended queue of tasks in a ring buffer.
+// The owning worker pushes and pops at the tail,
+// and other workers steal from the head.
+typedef struct {
+  Mutex9 mtx;
+  Task *tasks;
+  int head, n, cap;
+} Deque;
+
+typedef struct {
+  Pool9 *pool;
+  int index;
+  Thread9 thrd;
+  Deque deque;
+  PoolStats9 stats;
+} Worker;
+
+struct pool9 {
+  Worker *workers;
+  int nworkers;
+  // The worker running in the current thread, if any.
+  ThreadLocal9 self;
+
+  Mutex9 mtx;
+  // Signaled when a task is queued or quit is set.
+  Cond9 work;
+  // Signaled when pending becomes 0.
+  Cond9 idle;
+  // The number of tasks in all deques.
+  // Guarded by mtx.
+  int queued;
+  // The number of tasks added that have not finished.
+  // Guarded by mtx.
+  int pending;
+  // Guarded by mtx.
+  int next_worker;
+  // Guarded by mtx.
+  bool quit;
+};
+
+static void push(Deque *d, Task t) {
+  mutex_lock9(&d->mtx);
+  if (d->n == d->cap) {
+    int cap = d->cap == 0 ? 16 : d->cap * 2;
+    Task *tasks = calloc(cap, sizeof(Task));
+    if (tasks == NULL) {
+      abort();
+    }
+    for (int i = 0; i < d->n; i++) {
+      tasks[i] = d->tasks[(d->head + i) % d->cap];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->head = 0;
+    d->cap = cap;
+  }
+  d->tasks[(d->head + d->n) % d->cap] = t;
+  d->n++;
+  mutex_unlock9(&d->mtx);
+}
+
+// Removes a task from the tail, if steal is false, or the head, if it is true,
+// and returns whether there was one.
+static bool take(Deque *d, bool steal, Task *t) {
+  mutex_lock9(&d->mtx);
+  bool ok = d->n > 0;
+  if (ok && steal) {
+    *t = d->tasks[d->head];
+    d->head = (d->head + 1) % d->cap;
+    d->n--;
+  } else if (ok) {
+    d->n--;
+    *t = d->tasks[(d->head + d->n) % d->cap];
+  }
+  mutex_unlock9(&d->mtx);
+  return ok;
+}
+
+// Takes a task from w's own deque, or steals one from another worker,
+// and returns whether it found one.
+static bool find_task(Worker *w, Task *t) {
+  Pool9 *pool = w->pool;
+  if (take(&w->deque, false, t)) {
+    return true;
+  }
+  for (int i = 1; i < pool->nworkers; i++) {
+    Worker *victim = &pool->workers[(w->index + i) % pool->nworkers];
+    if (take(&victim->deque, true, t)) {
+      w->stats.steals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void run_worker(void *arg) {
+  Worker *w = arg;
+  Pool9 *pool = w->pool;
+  thread_local_set9(&pool->self, w);
+  for (;;) {
+    mutex_lock9(&pool->mtx);
+    while (pool->queued == 0 && !pool->quit) {
+      cond_wait9(&pool->work, &pool->mtx);
+    }
+    if (pool->queued == 0 && pool->quit) {
+      mutex_unlock9(&pool->mtx);
+      return;
+    }
+    mutex_unlock9(&pool->mtx);
+
+    Task t;
+    if (!find_task(w, &t)) {
+      // Another worker took it first.
+      continue;
+    }
+    mutex_lock9(&pool->mtx);
+    pool->queued--;
+    mutex_unlock9(&pool->mtx);
+
+    t.fun(t.arg, w->index);
+    w->stats.tasks++;
+
+    mutex_lock9(&pool->mtx);
+    if (--pool->pending == 0) {
+      cond_broadcast9(&pool->idle);
+    }
+    mutex_unlock9(&pool->mtx);
+  }
+}
+
+Pool9 *pool_create9(int nworkers) {
+  Pool9 *pool = calloc(1, sizeof(Pool9));
+  if (pool == NULL || nworkers < 1) {
+    abort();
+  }
+  pool->nworkers = nworkers;
+  pool->workers = calloc(nworkers, sizeof(Worker));
+  if (pool->workers == NULL) {
+    abort();
+  }
+  thread_local_init9(&pool->self, NULL);
+  mutex_init9(&pool->mtx);
+  cond_init9(&pool->work);
+  cond_init9(&pool->idle);
+  for (int i = 0; i < nworkers; i++) {
+    Worker *w = &pool->workers[i];
+    w->pool = pool;
+    w->index = i;
+    mutex_init9(&w->deque.mtx);
+  }
+  for (int i = 0; i < nworkers; i++) {
+    thread_create9(&pool->workers[i].thrd, run_worker, &pool->workers[i]);
+  }
+  return pool;
+}
+
+void pool_add9(Pool9 *pool, void (*fun)(void *arg, int worker), void *arg) {
+  Worker *w = thread_local_get9(&pool->self);
+  mutex_lock9(&pool->mtx);
+  pool->pending++;
+  if (w == NULL) {
+    w = &pool->workers[pool->next_worker];
+    pool->next_worker = (pool->next_worker + 1) % pool->nworkers;
+  }
+  mutex_unlock9(&pool->mtx);
+
+  push(&w->deque, (Task){.fun = fun, .arg = arg});
+
+  mutex_lock9(&pool->mtx);
+  pool->queued++;
+  cond_broadcast9(&pool->work);
+  mutex_unlock9(&pool->mtx);
+}
+
+void pool_wait9(Pool9 *pool) {
+  mutex_lock9(&pool->mtx);
+  while (pool->pending > 0) {
+    cond_wait9(&pool->idle, &pool->mtx);
+  }
+  mutex_unlock9(&pool->mtx);
+}
+
+PoolStats9 pool_stats9(Pool9 *pool, int worker) {
+  pool_wait9(pool);
+  return pool->workers[worker].stats;
+}
+
+void pool_free9(Pool9 *pool) {
+  pool_wait9(pool);
+  mutex_lock9(&pool->mtx);
+  pool->quit = true;
+  cond_broadcast9(&pool->work);
+  mutex_unlock9(&pool->mtx);
+  for (int i = 0; i < pool->nworkers; i++) {
+    thread_join9(&pool->workers[i].thrd);
+  }
+  for (int i = 0; i < pool->nworkers; i++) {
+    mutex_destroy9(&pool->workers[i].deque.mtx);
+    free(pool->workers[i].deque.tasks);
+  }
+  cond_destroy9(&pool->idle);
+  cond_destroy9(&pool->work);
+  mutex_destroy9(&pool->mtx);
+  thread_local_free9(&pool->self);
+  free(pool->workers);
+  free(pool);
+}
@@ -0,0 +1,36 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// A work-stealing pool of worker threads.
+//
+// Each worker has its own queue of tasks.
+// A worker runs the most recently added task from its own queue,
+// and when that is empty, steals the oldest task from another worker.
+typedef struct pool9 Pool9;
+
+typedef struct {
+  // The number of tasks the worker ran.
+  long tasks;
+  // The number of those tasks that it stole from another worker.
+  long steals;
+} PoolStats9;
+
+// Returns a new pool with nworkers threads, which must be at least 1.
+Pool9 *pool_create9(int nworkers);
+
+// Adds a task to call fun(arg, worker),
+// where worker is the index of the worker thread running it.
+// Tasks added by a task go to the queue of its worker,
+// and others are spread over the workers' queues.
+void pool_add9(Pool9 *pool, void (*fun)(void *arg, int worker), void *arg);
+
+// Waits until all added tasks, and any tasks they add, have finished.
+void pool_wait9(Pool9 *pool);
+
+// Returns the statistics for the worker at index worker.
+PoolStats9 pool_stats9(Pool9 *pool, int worker);
+
+// Waits for all tasks to finish, then stops the workers and frees the pool.
+void pool_free9(Pool9 *pool);
+
+#endif // _POOL_H_
@@ -0,0 +1,111 @@
+#include "pool.h"
+#include "thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fprintf(stderr, __VA_ARGS__);                                              \
+    abort();                                                                   \
+  } while (0)
+
+enum {
+  NUM_WORKERS = 4,
+  NUM_TASKS = 1000,
+  NUM_SUBTASKS = 10,
+  // More than the thread-local keys available to a process on Linux.
+  NUM_POOLS = 2000,
+};
+
+typedef struct {
+  Pool9 *pool;
+  Mutex9 mtx;
+  int count;
+  int worker_count[NUM_WORKERS];
+} Counter;
+
+static void count_task(void *arg, int worker) {
+  Counter *c = arg;
+  mutex_lock9(&c->mtx);
+  c->count++;
+  c->worker_count[worker]++;
+  mutex_unlock9(&c->mtx);
+}
+
+static void spawn_task(void *arg, int worker) {
+  Counter *c = arg;
+  for (int i = 0; i < NUM_SUBTASKS; i++) {
+    pool_add9(c->pool, count_task, c);
+  }
+  count_task(arg, worker);
+}
+
+static void check_stats(Counter *c) {
+  long total = 0;
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    PoolStats9 stats = pool_stats9(c->pool, i);
+    if (stats.steals > stats.tasks) {
+      FAIL("worker %d stole %ld of %ld tasks\n", i, stats.steals,
+           stats.tasks);
+    }
+    total += stats.tasks;
+  }
+  if (total != c->count) {
+    FAIL("workers ran %ld tasks, counted %d\n", total, c->count);
+  }
+}
+
+static void run_pool_test() {
+  Counter c = {.pool = pool_create9(NUM_WORKERS)};
+  mutex_init9(&c.mtx);
+  for (int i = 0; i < NUM_TASKS; i++) {
+    pool_add9(c.pool, count_task, &c);
+  }
+  pool_wait9(c.pool);
+  if (c.count != NUM_TASKS) {
+    FAIL("got %d tasks run, wanted %d\n", c.count, NUM_TASKS);
+  }
+  check_stats(&c);
+  pool_free9(c.pool);
+  mutex_destroy9(&c.mtx);
+}
+
+static void run_pool_subtask_test() {
+  Counter c = {.pool = pool_create9(NUM_WORKERS)};
+  mutex_init9(&c.mtx);
+  for (int i = 0; i < NUM_TASKS; i++) {
+    pool_add9(c.pool, spawn_task, &c);
+  }
+  pool_wait9(c.pool);
+  int want = NUM_TASKS * (NUM_SUBTASKS + 1);
+  if (c.count != want) {
+    FAIL("got %d tasks run, wanted %d\n", c.count, want);
+  }
+  check_stats(&c);
+  pool_free9(c.pool);
+  mutex_destroy9(&c.mtx);
+}
+
+// Creates and frees more pools than there are thread-local keys,
+// so freeing a pool must free its key.
+static void run_pool_create_free_test() {
+  for (int i = 0; i < NUM_POOLS; i++) {
+    Counter c = {.pool = pool_create9(1)};
+    mutex_init9(&c.mtx);
+    pool_add9(c.pool, count_task, &c);
+    pool_wait9(c.pool);
+    if (c.count != 1) {
+      FAIL("pool %d: got %d tasks run, wanted 1\n", i, c.count);
+    }
+    pool_free9(c.pool);
+    mutex_destroy9(&c.mtx);
+  }
+}
+
+int main() {
+  run_pool_test();
+  run_pool_subtask_test();
+  run_pool_create_free_test();
+  return 0;
+}
@@ -43,6 +43,12 @@ void thread_local_init9(ThreadLocal9 *local, void (*destroy)(void *)) {
   }
 }
 
+void thread_local_free9(ThreadLocal9 *local) {
+  if (pthread_key_delete(*local) != 0) {
+    abort();
+  }
+}
+
 void *thread_local_get9(ThreadLocal9 *local) {
   return pthread_getspecific(*local);
 }
@@ -17,6 +17,7 @@ void thread_join9(Thread9 *thrd);
 void do_once9(Once9 *once, void (*fun)());
 
 void thread_local_init9(ThreadLocal9 *local, void (*destroy)(void *));
+void thread_local_free9(ThreadLocal9 *local);
 void *thread_local_get9(ThreadLocal9 *local);
 void thread_local_set9(ThreadLocal9 *local, void *val);
 
@@ -0,0 +1,76 @@
+#include "triple.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+enum {
+  // The low bits of pending are the index of the pending buffer,
+  // and this bit is set if it was published since the reader's last swap.
+  PENDING_FRESH = 1 << 2,
+  PENDING_INDEX = PENDING_FRESH - 1,
+
+  // The writer and reader fields are on separate cache lines,
+  // so the two threads do not contend for them.
+  CACHE_LINE_SIZE = 64,
+};
+
+struct triple9 {
+  uint8_t *bufs[3];
+
+  alignas(CACHE_LINE_SIZE) atomic_uint pending;
+
+  // Owned by the writer.
+  alignas(CACHE_LINE_SIZE) int write;
+
+  // Owned by the reader.
+  alignas(CACHE_LINE_SIZE) int read;
+};
+
+Triple9 *triple_create9(int size) {
+  Triple9 *t = aligned_alloc(CACHE_LINE_SIZE, sizeof(Triple9));
+  if (t == NULL) {
+    abort();
+  }
+  *t = (Triple9){.write = 0, .pending = 1, .read = 2};
+  for (int i = 0; i < 3; i++) {
+    t->bufs[i] = calloc(size, 1);
+    if (t->bufs[i] == NULL) {
+      abort();
+    }
+  }
+  return t;
+}
+
+void triple_free9(Triple9 *t) {
+  for (int i = 0; i < 3; i++) {
+    free(t->bufs[i]);
+  }
+  free(t);
+}
+
+void *triple_write_buf9(Triple9 *t) { return t->bufs[t->write]; }
+
+void *triple_publish9(Triple9 *t) {
+  // Release the writes to the buffer to the reader's acquire,
+  // and acquire the reader's last reads of the buffer taken back.
+  unsigned old = atomic_exchange_explicit(
+      &t->pending, t->write | PENDING_FRESH, memory_order_acq_rel);
+  t->write = old & PENDING_INDEX;
+  return t->bufs[t->write];
+}
+
+const void *triple_read9(Triple9 *t, bool *fresh) {
+  bool f =
+      atomic_load_explicit(&t->pending, memory_order_relaxed) & PENDING_FRESH;
+  if (f) {
+    unsigned old =
+        atomic_exchange_explicit(&t->pending, t->read, memory_order_acq_rel);
+    t->read = old & PENDING_INDEX;
+  }
+  if (fresh != NULL) {
+    *fresh = f;
+  }
+  return t->bufs[t->read];
+}
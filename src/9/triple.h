@@ -0,0 +1,35 @@
+#ifndef _TRIPLE_H_
+#define _TRIPLE_H_
+
+// A triple buffer passes the latest of a stream of values
+// from one writer thread to one reader thread without locking.
+//
+// The writer fills its own buffer and publishes it,
+// swapping it with a third, pending buffer.
+// The reader swaps its own buffer with the pending one
+// if one was published since it last read.
+// Neither ever waits on the other;
+// values published faster than the reader reads are dropped.
+typedef struct triple9 Triple9;
+
+// Returns a new triple buffer of zeroed buffers of size bytes.
+Triple9 *triple_create9(int size);
+
+// Frees the triple buffer.
+void triple_free9(Triple9 *t);
+
+// Returns the buffer owned by the writer, to be filled before publishing.
+void *triple_write_buf9(Triple9 *t);
+
+// Publishes the writer's buffer as the latest value,
+// and returns the writer's new buffer.
+// The contents of the new buffer are those of an older value.
+void *triple_publish9(Triple9 *t);
+
+// Returns the latest published value, or zeros if none was published.
+// The buffer belongs to the reader until its next call to triple_read9.
+// Sets *fresh, if it is not NULL,
+// to whether the value was published since the last read.
+const void *triple_read9(Triple9 *t, bool *fresh);
+
+#endif // _TRIPLE_H_
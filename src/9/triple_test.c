@@ -0,0 +1,71 @@
+#include "thread.h"
+#include "triple.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fprintf(stderr, __VA_ARGS__);                                              \
+    abort();                                                                   \
+  } while (0)
+
+enum {
+  NUM_VALUES = 100000,
+  VALUE_WORDS = 64,
+};
+
+// Publishes values 1 through NUM_VALUES,
+// each filling a buffer of VALUE_WORDS ints.
+static void write_values(void *arg) {
+  Triple9 *t = arg;
+  int *buf = triple_write_buf9(t);
+  for (int i = 1; i <= NUM_VALUES; i++) {
+    for (int j = 0; j < VALUE_WORDS; j++) {
+      buf[j] = i;
+    }
+    buf = triple_publish9(t);
+  }
+}
+
+static void run_triple_test() {
+  Triple9 *t = triple_create9(VALUE_WORDS * sizeof(int));
+  bool fresh = true;
+  const int *buf = triple_read9(t, &fresh);
+  if (fresh || buf[0] != 0) {
+    FAIL("read %d (fresh=%d) before any publish, wanted 0 (fresh=0)\n",
+         buf[0], fresh);
+  }
+
+  Thread9 writer;
+  thread_create9(&writer, write_values, t);
+  int last = 0;
+  long reads = 0;
+  while (last < NUM_VALUES) {
+    buf = triple_read9(t, &fresh);
+    reads++;
+    for (int j = 0; j < VALUE_WORDS; j++) {
+      if (buf[j] != buf[0]) {
+        FAIL("read torn value: word %d is %d, word 0 is %d\n", j, buf[j],
+             buf[0]);
+      }
+    }
+    if (fresh ? buf[0] <= last : buf[0] != last) {
+      FAIL("read %d (fresh=%d) after %d\n", buf[0], fresh, last);
+    }
+    last = buf[0];
+  }
+  thread_join9(&writer);
+  buf = triple_read9(t, &fresh);
+  if (fresh || buf[0] != NUM_VALUES) {
+    FAIL("read %d (fresh=%d) after the last publish, wanted %d (fresh=0)\n",
+         buf[0], fresh, NUM_VALUES);
+  }
+  triple_free9(t);
+}
+
+int main() {
+  run_triple_test();
+  return 0;
+}
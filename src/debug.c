@@ -1,6 +1,7 @@
 #include "9/acme.h"
 #include "9/errstr.h"
 #include "9/thread.h"
+#include "9/triple.h"
 #include "buf/buffer.h"
 #include "gb/gameboy.h"
 #include "time_ns.h"
@@ -11,6 +12,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -28,23 +30,59 @@ enum {
 
   ACME_FRAME_HZ = 30,
   VBLANK_HZ = 60,
+
+  // The default seconds of history held for rewinding,
+  // and frames from one rewind keyframe to the next.
+  REWIND_SECONDS = 60,
+  REWIND_KEY_FRAMES = 60,
 };
 static const double NS_PER_S = 1e9;
 static const double ACME_FRAME_NS = NS_PER_S / ACME_FRAME_HZ;
 static const double VBLANK_NS = NS_PER_S / VBLANK_HZ;
+static const double SAVE_SYNC_NS = 5 * NS_PER_S;
 static const uint16_t HALT = 0x76;
 
 // Flags.
 static bool enable_trap = true;
 static bool acme_video = false;
+static bool save_sync = false;
+static int rewind_seconds = REWIND_SECONDS;
+static int rewind_key_frames = REWIND_KEY_FRAMES;
+static const char *record_path = NULL;
+static const char *replay_path = NULL;
+
+// The emulation speed as a multiple of real time, or 0 for uncapped.
+// Set by the -speed flag and speed command,
+// and toggled to and from fast_speed by the fast-forward key.
+static atomic_int speed = 1;
+// The last speed other than 1x, toggled to by the fast-forward key.
+static atomic_int fast_speed = 0;
 
 static Mutex9 mtx;
+// Held by the Gameboy thread, except while it waits at the prompt,
+// so that another thread can exit without stopping it mid-instruction.
+static Mutex9 run_mtx;
+static Thread9 gameboy_thread;
+// Set to have the Gameboy thread exit at its next instruction boundary.
+static atomic_bool quitting;
+// Whether the Gameboy thread is waiting at the prompt.
+// Written and read only by the Gameboy thread, and its signal handler.
+static volatile sig_atomic_t at_prompt;
 static Gameboy g;
+static GameboyStats stats;
+// The profile of the guest code, if started with the profile command.
+static Profile profile;
+// A snapshot of each frame, if rewind_seconds > 0.
+static Rewind rewind_history;
+// The joypad inputs being recorded to record_path,
+// or replayed from replay_path.
+// Used by the Gameboy thread, or by a thread exiting with run_mtx.
+static Movie movie;
 static Acme *acme = NULL;
 
-// The LCD at the last transition to VBLANK.
-// Guarded by mtx;
-uint8_t lcd[SCREEN_HEIGHT][SCREEN_WIDTH];
+// The LCD at each transition to VBLANK,
+// written by the Gameboy thread and read by the display thread.
+static Triple9 *frames;
 static AcmeWin *lcd_win = NULL;
 
 typedef struct {
@@ -64,19 +102,36 @@ static int breaks[MAX_BREAKS];
 
 static sig_atomic_t go = false;
 
-// Guarded by mtx;
+// The joypad inputs held, set by the input threads
+// and copied to the Gameboy before each mcycle.
+// The low byte is Gameboy.buttons, and the high byte is Gameboy.dpad.
+static atomic_uint input;
+
 enum { BUTTON_TIME = 100000 };
-static int button_count;
+static atomic_int button_count;
 
 // Maximum size of an input line.
 enum { LINE_MAX = 128 };
 
+// Exits the debugger from a thread other than the Gameboy thread.
+// If the Gameboy thread is running,
+// it exits at the next instruction boundary.
+// If it is waiting at the prompt, this thread exits.
+static void quit() {
+  atomic_store(&quitting, true);
+  mutex_lock9(&run_mtx);
+  exit(0);
+}
+
 void sigint_handler(int s) {
   if (go) {
     printf("\n");
     go = false;
+  } else if (pthread_equal(pthread_self(), gameboy_thread) && !at_prompt) {
+    // The Gameboy thread holds run_mtx.
+    atomic_store(&quitting, true);
   } else {
-    exit(0);
+    quit();
   }
 }
 
@@ -91,9 +146,12 @@ static int find_disasm_line(uint16_t addr) {
 }
 
 static void update_disasm_lines() {
+  // The mapped ROM banks are not in g.mem.
+  static Mem mem;
+  gameboy_mem_view(&g, mem);
   int s;
   for (s = 0; s < MEM_SIZE; s++) {
-    if (disasm_mem[s] != g.mem[s]) {
+    if (disasm_mem[s] != mem[s]) {
       break;
     }
   }
@@ -107,12 +165,12 @@ static void update_disasm_lines() {
 
   int e;
   for (e = MEM_SIZE - 1; e >= 0; e--) {
-    if (disasm_mem[e] != g.mem[e]) {
+    if (disasm_mem[e] != mem[e]) {
       break;
     }
   }
   e++; // make e exclusive.
-  memcpy(disasm_mem + s, g.mem + s, e - s);
+  memcpy(disasm_mem + s, mem + s, e - s);
   int eline = find_disasm_line(e);
 
   // We cannot have more than one line per byte of memory,
@@ -304,7 +362,9 @@ static void print_current_instruction() {
   // IR has already been fetched into PC, so we go back one,
   // except for HALT, which doesn't increment PC.
   Addr pc = g.cpu.ir == HALT ? g.cpu.pc : g.cpu.pc - 1;
-  Disasm disasm = disassemble(g.mem, MEM_SIZE, pc);
+  static Mem mem;
+  gameboy_mem_view(&g, mem);
+  Disasm disasm = disassemble(mem, MEM_SIZE, pc);
   printf("%s\n", disasm.full);
 }
 
@@ -387,7 +447,7 @@ static void do_peek(const char *arg_in) {
 
   for (const MemName *n = mem_names; n->name != NULL; n++) {
     if (strcmp(arg, n->name) == 0) {
-      uint8_t x = g.mem[n->addr];
+      uint8_t x = gameboy_peek(&g, n->addr);
       printf("%s ($%04X): %d ($%02X)\n", n->name, n->addr, x, x);
       return;
     }
@@ -412,7 +472,7 @@ static void do_peek(const char *arg_in) {
            addr);
     return;
   }
-  uint8_t x = g.mem[addr];
+  uint8_t x = gameboy_peek(&g, addr);
   for (const MemName *n = mem_names; n->name != NULL; n++) {
     if (n->addr == addr) {
       printf("%s ($%04X): %d ($%02X)\n", n->name, n->addr, x, x);
@@ -438,6 +498,12 @@ static const char *px_str(int px) {
   return ""; // impossible
 }
 
+// Holds down the inputs of mask for BUTTON_TIME mcycles.
+static void press(unsigned mask) {
+  atomic_fetch_or_explicit(&input, mask, memory_order_relaxed);
+  atomic_store_explicit(&button_count, BUTTON_TIME, memory_order_relaxed);
+}
+
 static void acme_event_thread(void *unused) {
   if (!win_start_events(lcd_win)) {
     fprintf(stderr, "failed to start events: %s\n", errstr9());
@@ -450,59 +516,46 @@ static void acme_event_thread(void *unused) {
       break;
     }
     if (event->type == 'x') {
-      mutex_lock9(&mtx);
       if (strcmp(event->data, "Up") == 0) {
-        g.dpad |= BUTTON_UP;
-        button_count = BUTTON_TIME;
+        press(BUTTON_UP << 8);
       } else if (strcmp(event->data, "Down") == 0) {
-        g.dpad |= BUTTON_DOWN;
-        button_count = BUTTON_TIME;
+        press(BUTTON_DOWN << 8);
       } else if (strcmp(event->data, "Left") == 0) {
-        g.dpad |= BUTTON_LEFT;
-        button_count = BUTTON_TIME;
+        press(BUTTON_LEFT << 8);
       } else if (strcmp(event->data, "Right") == 0) {
-        g.dpad |= BUTTON_RIGHT;
-        button_count = BUTTON_TIME;
+        press(BUTTON_RIGHT << 8);
       } else if (strcmp(event->data, "AButton") == 0) {
-        g.buttons |= BUTTON_A;
-        button_count = BUTTON_TIME;
+        press(BUTTON_A);
       } else if (strcmp(event->data, "BButton") == 0) {
-        g.buttons |= BUTTON_B;
-        button_count = BUTTON_TIME;
+        press(BUTTON_B);
       } else if (strcmp(event->data, "Start") == 0) {
-        g.buttons |= BUTTON_START;
-        button_count = BUTTON_TIME;
+        press(BUTTON_START);
       } else if (strcmp(event->data, "Select") == 0) {
-        g.buttons |= BUTTON_SELECT;
-        button_count = BUTTON_TIME;
+        press(BUTTON_SELECT);
       } else if (strcmp(event->data, "Break") == 0) {
         go = false;
       } else if (strcmp(event->data, "Del") == 0 ||
                  strcmp(event->data, "Delete") == 0) {
         free(event);
-        mutex_unlock9(&mtx);
         break;
       } else {
         win_write_event(lcd_win, event);
       }
-      mutex_unlock9(&mtx);
     } else if (event->type == 'X' || event->type == 'l' || event->type == 'L' ||
                event->type == 'r' || event->type == 'R') {
       win_write_event(lcd_win, event);
     }
     free(event);
   }
-  exit(0);
+  quit();
 }
 
 static void check_button_count() {
-  if (button_count == 0) {
+  if (atomic_load_explicit(&button_count, memory_order_relaxed) == 0) {
     return;
   }
-  button_count--;
-  if (button_count == 0) {
-    g.buttons = 0;
-    g.dpad = 0;
+  if (atomic_fetch_sub_explicit(&button_count, 1, memory_order_relaxed) == 1) {
+    atomic_store_explicit(&input, 0, memory_order_relaxed);
   }
 }
 
@@ -543,14 +596,12 @@ static void do_tile(int tile_index) {
   }
   bprintf(&b, "\n");
   bprintf(&b, "+--------+\n");
+  uint8_t px[8][8];
+  decode_tile_rows(&g.mem[addr], 8, PALLET_IDENTITY, px[0]);
   for (int y = 0; y < 8; y++) {
     bprintf(&b, "|");
-    uint8_t row_low = g.mem[addr++];
-    uint8_t row_high = g.mem[addr++];
     for (int x = 0; x < 8; x++) {
-      uint8_t px_low = row_low >> (7 - x) & 1;
-      uint8_t px_high = row_high >> (7 - x) & 1;
-      bprintf(&b, "%s", px_str(px_high << 1 | px_low));
+      bprintf(&b, "%s", px_str(px[y][x]));
     }
     bprintf(&b, "|\n");
   }
@@ -578,12 +629,10 @@ static void do_tilemap() {
           continue;
         }
         uint16_t addr = MEM_TILE_BLOCK0_START + tile * 16;
-        uint8_t row_low = g.mem[addr + y * 2];
-        uint8_t row_high = g.mem[addr + y * 2 + 1];
+        uint8_t px[8];
+        decode_tile_rows(&g.mem[addr + y * 2], 1, PALLET_IDENTITY, px);
         for (int x = 0; x < 8; x++) {
-          uint8_t px_low = row_low >> (7 - x) & 1;
-          uint8_t px_high = row_high >> (7 - x) & 1;
-          bprintf(&b, "%s", px_str(px_high << 1 | px_low));
+          bprintf(&b, "%s", px_str(px[x]));
         }
         bprintf(&b, "|");
         tile++;
@@ -613,12 +662,10 @@ static void do_bgmap(int map_index) {
       for (int map_x = 0; map_x < 32; map_x++) {
         int tile = g.mem[map_addr + (32 * map_y) + map_x];
         uint16_t addr = MEM_TILE_BLOCK0_START + tile * 16;
-        uint8_t row_low = g.mem[addr + y * 2];
-        uint8_t row_high = g.mem[addr + y * 2 + 1];
+        uint8_t px[8];
+        decode_tile_rows(&g.mem[addr + y * 2], 1, PALLET_IDENTITY, px);
         for (int x = 0; x < 8; x++) {
-          uint8_t px_low = row_low >> (7 - x) & 1;
-          uint8_t px_high = row_high >> (7 - x) & 1;
-          bprintf(&b, "%s", px_str(px_high << 1 | px_low));
+          bprintf(&b, "%s", px_str(px[x]));
         }
       }
       bprintf(&b, "\n");
@@ -661,9 +708,11 @@ static void acme_draw_thread(void *unused) {
     }
     last = monoclock_time_ns();
 
-    mutex_lock9(&mtx);
-    memcpy(latest, lcd, sizeof(lcd));
-    mutex_unlock9(&mtx);
+    bool fresh = false;
+    memcpy(latest, triple_read9(frames, &fresh), sizeof(latest));
+    if (!fresh && !first) {
+      continue;
+    }
 
     int start_y;
     int end_y;
@@ -707,9 +756,8 @@ static void acme_draw_thread(void *unused) {
 }
 
 static void draw_lcd() {
-  mutex_lock9(&mtx);
-  memcpy(lcd, g.lcd, sizeof(lcd));
-  mutex_unlock9(&mtx);
+  memcpy(triple_write_buf9(frames), g.lcd, sizeof(g.lcd));
+  triple_publish9(frames);
 }
 
 static void close_lcd_win() { win_fmt_ctl(lcd_win, "delete"); }
@@ -765,6 +813,35 @@ static int sdl_keycode_to_dir(SDL_Keycode key) {
   }
 }
 
+// Prints the emulation speed s.
+static void print_speed(int s) {
+  if (s == 0) {
+    printf("Speed: uncapped\n");
+  } else {
+    printf("Speed: %dx\n", s);
+  }
+}
+
+// Sets the emulation speed to s, which must be non-negative.
+static void set_speed(int s) {
+  atomic_store_explicit(&speed, s, memory_order_relaxed);
+  if (s != 1) {
+    atomic_store_explicit(&fast_speed, s, memory_order_relaxed);
+  }
+}
+
+// Toggles between 1x and the last faster speed.
+static void toggle_fast_forward() {
+  int s = atomic_load_explicit(&speed, memory_order_relaxed);
+  if (s == 1) {
+    s = atomic_load_explicit(&fast_speed, memory_order_relaxed);
+  } else {
+    s = 1;
+  }
+  atomic_store_explicit(&speed, s, memory_order_relaxed);
+  print_speed(s);
+}
+
 static void sdl_poll_event() {
   SDL_Event event = {};
   if (!SDL_PollEvent(&event)) {
@@ -772,39 +849,92 @@ static void sdl_poll_event() {
   }
   switch (event.type) {
   case SDL_EVENT_WINDOW_CLOSE_REQUESTED:
-    exit(0);
+    quit();
   case SDL_EVENT_KEY_DOWN:
   case SDL_EVENT_KEY_UP:
     SDL_KeyboardEvent *key_event = (SDL_KeyboardEvent *)&event;
-    mutex_lock9(&mtx);
+    if (key_event->key == SDLK_SPACE) {
+      if (event.type == SDL_EVENT_KEY_DOWN && !key_event->repeat) {
+        toggle_fast_forward();
+      }
+      break;
+    }
+    unsigned mask = 0;
     int button = sdl_keycode_to_button(key_event->key);
     if (button >= 0) {
-      if (event.type == SDL_EVENT_KEY_DOWN) {
-        g.buttons |= button;
-      } else {
-        g.buttons &= ~button;
-      }
+      mask |= button;
     }
     int dir = sdl_keycode_to_dir(key_event->key);
     if (dir >= 0) {
-      if (event.type == SDL_EVENT_KEY_DOWN) {
-        g.dpad |= dir;
-      } else {
-        g.dpad &= ~dir;
-      }
+      mask |= dir << 8;
+    }
+    if (event.type == SDL_EVENT_KEY_DOWN) {
+      atomic_fetch_or_explicit(&input, mask, memory_order_relaxed);
+    } else {
+      atomic_fetch_and_explicit(&input, ~mask, memory_order_relaxed);
     }
-    mutex_unlock9(&mtx);
     break;
   }
 }
 
+enum {
+  // Buckets of the presentation time histogram.
+  // Bucket i counts times under 2^i µs; the last counts the rest.
+  PRESENT_BUCKETS = 16,
+};
+
+// The number of frames presented to SDL
+// by the time taken to present them; see PRESENT_BUCKETS.
+// Guarded by mtx.
+static long present_hist[PRESENT_BUCKETS];
+
+static void record_present_ns(double ns) {
+  int i = 0;
+  while (i < PRESENT_BUCKETS - 1 && ns >= (1000L << i)) {
+    i++;
+  }
+  mutex_lock9(&mtx);
+  present_hist[i]++;
+  mutex_unlock9(&mtx);
+}
+
+// Copies l to texture through colors, then draws it to fill the window.
+static void present_lcd(SDL_Renderer *renderer, SDL_Texture *texture,
+                        const uint32_t colors[4],
+                        const uint8_t l[SCREEN_HEIGHT][SCREEN_WIDTH]) {
+  void *pixels = NULL;
+  int pitch = 0;
+  if (!SDL_LockTexture(texture, NULL, &pixels, &pitch)) {
+    fail("failed to lock SDL texture: %s", SDL_GetError());
+  }
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    uint32_t *row = (uint32_t *)((uint8_t *)pixels + y * pitch);
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      row[x] = colors[l[y][x]];
+    }
+  }
+  SDL_UnlockTexture(texture);
+  SDL_RenderTexture(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+}
+
 static void run_sdl(SDL_Window *sdl_win) {
   SDL_Renderer *renderer = SDL_CreateRenderer(sdl_win, NULL);
-  static uint8_t l[SCREEN_HEIGHT][SCREEN_WIDTH] = {};
-  SDL_FRect rect = {
-      .w = SDL_SCREEN_SCALE,
-      .h = SDL_SCREEN_SCALE,
-  };
+  if (renderer == NULL) {
+    fail("failed to create SDL renderer: %s", SDL_GetError());
+  }
+  SDL_Texture *texture = SDL_CreateTexture(
+      renderer, SDL_PIXELFORMAT_XRGB8888, SDL_TEXTUREACCESS_STREAMING,
+      SCREEN_WIDTH, SCREEN_HEIGHT);
+  if (texture == NULL) {
+    fail("failed to create SDL texture: %s", SDL_GetError());
+  }
+  SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+  uint32_t colors[4];
+  for (int i = 0; i < 4; i++) {
+    uint8_t c = (255 / 4) * (4 - i);
+    colors[i] = c << 16 | c << 8 | c;
+  }
   double last = monoclock_time_ns();
   for (;;) {
     sdl_poll_event();
@@ -815,23 +945,43 @@ static void run_sdl(SDL_Window *sdl_win) {
     }
     last = monoclock_time_ns();
 
-    mutex_lock9(&mtx);
-    memcpy(l, lcd, sizeof(lcd));
-    mutex_unlock9(&mtx);
+    const uint8_t(*l)[SCREEN_WIDTH] = triple_read9(frames, NULL);
+    double start = monoclock_time_ns();
+    present_lcd(renderer, texture, colors, l);
+    record_present_ns(monoclock_time_ns() - start);
+  }
+}
 
-    for (int y = 0; y < SCREEN_HEIGHT; y++) {
-      for (int x = 0; x < SCREEN_WIDTH; x++) {
-        rect.x = x * SDL_SCREEN_SCALE;
-        rect.y = y * SDL_SCREEN_SCALE;
-        uint8_t c = (255 / 4) * (4 - l[y][x]);
-        SDL_SetRenderDrawColor(renderer, c, c, c, 0xFF);
-        SDL_RenderFillRect(renderer, &rect);
-      }
+static void do_present() {
+  long hist[PRESENT_BUCKETS];
+  mutex_lock9(&mtx);
+  memcpy(hist, present_hist, sizeof(hist));
+  mutex_unlock9(&mtx);
+  long n = 0;
+  for (int i = 0; i < PRESENT_BUCKETS; i++) {
+    n += hist[i];
+  }
+  printf("Presentation time of %ld frames:\n", n);
+  for (int i = 0; i < PRESENT_BUCKETS; i++) {
+    if (hist[i] == 0) {
+      continue;
+    }
+    if (i < PRESENT_BUCKETS - 1) {
+      printf("\t< %6ld µs: ", 1L << i);
+    } else {
+      printf("\t≥ %6ld µs: ", 1L << (i - 1));
     }
-    SDL_RenderPresent(renderer);
+    printf("%ld (%.1f%%)\n", hist[i], 100.0 * hist[i] / n);
   }
 }
 
+// Copies the joypad inputs held to the Gameboy.
+static void set_input() {
+  unsigned in = atomic_load_explicit(&input, memory_order_relaxed);
+  g.buttons = in & 0xFF;
+  g.dpad = in >> 8;
+}
+
 static void do_step(int n) {
   if (n < 0) {
     printf("step argument must be positive\n");
@@ -841,6 +991,70 @@ static void do_step(int n) {
   go = true;
 }
 
+static void do_back(int n) {
+  if (rewind_seconds <= 0) {
+    printf("rewind is disabled\n");
+    return;
+  }
+  bool ok = rewind_back(&rewind_history, &g, n);
+  // Keep the buttons that are held now.
+  set_input();
+  if (ok && record_path != NULL) {
+    movie_truncate(&movie, &g);
+  }
+  if (!ok) {
+    printf("back argument must be in the range 0-%d\n",
+           rewind_history.n - 1);
+    return;
+  }
+  draw_lcd();
+}
+
+static void do_speed(int s) {
+  if (s < 0) {
+    printf("speed argument must be 0 (uncapped) or more\n");
+    return;
+  }
+  set_speed(s);
+  print_speed(s);
+}
+
+static void do_stats() {
+  char *report = stats_report(&stats);
+  printf("%s", report);
+  free(report);
+}
+
+static void do_profile(const char *arg) {
+  enum { PROFILE_LINES = 20 };
+  if (strcmp(arg, "start") == 0) {
+    free_profile(&profile);
+    profile = init_profile(&g);
+    stats.profile = &profile;
+    printf("Profiling\n");
+  } else if (strcmp(arg, "stop") == 0) {
+    stats.profile = NULL;
+    printf("Stopped profiling\n");
+  } else if (profile.nodes == NULL) {
+    printf("No profile; use profile start\n");
+  } else if (strcmp(arg, "") == 0) {
+    char *report = profile_report(&profile, &g, PROFILE_LINES);
+    printf("%s", report);
+    free(report);
+  } else {
+    write_profile_stacks(&profile, arg);
+    printf("Wrote folded stacks to %s\n", arg);
+  }
+}
+
+static void do_rewind() {
+  const Rewind *r = &rewind_history;
+  printf("Rewind: %d of %d frames, keyframe every %d frames\n", r->n,
+         r->max_frames, r->key_interval);
+  printf("Memory: %.1f KiB, %.1f KiB per minute\n", r->bytes / 1024.0,
+         rewind_bytes_per_minute(r) / 1024.0);
+}
+
 static void check_step() {
   if (step == 0) {
     return;
@@ -910,7 +1124,12 @@ static void check_cpu_trap() {
 static bool handle_input_line() {
   char line[LINE_MAX];
   printf("> ");
-  if (fgets(line, sizeof(line), stdin) == NULL) {
+  at_prompt = true;
+  mutex_unlock9(&run_mtx);
+  char *s = fgets(line, sizeof(line), stdin);
+  mutex_lock9(&run_mtx);
+  at_prompt = false;
+  if (s == NULL) {
     fail("error reading stdin");
   }
   // If the line is just \n, then break the read loop and step.
@@ -938,6 +1157,22 @@ static bool handle_input_line() {
     do_dump();
   } else if (sscanf(line, "step %d", &arg_d) == 1) {
     do_step(arg_d);
+  } else if (sscanf(line, "back %d", &arg_d) == 1) {
+    do_back(arg_d);
+  } else if (strcmp(line, "rewind") == 0) {
+    do_rewind();
+  } else if (sscanf(line, "speed %d", &arg_d) == 1) {
+    do_speed(arg_d);
+  } else if (strcmp(line, "speed") == 0) {
+    print_speed(atomic_load_explicit(&speed, memory_order_relaxed));
+  } else if (strcmp(line, "stats") == 0) {
+    do_stats();
+  } else if (sscanf(line, "profile %s", arg_s) == 1) {
+    do_profile(arg_s);
+  } else if (strcmp(line, "profile") == 0) {
+    do_profile("");
+  } else if (strcmp(line, "present") == 0) {
+    do_present();
   } else if (strcmp(line, "next") == 0) {
     do_next();
   } else if (sscanf(line, "break $%x", &arg_d) == 1) {
@@ -954,7 +1189,28 @@ static bool handle_input_line() {
 
 static void print_exiting() { printf("exiting\n"); }
 
+static void flush_save() { sync_save_file(&g); }
+
+// Called at exit from the Gameboy thread at an instruction boundary,
+// or from another thread holding run_mtx.
+static void write_recording() {
+  movie_end(&movie, &g);
+  write_movie(&movie, record_path);
+  printf("Recorded %d inputs to %s\n", movie.n, record_path);
+}
+
+// Periodically writes back the save file,
+// so that less is lost if the debugger crashes.
+static void run_save_sync(void *arg) {
+  for (;;) {
+    sleep_ns(SAVE_SYNC_NS);
+    sync_save_file(&g);
+  }
+}
+
 static void run_gameboy(const char *rom_name) {
+  gameboy_thread = pthread_self();
+  mutex_lock9(&run_mtx);
   Rom rom = read_rom(rom_name);
   printf("Loaded ROM file %s\n", rom_name);
   printf("File Size: %d bytes\n", rom.size);
@@ -964,49 +1220,86 @@ static void run_gameboy(const char *rom_name) {
   printf("ROM banks: %d\n", rom.num_rom_banks);
   printf("RAM size: %d\n", rom.ram_size);
   g = init_gameboy(&rom);
+  g.stats = &stats;
+  // A movie starts from power on with zeroed external RAM,
+  // so that it can be replayed without the save file.
+  bool movie_mode = record_path != NULL || replay_path != NULL;
+  if (!movie_mode && cart_has_battery(rom.cart_type) && rom.ram_size > 0) {
+    char *path = save_file_path(rom_name);
+    map_save_file(&g, path);
+    printf("Save file: %s\n", path);
+    free(path);
+    atexit(flush_save);
+    if (save_sync) {
+      static Thread9 save_thread;
+      thread_create9(&save_thread, run_save_sync, NULL);
+    }
+  }
+  if (record_path != NULL) {
+    movie = init_movie(&g);
+    atexit(write_recording);
+  } else if (replay_path != NULL) {
+    movie = read_movie(replay_path);
+    if (state_hash(&g) != movie.start_hash) {
+      printf("Movie %s starts from a different state\n", replay_path);
+    }
+  }
+  if (rewind_seconds > 0) {
+    rewind_history =
+        init_rewind(&g, rewind_seconds * VBLANK_HZ, rewind_key_frames);
+  }
 
   double last_vblank = monoclock_time_ns();
-  long num_mcycle = 0;
-  double mcycle_ns_avg = 0;
+  // The start of the current frame, less time stopped at the prompt.
+  double frame_start = last_vblank;
+  long go_mcycles = 0;
   for (;;) {
+    if (atomic_load(&quitting)) {
+      exit(0);
+    }
     if (!go && (g.cpu.state == DONE || g.cpu.state == HALTED)) {
-      if (num_mcycle > 0) {
-        printf("num mcycles: %ld\navg time: %lf ns\n", num_mcycle,
-               mcycle_ns_avg);
-        num_mcycle = 0;
+      if (stats.mcycles > go_mcycles) {
+        printf("num mcycles: %ld\n", stats.mcycles - go_mcycles);
       }
       update_disasm_win();
       print_current_instruction();
+      double stop = monoclock_time_ns();
       while (!go && handle_input_line()) {
       }
+      frame_start += monoclock_time_ns() - stop;
+      go_mcycles = stats.mcycles;
     }
 
     PpuMode prev_ppu_mode = ppu_mode(&g);
-    double start_ns = monoclock_time_ns();
-    mutex_lock9(&mtx);
+    set_input();
+    if (record_path != NULL) {
+      movie_record(&movie, &g);
+    } else if (replay_path != NULL) {
+      movie_play(&movie, &g);
+    }
     mcycle(&g);
     if (acme_video) {
       check_button_count();
     }
-    mutex_unlock9(&mtx);
-    long ns = monoclock_time_ns() - start_ns;
 
     if (ppu_mode(&g) == VBLANK && prev_ppu_mode != VBLANK) {
+      if (rewind_seconds > 0) {
+        rewind_record(&rewind_history, &g);
+      }
       draw_lcd();
+      stats_add_frame_ns(&stats, monoclock_time_ns() - frame_start);
+      // The display shows only the latest frame,
+      // so faster speeds skip the frames drawn in between.
+      int s = atomic_load_explicit(&speed, memory_order_relaxed);
       double since = monoclock_time_ns() - last_vblank;
-      if (since < VBLANK_NS) {
-        sleep_ns(VBLANK_NS - since);
+      if (s > 0 && since < VBLANK_NS / s) {
+        sleep_ns(VBLANK_NS / s - since);
       }
       last_vblank = monoclock_time_ns();
+      frame_start = last_vblank;
     }
 
     if (go) {
-      if (num_mcycle == 0) {
-        mcycle_ns_avg = ns;
-      } else {
-        mcycle_ns_avg = mcycle_ns_avg + (ns - mcycle_ns_avg) / (num_mcycle + 1);
-      }
-      num_mcycle++;
       check_step();
       check_next();
       check_break();
@@ -1031,6 +1324,18 @@ int main(int argc, const char *argv[]) {
       enable_trap = false;
     } else if (strcmp(argv[i], "-acme") == 0) {
       acme_video = true;
+    } else if (strcmp(argv[i], "-savesync") == 0) {
+      save_sync = true;
+    } else if (strcmp(argv[i], "-rewind") == 0 && i + 1 < argc) {
+      rewind_seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-rewindkey") == 0 && i + 1 < argc) {
+      rewind_key_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-speed") == 0 && i + 1 < argc) {
+      set_speed(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
     } else if (rom_name == NULL) {
       rom_name = argv[i];
     } else {
@@ -1039,13 +1344,19 @@ int main(int argc, const char *argv[]) {
       break;
     }
   }
-  if (rom_name == NULL) {
-    printf("Usage: debug [-notrap] <rom-file-name>\n");
+  if (rom_name == NULL || record_path != NULL && replay_path != NULL ||
+      speed < 0) {
+    printf("Usage: debug [-notrap] [-acme] [-savesync] [-rewind seconds] "
+           "[-rewindkey frames]\n"
+           "             [-speed n] [-record movie | -replay movie] "
+           "<rom-file-name>\n");
     return 1;
   }
   atexit(print_exiting);
   signal(SIGINT, sigint_handler);
   mutex_init9(&mtx);
+  mutex_init9(&run_mtx);
+  frames = triple_create9(sizeof(g.lcd));
 
   acme = acme_connect();
   if (acme == NULL) {
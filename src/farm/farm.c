@@ -0,0 +1,244 @@
+// Needed for strdup and strtok_r.
+#define _POSIX_C_SOURCE 200809L
+
+#include "farm.h"
+#include "9/pool.h"
+#include "9/thread.h"
+#include "buf/buffer.h"
+#include "gb/gameboy.h"
+#include "time_ns.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+FarmJob *read_farm_jobs(const char *path, int *njobs) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fail("failed to open %s", path);
+  }
+  FarmJob *jobs = NULL;
+  int n = 0, cap = 0;
+  char line[1024];
+  for (int lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++) {
+    char *save = NULL;
+    char *rom = strtok_r(line, " \t\r\n", &save);
+    if (rom == NULL || rom[0] == '#') {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap == 0 ? 16 : cap * 2;
+      jobs = realloc(jobs, cap * sizeof(FarmJob));
+      if (jobs == NULL) {
+        fail("failed to allocate jobs");
+      }
+    }
+    FarmJob *job = &jobs[n++];
+    *job = (FarmJob){.rom_path = strdup(rom)};
+    char *tok = strtok_r(NULL, " \t\r\n", &save);
+    char *end = NULL;
+    job->frames = tok == NULL ? -1 : strtol(tok, &end, 10);
+    if (job->frames < 0 || *end != '\0') {
+      fail("%s:%d: expected a number of frames", path, lineno);
+    }
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      if (strncmp(tok, "input=", 6) == 0) {
+        job->input_path = strdup(tok + 6);
+      } else if (strncmp(tok, "capture=", 8) == 0) {
+        job->capture_frames = strtol(tok + 8, &end, 10);
+        if (job->capture_frames < 0 || *end != '\0') {
+          fail("%s:%d: bad capture %s", path, lineno, tok);
+        }
+      } else {
+        fail("%s:%d: unknown option %s", path, lineno, tok);
+      }
+    }
+  }
+  fclose(f);
+  *njobs = n;
+  return jobs;
+}
+
+void free_farm_jobs(FarmJob *jobs, int njobs) {
+  for (int i = 0; i < njobs; i++) {
+    free((void *)jobs[i].rom_path);
+    free((void *)jobs[i].input_path);
+  }
+  free(jobs);
+}
+
+typedef struct {
+  const FarmJob *jobs;
+  // The Rom for each job, shared by jobs with the same ROM path.
+  const Rom **roms;
+  FarmWorkerStats *workers;
+
+  Mutex9 mtx;
+  // Guarded by mtx.
+  FILE *out;
+  // Guarded by mtx.
+  long frames;
+  // Guarded by mtx.
+  double end_ns;
+} Farm;
+
+typedef struct {
+  Farm *farm;
+  int index;
+} Task;
+
+static void print_capture(Buffer *b, int index, long frame, const Gameboy *g) {
+  static const char hex[] = "0123456789abcdef";
+  enum { NPIXELS = SCREEN_WIDTH * SCREEN_HEIGHT };
+  const uint8_t *lcd = &g->lcd[0][0];
+  char line[NPIXELS / 2 + 1];
+  for (int i = 0; i < NPIXELS; i += 4) {
+    uint8_t x = (lcd[i] & 3) << 6 | (lcd[i + 1] & 3) << 4 |
+                (lcd[i + 2] & 3) << 2 | lcd[i + 3] & 3;
+    line[i / 2] = hex[x >> 4];
+    line[i / 2 + 1] = hex[x & 0xF];
+  }
+  line[NPIXELS / 2] = '\0';
+  bprintf(b, "capture %d %ld %s\n", index, frame, line);
+}
+
+static void print_serial(Buffer *b, int index, const Gameboy *g) {
+  bprintf(b, "serial %d ", index);
+  for (int i = 0; i < g->serial_len; i++) {
+    uint8_t c = g->serial_out[i];
+    if (c == '\\') {
+      bprintf(b, "\\\\");
+    } else if (c == '\n') {
+      bprintf(b, "\\n");
+    } else if (isprint(c)) {
+      bprintf(b, "%c", c);
+    } else {
+      bprintf(b, "\\x%02x", c);
+    }
+  }
+  bprintf(b, "\n");
+}
+
+static void run_job(void *arg, int worker) {
+  Task *task = arg;
+  Farm *farm = task->farm;
+  const FarmJob *job = &farm->jobs[task->index];
+  double start_ns = monoclock_time_ns();
+
+  InputScript script = {};
+  if (job->input_path != NULL) {
+    script = read_input_script(job->input_path);
+  }
+  // Gameboy is large, so keep it off of the worker's stack.
+  Gameboy *g = malloc(sizeof(Gameboy));
+  if (g == NULL) {
+    fail("failed to allocate a Gameboy");
+  }
+  *g = init_gameboy(farm->roms[task->index]);
+  g->engine = ENGINE_INSTRUCTION;
+
+  Buffer captures = {};
+  long mcycles = 0;
+  for (long frame = 0; frame < job->frames; frame++) {
+    apply_input_script(&script, g, frame);
+    mcycles += run_frame(g, LONG_MAX);
+    if (job->capture_frames > 0 && (frame + 1) % job->capture_frames == 0) {
+      print_capture(&captures, task->index, frame + 1, g);
+    }
+  }
+
+  Buffer b = {};
+  bprintf(&b, "job %d %s frames %ld mcycles %ld lcd %016llx state %016llx\n",
+          task->index, job->rom_path, job->frames, mcycles,
+          (unsigned long long)lcd_hash(g), (unsigned long long)state_hash(g));
+  if (captures.size > 0) {
+    bprintf(&b, "%s", captures.data);
+  }
+  if (g->serial_len > 0) {
+    print_serial(&b, task->index, g);
+  }
+  bprintf(&b, "end %d\n", task->index);
+  free(captures.data);
+  free_gameboy(g);
+  free(g);
+  free_input_script(&script);
+
+  double end_ns = monoclock_time_ns();
+  mutex_lock9(&farm->mtx);
+  fwrite(b.data, 1, b.size, farm->out);
+  farm->frames += job->frames;
+  if (end_ns > farm->end_ns) {
+    farm->end_ns = end_ns;
+  }
+  mutex_unlock9(&farm->mtx);
+  free(b.data);
+
+  // Only this worker writes its stats.
+  farm->workers[worker].jobs++;
+  farm->workers[worker].busy_ns += end_ns - start_ns;
+}
+
+FarmStats run_farm(const FarmJob *jobs, int njobs, int nworkers, FILE *out) {
+  Farm farm = {
+      .jobs = jobs,
+      .roms = calloc(njobs, sizeof(Rom *)),
+      .workers = calloc(nworkers, sizeof(FarmWorkerStats)),
+      .out = out,
+  };
+  Task *tasks = calloc(njobs, sizeof(Task));
+  // Distinct ROMs in the order they are first used.
+  Rom *roms = calloc(njobs, sizeof(Rom));
+  if (farm.roms == NULL || farm.workers == NULL || tasks == NULL ||
+      roms == NULL) {
+    fail("failed to allocate farm");
+  }
+  int nroms = 0;
+  for (int i = 0; i < njobs; i++) {
+    for (int j = 0; j < i; j++) {
+      if (strcmp(jobs[i].rom_path, jobs[j].rom_path) == 0) {
+        farm.roms[i] = farm.roms[j];
+        break;
+      }
+    }
+    if (farm.roms[i] == NULL) {
+      roms[nroms] = read_rom(jobs[i].rom_path);
+      farm.roms[i] = &roms[nroms++];
+    }
+  }
+  mutex_init9(&farm.mtx);
+
+  double start_ns = monoclock_time_ns();
+  farm.end_ns = start_ns;
+  Pool9 *pool = pool_create9(nworkers);
+  for (int i = 0; i < njobs; i++) {
+    tasks[i] = (Task){.farm = &farm, .index = i};
+    pool_add9(pool, run_job, &tasks[i]);
+  }
+  pool_wait9(pool);
+  for (int i = 0; i < nworkers; i++) {
+    farm.workers[i].steals = pool_stats9(pool, i).steals;
+  }
+  pool_free9(pool);
+  fflush(out);
+
+  FarmStats stats = {
+      .nworkers = nworkers,
+      .workers = farm.workers,
+      .frames = farm.frames,
+      .wall_ns = farm.end_ns - start_ns,
+  };
+  mutex_destroy9(&farm.mtx);
+  for (int i = 0; i < nroms; i++) {
+    free_rom(&roms[i]);
+  }
+  free(roms);
+  free(tasks);
+  free(farm.roms);
+  return stats;
+}
+
+void free_farm_stats(FarmStats *stats) {
+  free(stats->workers);
+  stats->workers = NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef _FARM_H_
+#define _FARM_H_
+
+#include <stdio.h>
+
+// A run of a ROM, with an optional script of inputs.
+typedef struct {
+  const char *rom_path;
+  // The input script (see read_input_script), or NULL for none.
+  const char *input_path;
+  long frames;
+  // If non-zero, the LCD is captured every capture_frames frames.
+  long capture_frames;
+} FarmJob;
+
+typedef struct {
+  // The number of jobs the worker ran,
+  // and how many of those it stole from another worker.
+  long jobs, steals;
+  // The time the worker spent running jobs.
+  double busy_ns;
+} FarmWorkerStats;
+
+typedef struct {
+  int nworkers;
+  // An array of nworkers stats.
+  FarmWorkerStats *workers;
+  // The total number of frames run by all jobs.
+  long frames;
+  // The time from the start of the first job to the end of the last.
+  double wall_ns;
+} FarmStats;
+
+// Reads jobs from the file at path,
+// and returns an array of them, setting *njobs to its length.
+// Each line is a ROM path, a number of frames,
+// and optionally input=<path> and capture=<frames>, separated by spaces.
+// Blank lines and lines starting with # are ignored.
+// If there is an error, fail() is called.
+// The returned array and its strings are freed with free_farm_jobs.
+FarmJob *read_farm_jobs(const char *path, int *njobs);
+
+void free_farm_jobs(FarmJob *jobs, int njobs);
+
+// Runs each job on a separate Gameboy, using nworkers threads,
+// and writes the results of each job to out as it finishes.
+// Jobs with the same ROM path share the same Rom.
+//
+// The results of a job are written together as lines of text:
+//   job <index> <rom path> frames <frames> mcycles <M cycles>
+//       lcd <hash> state <hash>
+//   capture <index> <frame> <LCD as hex, 2 bits per pixel, 4 per byte>
+//   serial <index> <bytes sent over serial, C escaped>
+//   end <index>
+// The first two lines are a single line in the output.
+// There is a capture line for each capture,
+// and a serial line only if the ROM sent anything.
+//
+// The returned stats must be freed with free_farm_stats.
+FarmStats run_farm(const FarmJob *jobs, int njobs, int nworkers, FILE *out);
+
+void free_farm_stats(FarmStats *stats);
+
+#endif // _FARM_H_
@@ -0,0 +1,129 @@
+// Needed for mkstemp.
+#define _POSIX_C_SOURCE 200809L
+
+#include "farm.h"
+#include "gb/gameboy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+// Sends "Hi" over serial, then loops forever.
+static const uint8_t serial_program[] = {
+    0x3E, 'H',  // LD A, 'H'
+    0xE0, 0x01, // LDH [SB], A
+    0x3E, 0x81, // LD A, $81
+    0xE0, 0x02, // LDH [SC], A
+    0x3E, 'i',  // LD A, 'i'
+    0xE0, 0x01, // LDH [SB], A
+    0x3E, 0x81, // LD A, $81
+    0xE0, 0x02, // LDH [SC], A
+    0x18, 0xFE, // JR -2
+};
+
+// Writes a 2-bank ROM with program at the starting PC to a temporary file,
+// and returns its path, which must be freed by the caller.
+static char *write_temp_rom(const uint8_t *program, int n) {
+  static uint8_t data[2 * ROM_BANK_SIZE];
+  memset(data, 0, sizeof(data));
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, program, n);
+  char *path = strdup("/tmp/farm_test_rom_XXXXXX");
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data)) {
+    FAIL("failed to write temp file");
+  }
+  close(fd);
+  return path;
+}
+
+static void run_farm_test() {
+  enum {
+    NUM_JOBS = 8,
+    NUM_WORKERS = 3,
+    FRAMES = 5,
+    CAPTURE_FRAMES = 2,
+  };
+  const uint8_t loop_program[] = {0x18, 0xFE};
+  char *loop_rom = write_temp_rom(loop_program, sizeof(loop_program));
+  char *serial_rom = write_temp_rom(serial_program, sizeof(serial_program));
+  FarmJob jobs[NUM_JOBS];
+  for (int i = 0; i < NUM_JOBS; i++) {
+    jobs[i] = (FarmJob){
+        .rom_path = i % 2 == 0 ? loop_rom : serial_rom,
+        .frames = FRAMES,
+        .capture_frames = CAPTURE_FRAMES,
+    };
+  }
+  FILE *out = tmpfile();
+  FarmStats stats = run_farm(jobs, NUM_JOBS, NUM_WORKERS, out);
+  if (stats.frames != NUM_JOBS * FRAMES) {
+    FAIL("ran %ld frames, wanted %d", stats.frames, NUM_JOBS * FRAMES);
+  }
+  long njobs = 0;
+  for (int i = 0; i < stats.nworkers; i++) {
+    njobs += stats.workers[i].jobs;
+  }
+  if (njobs != NUM_JOBS) {
+    FAIL("workers ran %ld jobs, wanted %d", njobs, NUM_JOBS);
+  }
+
+  rewind(out);
+  unsigned long long state[NUM_JOBS] = {};
+  int captures[NUM_JOBS] = {};
+  bool serial[NUM_JOBS] = {};
+  bool ended[NUM_JOBS] = {};
+  static char line[2 * SCREEN_WIDTH * SCREEN_HEIGHT];
+  while (fgets(line, sizeof(line), out) != NULL) {
+    int i = 0;
+    unsigned long long lcd = 0, st = 0;
+    char text[16];
+    if (sscanf(line, "job %d %*s frames %*d mcycles %*d lcd %llx state %llx", &i,
+               &lcd, &st) == 3) {
+      state[i] = st;
+    } else if (sscanf(line, "capture %d", &i) == 1) {
+      captures[i]++;
+    } else if (sscanf(line, "serial %d %15s", &i, text) == 2) {
+      serial[i] = strcmp(text, "Hi") == 0;
+    } else if (sscanf(line, "end %d", &i) == 1) {
+      ended[i] = true;
+    } else {
+      FAIL("unexpected line: %s", line);
+    }
+  }
+  for (int i = 0; i < NUM_JOBS; i++) {
+    if (!ended[i]) {
+      FAIL("job %d did not end", i);
+    }
+    if (captures[i] != FRAMES / CAPTURE_FRAMES) {
+      FAIL("job %d had %d captures, wanted %d", i, captures[i],
+           FRAMES / CAPTURE_FRAMES);
+    }
+    if (serial[i] != (i % 2 == 1)) {
+      FAIL("job %d serial output is wrong", i);
+    }
+    // Runs of the same ROM end in the same state.
+    if (state[i] != state[i % 2]) {
+      FAIL("job %d state %llx, wanted %llx", i, state[i], state[i % 2]);
+    }
+  }
+  fclose(out);
+  free_farm_stats(&stats);
+  unlink(loop_rom);
+  unlink(serial_rom);
+  free(loop_rom);
+  free(serial_rom);
+}
+
+int main() {
+  extern bool shhhh;
+  shhhh = true;
+  run_farm_test();
+  return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef COUNT_ROM_TEST_H
+#define COUNT_ROM_TEST_H
+
+// A test ROM shared by the tests of save states, rewinding, and forking,
+// which change memory, registers, and the MBC a little on each instruction.
+
+#include "gameboy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Switches ROM banks, then counts in RAM and registers forever.
+static const uint8_t count_program[] = {
+    0x3E, 0x02,       // LD A, $02
+    0xEA, 0x00, 0x20, // LD [$2000], A
+    0x3E, 0x0A,       // LD A, $0A
+    0xEA, 0x00, 0x00, // LD [$0000], A
+    0x21, 0x00, 0xA0, // LD HL, $A000
+    0x34,             // INC [HL]
+    0x04,             // INC B
+    0xCB, 0x10,       // RL B
+    0x18, 0xFA,       // JR -6
+};
+
+// Returns an MBC1 Rom with 8 KiB of RAM that runs count_program,
+// with its data in the size bytes of data.
+static Rom count_rom(uint8_t *data, int size) {
+  memset(data, 0, size);
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, count_program, sizeof(count_program));
+  return (Rom){
+      .data = data,
+      .size = size,
+      .cart_type = CART_MBC1_RAM,
+      .num_rom_banks = size / ROM_BANK_SIZE,
+      .ram_size = EXT_RAM_BANK_SIZE,
+      .header_checksum = 0x42,
+  };
+}
+
+#endif // COUNT_ROM_TEST_H
@@ -62,6 +62,20 @@ struct instruction {
   // Executes the next cycle of the instruction.
   // Returns whether the instruction is complete.
   CpuState (*exec)(Gameboy *g, const Instruction *instr, int cycle);
+
+  // The remaining fields are only set on the per-op-code copies
+  // returned by find_instruction; see init_instruction_tables.
+
+  // The size of the instruction in bytes, including any 0xCB prefix.
+  int size;
+
+  // Operands decoded from the op code.
+  Reg8 r8;      // R8
+  Reg8 r8_dst;  // R8_DST
+  Reg16 r16;    // R16, R16STK, or R16MEM
+  Cond cond;    // COND
+  int bit;      // BIT_INDEX
+  uint16_t tgt; // TGT3
 };
 
 // Print a message, if enabled, and set trap=true to signal the debugger to
@@ -80,28 +94,20 @@ static void do_store(Gameboy *g, uint16_t addr, uint8_t x) { g->mem[addr] = x; }
 
 static uint8_t do_fetch(Gameboy *g, uint16_t addr) { return g->mem[addr]; }
 
+static uint8_t rom_fetch(const Gameboy *g, uint16_t addr) {
+  const uint8_t *bank =
+      mbc_rom(g, addr < MEM_ROM_N_START ? MEM_ROM0_START : MEM_ROM_N_START);
+  return bank == NULL ? 0xFF : bank[addr % ROM_BANK_SIZE];
+}
+
+static uint8_t do_rom_fetch(Gameboy *g, uint16_t addr) {
+  return rom_fetch(g, addr);
+}
+
 static void do_rom_store(Gameboy *g, uint16_t addr, uint8_t x) {
-  switch (g->rom->cart_type) {
-  case CART_MBC1:
-  case CART_MBC1_RAM:
-  case CART_MBC1_RAM_BATTERY:
-    if (0x0000 <= addr && addr <= 0x1FFF) {
-      // ram enable --- just ignore it for now
-    } else if (0x2000 <= addr && addr <= 0x3FFF) {
-      int bank = x % g->rom->num_rom_banks;
-      if (bank == 0) {
-        bank = 1;
-      }
-      int offs = bank * ROM_BANK_SIZE;
-      memcpy(g->mem + MEM_ROM_N_START, g->rom->data + offs, ROM_BANK_SIZE);
-    } else if (0x4000 <= addr && addr <= 0x5FFF) {
-      // ram bank number --- just ignore it for now.
-    } else if (0x6000 <= addr && addr <= 0x7FFF) {
-      // banking mode select --- just ignore it for now.
-    }
-    break;
-  default:
-    trap(g, "Ignoring unsupported ROM store %d ($%02X) to $%04X\n", x, x, addr);
+  if (!mbc_store(g, addr, x)) {
+    trap(g, "Ignoring unsupported ROM store %d ($%02X) to $%04X\n", x, x,
+         addr);
   }
 }
 
@@ -113,6 +119,16 @@ static void do_vram_store(Gameboy *g, uint16_t addr, uint8_t x) {
   g->mem[addr] = x;
 }
 
+// Tile data is never mapped for stores,
+// so that the PPU can drop the tiles it has decoded when they change.
+static void do_tile_data_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  uint8_t old = g->mem[addr];
+  do_vram_store(g, addr, x);
+  if (g->mem[addr] != old) {
+    ppu_tile_changed(g, addr);
+  }
+}
+
 static uint8_t do_vram_fetch(Gameboy *g, uint16_t addr) {
   if (ppu_enabled(g) && ppu_mode(g) == DRAWING) {
     if (!shhhh) {
@@ -179,7 +195,9 @@ static void do_io_store(Gameboy *g, uint16_t addr, uint8_t x) {
     if (!ppu_enabled(g) && (x & LCDC_ENABLED)) {
       ppu_enable(g);
     }
-    break;
+    g->mem[MEM_LCDC] = x;
+    mem_map_ppu_changed(g);
+    return;
 
   case MEM_STAT:
     // The lower 3 bits of STAT are read-only.
@@ -189,9 +207,18 @@ static void do_io_store(Gameboy *g, uint16_t addr, uint8_t x) {
   case MEM_LY:
     return; // read only
 
+  case MEM_SERIAL_CONTROL:
+    // There is no link partner, so just record the byte sent.
+    if ((x & SERIAL_START_INTERNAL) == SERIAL_START_INTERNAL &&
+        g->serial_len < SERIAL_OUT_SIZE) {
+      g->serial_out[g->serial_len++] = g->mem[MEM_SERIAL_DATA];
+    }
+    break;
+
   case MEM_DMA:
     g->dma_ticks_remaining = DMA_MCYCLES + DMA_SETUP_MCYCLES;
     g->mem[MEM_DMA] = x;
+    mem_map_invalidate(g);
     return;
   }
   g->mem[addr] = x;
@@ -204,35 +231,109 @@ static uint8_t do_io_fetch(Gameboy *g, uint16_t addr) {
   return g->mem[addr];
 }
 
-typedef struct {
+typedef struct mem_region MemRegion;
+
+struct mem_region {
   const char *name;
   uint16_t start;
   uint16_t end;
   void (*do_store)(Gameboy *, uint16_t, uint8_t);
   uint8_t (*do_fetch)(Gameboy *, uint16_t);
-} MemRegion;
+
+  // Return the memory backing the start of the region
+  // if the CPU can currently access it directly,
+  // bypassing do_fetch or do_store,
+  // or NULL if accesses must go through do_fetch or do_store.
+  // A NULL function is the same as always returning NULL.
+  const uint8_t *(*fetch_direct)(Gameboy *, const MemRegion *);
+  uint8_t *(*store_direct)(Gameboy *, const MemRegion *);
+};
+
+static uint8_t *direct(Gameboy *g, const MemRegion *r) {
+  return g->mem + r->start;
+}
+
+static const uint8_t *fetch_direct(Gameboy *g, const MemRegion *r) {
+  return direct(g, r);
+}
+
+static const uint8_t *rom_fetch_direct(Gameboy *g, const MemRegion *r) {
+  return mbc_rom(g, r->start);
+}
+
+static uint8_t *ext_ram_direct(Gameboy *g, const MemRegion *r) {
+  return mbc_ram(g);
+}
+
+static const uint8_t *ext_ram_fetch_direct(Gameboy *g, const MemRegion *r) {
+  return mbc_ram(g);
+}
+
+static uint8_t *vram_direct(Gameboy *g, const MemRegion *r) {
+  // Unless the PPU runs in step with the CPU,
+  // its mode may have changed since the map was last updated.
+  if (g->engine != ENGINE_MCYCLE ||
+      ppu_enabled(g) && ppu_mode(g) == DRAWING) {
+    return NULL;
+  }
+  return g->mem + r->start;
+}
+
+static const uint8_t *vram_fetch_direct(Gameboy *g, const MemRegion *r) {
+  return vram_direct(g, r);
+}
+
+// Echo ram is mapped to 0xC000-0xDDFF.
+static uint8_t *echo_ram_direct(Gameboy *g, const MemRegion *r) {
+  return g->mem + 0xC000;
+}
+
+static const uint8_t *echo_ram_fetch_direct(Gameboy *g, const MemRegion *r) {
+  return echo_ram_direct(g, r);
+}
 
 static const MemRegion mem_regions[] = {
     {
-        .name = "ROM",
-        .start = MEM_ROM_START,
-        .end = MEM_ROM_END,
+        .name = "ROM bank 0",
+        .start = MEM_ROM0_START,
+        .end = MEM_ROM0_END,
         .do_store = do_rom_store,
-        .do_fetch = do_fetch,
+        .do_fetch = do_rom_fetch,
+        .fetch_direct = rom_fetch_direct,
     },
     {
-        .name = "VRAM",
-        .start = MEM_VRAM_START,
-        .end = MEM_VRAM_END,
+        .name = "ROM bank N",
+        .start = MEM_ROM_N_START,
+        .end = MEM_ROM_N_END,
+        .do_store = do_rom_store,
+        .do_fetch = do_rom_fetch,
+        .fetch_direct = rom_fetch_direct,
+    },
+    {
+        .name = "VRAM tile data",
+        .start = MEM_TILE_BLOCK0_START,
+        .end = MEM_TILE_BLOCK2_END,
+        .do_store = do_tile_data_store,
+        .do_fetch = do_vram_fetch,
+        .fetch_direct = vram_fetch_direct,
+    },
+    {
+        .name = "VRAM tile maps",
+        .start = MEM_TILE_MAP0_START,
+        .end = MEM_TILE_MAP1_END,
         .do_store = do_vram_store,
         .do_fetch = do_vram_fetch,
+        .fetch_direct = vram_fetch_direct,
+        .store_direct = vram_direct,
     },
     {
         .name = "External RAM",
         .start = MEM_EXT_RAM_START,
         .end = MEM_EXT_RAM_END,
-        .do_store = do_store,
-        .do_fetch = do_fetch,
+        .do_store = mbc_ram_store,
+        .do_fetch = mbc_ram_fetch,
+        .fetch_direct = ext_ram_fetch_direct,
+        .store_direct = ext_ram_direct,
     },
     {
         .name = "Working RAM",
@@ -240,6 +341,8 @@ static const MemRegion mem_regions[] = {
         .end = MEM_WRAM_END,
         .do_store = do_store,
         .do_fetch = do_fetch,
+        .fetch_direct = fetch_direct,
+        .store_direct = direct,
     },
     {
         .name = "Echo RAM",
@@ -247,6 +350,8 @@ static const MemRegion mem_regions[] = {
         .end = MEM_ECHO_RAM_END,
         .do_store = do_echo_ram_store,
         .do_fetch = do_echo_ram_fetch,
+        .fetch_direct = echo_ram_fetch_direct,
+        .store_direct = echo_ram_direct,
     },
     {
         .name = "OAM",
@@ -309,14 +414,143 @@ static const MemRegion *find_mem_region(uint16_t addr) {
   return NULL;
 }
 
+// Sets the memory map entries for the pages of the region.
+// Pages that the region shares with another region
+// are never accessed directly.
+static void map_region(Gameboy *g, const MemRegion *r) {
+  MemMap *m = &g->mem_map;
+  const uint8_t *f = NULL;
+  uint8_t *s = NULL;
+  // During DMA, only high RAM is accessible,
+  // so everything goes through the slow path to check.
+  if (g->dma_ticks_remaining <= 0) {
+    f = r->fetch_direct == NULL ? NULL : r->fetch_direct(g, r);
+    s = r->store_direct == NULL ? NULL : r->store_direct(g, r);
+  }
+  int first = r->start / MEM_PAGE_SIZE;
+  int last = r->end / MEM_PAGE_SIZE;
+  for (int page = first; page <= last; page++) {
+    int offs = page * MEM_PAGE_SIZE - r->start;
+    m->fetch[page] = f != NULL ? f + offs : NULL;
+    m->store[page] = s != NULL ? s + offs : NULL;
+  }
+  // Only the first and last pages can be shared.
+  if (r->start % MEM_PAGE_SIZE != 0) {
+    m->fetch[first] = NULL;
+    m->store[first] = NULL;
+  }
+  if ((r->end + 1) % MEM_PAGE_SIZE != 0) {
+    m->fetch[last] = NULL;
+    m->store[last] = NULL;
+  }
+}
+
+// Returns g's memory map, first rebuilding it if it is stale.
+static MemMap *mem_map(Gameboy *g) {
+  MemMap *m = &g->mem_map;
+  if (m->owner != g) {
+    for (int i = 0; i < num_mem_regions; i++) {
+      map_region(g, &mem_regions[i]);
+    }
+    m->owner = g;
+  }
+  return m;
+}
+
+void mem_map_invalidate(Gameboy *g) { g->mem_map.owner = NULL; }
+
+// Maps the page-aligned region r again if the memory backing it has changed.
+static void remap_region(Gameboy *g, const MemRegion *r) {
+  MemMap *m = &g->mem_map;
+  int page = r->start / MEM_PAGE_SIZE;
+  const uint8_t *f = r->fetch_direct == NULL ? NULL : r->fetch_direct(g, r);
+  uint8_t *s = r->store_direct == NULL ? NULL : r->store_direct(g, r);
+  if (m->fetch[page] != f || m->store[page] != s) {
+    map_region(g, r);
+  }
+}
+
+void mem_map_cart_changed(Gameboy *g) {
+  if (g->mem_map.owner == g) {
+    remap_region(g, find_mem_region(MEM_ROM0_START));
+    remap_region(g, find_mem_region(MEM_ROM_N_START));
+    remap_region(g, find_mem_region(MEM_EXT_RAM_START));
+  }
+}
+
+uint8_t gameboy_peek(const Gameboy *g, uint16_t addr) {
+  if (addr <= MEM_ROM_END) {
+    return rom_fetch(g, addr);
+  }
+  if (addr >= MEM_EXT_RAM_START && addr <= MEM_EXT_RAM_END) {
+    const uint8_t *bank = mbc_ram(g);
+    return bank == NULL ? 0xFF : bank[addr - MEM_EXT_RAM_START];
+  }
+  return g->mem[addr];
+}
+
+void gameboy_mem_view(const Gameboy *g, Mem view) {
+  memcpy(view, g->mem, sizeof(Mem));
+  for (int start = MEM_ROM0_START; start <= MEM_ROM_N_START;
+       start += ROM_BANK_SIZE) {
+    const uint8_t *bank = mbc_rom(g, start);
+    if (bank == NULL) {
+      memset(view + start, 0xFF, ROM_BANK_SIZE);
+    } else {
+      memcpy(view + start, bank, ROM_BANK_SIZE);
+    }
+  }
+  const uint8_t *ram = mbc_ram(g);
+  if (ram == NULL) {
+    memset(view + MEM_EXT_RAM_START, 0xFF, EXT_RAM_BANK_SIZE);
+  } else {
+    memcpy(view + MEM_EXT_RAM_START, ram, EXT_RAM_BANK_SIZE);
+  }
+}
+
+void mem_map_ppu_changed(Gameboy *g) {
+  MemMap *m = &g->mem_map;
+  if (m->owner != g || g->dma_ticks_remaining > 0) {
+    // It will be rebuilt anyway, or VRAM is not mapped during DMA.
+    return;
+  }
+  static const uint16_t vram_starts[] = {MEM_TILE_BLOCK0_START,
+                                         MEM_TILE_MAP0_START};
+  for (int i = 0; i < sizeof(vram_starts) / sizeof(vram_starts[0]); i++) {
+    const MemRegion *vram = find_mem_region(vram_starts[i]);
+    bool mapped = m->fetch[vram->start / MEM_PAGE_SIZE] != NULL;
+    bool accessible = vram_direct(g, vram) != NULL;
+    if (mapped != accessible) {
+      map_region(g, vram);
+    }
+  }
+}
+
+// Returns whether g counts stats.
+// It usually does not, so counting is laid out off the fast path.
+static inline bool counting_stats(const Gameboy *g) {
+  return __builtin_expect(g->stats != NULL, 0);
+}
+
 // Reads the byte at the given memory address.
 // CPU emulation should always read memory using fetch or one of the variants
 // that call into fetch instead of accessing memory directly. This is because
 // fetch takes care of situations were certain memory is not actually readable
 // by the CPU.
 static uint8_t fetch(Gameboy *g, Addr addr) {
-  if (g->dma_ticks_remaining > 0 &&
-      (addr < MEM_HIGH_RAM_START || addr > MEM_HIGH_RAM_END)) {
+  if (counting_stats(g)) {
+    g->stats->fetches[addr / MEM_PAGE_SIZE]++;
+  }
+  const uint8_t *page = mem_map(g)->fetch[addr / MEM_PAGE_SIZE];
+  if (page != NULL) {
+    return page[addr % MEM_PAGE_SIZE];
+  }
+  // High RAM shares its page with I/O, but is always accessible.
+  if (addr >= MEM_HIGH_RAM_START && addr <= MEM_HIGH_RAM_END) {
+    return g->mem[addr];
+  }
+  gameboy_sync(g);
+  if (g->dma_ticks_remaining > 0) {
     // During DMA, only high RAM is accessible.
     return 0xFF;
   }
@@ -332,8 +566,21 @@ static uint8_t fetch(Gameboy *g, Addr addr) {
 // memory directly. This is because store takes care of situations were certain
 // memory is not actually writable by the CPU.
 void store(Gameboy *g, Addr addr, uint8_t x) {
-  if (g->dma_ticks_remaining > 0 &&
-      (addr < MEM_HIGH_RAM_START || addr > MEM_HIGH_RAM_END)) {
+  if (counting_stats(g)) {
+    g->stats->stores[addr / MEM_PAGE_SIZE]++;
+  }
+  uint8_t *page = mem_map(g)->store[addr / MEM_PAGE_SIZE];
+  if (page != NULL) {
+    page[addr % MEM_PAGE_SIZE] = x;
+    return;
+  }
+  // High RAM shares its page with I/O, but is always accessible.
+  if (addr >= MEM_HIGH_RAM_START && addr <= MEM_HIGH_RAM_END) {
+    g->mem[addr] = x;
+    return;
+  }
+  gameboy_sync(g);
+  if (g->dma_ticks_remaining > 0) {
     // During DMA, only high RAM is accessible.
     return;
   }
@@ -342,6 +589,9 @@ void store(Gameboy *g, Addr addr, uint8_t x) {
     fail("unknown mem region for address $%04X\n", addr);
   }
   region->do_store(g, addr, x);
+  // The store may change when the rest of the system next raises an
+  // interrupt, for example by writing IE, TAC, or LCDC.
+  g->next_event = 0;
 }
 
 // Fetches the byte at the PC register and increments it.
@@ -391,6 +641,23 @@ static bool interrupts_pending(const Gameboy *g) {
   return g->mem[MEM_IF] & g->mem[MEM_IE];
 }
 
+// Counts the instruction, or interrupt dispatch, that just finished,
+// where op_code is the IR of its last M cycle.
+static void count_instruction(Gameboy *g, uint8_t op_code) {
+  const Cpu *cpu = &g->cpu;
+  // An interrupt dispatch has no instruction.
+  if (cpu->instr != NULL) {
+    g->stats->instructions++;
+  }
+  if (g->stats->profile != NULL) {
+    int op = -1;
+    if (cpu->instr != NULL) {
+      op = cpu->bank == cb_instructions ? 0x100 + op_code : op_code;
+    }
+    profile_instruction(g->stats->profile, g, op, cpu->cycle);
+  }
+}
+
 void cpu_mcycle(Gameboy *g) {
   Cpu *cpu = &g->cpu;
 
@@ -407,6 +674,9 @@ void cpu_mcycle(Gameboy *g) {
     cpu->state = INTERRUPTING;
   }
 
+  // IR holds the op code being executed until its last M cycle fetches the
+  // next. Instruction.op_code is only the base op code of its pattern.
+  uint8_t op_code = cpu->ir;
   if (cpu->state == INTERRUPTING) {
     cpu->state = call_interrupt(g, cpu->cycle);
     goto done;
@@ -431,6 +701,9 @@ done:
   }
   cpu->cycle++;
   if (cpu->state == DONE || cpu->state == HALTED) {
+    if (counting_stats(g)) {
+      count_instruction(g, op_code);
+    }
     cpu->bank = instructions;
     cpu->instr = NULL;
     cpu->cycle = 0;
@@ -535,7 +808,7 @@ static CpuState exec_ld_r16_imm16(Gameboy *g, const Instruction *instr,
     cpu->w = fetch_pc(g);
     return EXECUTING;
   default: // 2
-    Reg16 r = decode_reg16(instr->shift, cpu->ir);
+    Reg16 r = instr->r16;
     set_reg16_low_high(cpu, r, cpu->z, cpu->w);
     cpu->ir = fetch_pc(g);
     return DONE;
@@ -547,7 +820,7 @@ static CpuState exec_ld_r16mem_a(Gameboy *g, const Instruction *instr,
   Cpu *cpu = &g->cpu;
   switch (cycle) {
   case 0:
-    Reg16 r = decode_reg16mem(instr->shift, g->cpu.ir);
+    Reg16 r = instr->r16;
     Addr addr = get_reg16(cpu, r);
     uint8_t a = get_reg8(cpu, REG_A);
     if (r == REG_HL_PLUS) {
@@ -568,7 +841,7 @@ static CpuState exec_ld_a_r16mem(Gameboy *g, const Instruction *instr,
   Cpu *cpu = &g->cpu;
   switch (cycle) {
   case 0:
-    Reg16 r = decode_reg16mem(instr->shift, cpu->ir);
+    Reg16 r = instr->r16;
     Addr addr = get_reg16(cpu, r);
     uint8_t x = fetch(g, addr);
     set_reg8(cpu, REG_A, x);
@@ -613,7 +886,7 @@ static CpuState exec_inc_r16(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
   switch (cycle) {
   case 0:
-    Reg16 r = decode_reg16(instr->shift, cpu->ir);
+    Reg16 r = instr->r16;
     set_reg16(cpu, r, get_reg16(cpu, r) + 1);
     return EXECUTING;
   default: // 1
@@ -626,7 +899,7 @@ static CpuState exec_dec_r16(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
   switch (cycle) {
   case 0:
-    Reg16 r = decode_reg16(instr->shift, cpu->ir);
+    Reg16 r = instr->r16;
     set_reg16(cpu, r, get_reg16(cpu, r) - 1);
     return EXECUTING;
   default: // 1
@@ -638,7 +911,7 @@ static CpuState exec_dec_r16(Gameboy *g, const Instruction *instr, int cycle) {
 static CpuState exec_add_hl_r16(Gameboy *g, const Instruction *instr,
                                 int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg16 r = decode_reg16(instr->shift, cpu->ir);
+  Reg16 r = instr->r16;
   uint16_t x = get_reg16(cpu, r);
   switch (cycle) {
   case 0:
@@ -662,7 +935,7 @@ static CpuState exec_add_hl_r16(Gameboy *g, const Instruction *instr,
 
 static CpuState exec_inc_r8(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg8 r = decode_reg8(instr->shift, cpu->ir);
+  Reg8 r = instr->r8;
   if (r != REG_HL_MEM) {
     uint8_t x = get_reg8(cpu, r);
     set_reg8(cpu, r, x + 1);
@@ -691,7 +964,7 @@ static CpuState exec_inc_r8(Gameboy *g, const Instruction *instr, int cycle) {
 
 static CpuState exec_dec_r8(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg8 r = decode_reg8(instr->shift, cpu->ir);
+  Reg8 r = instr->r8;
   if (r != REG_HL_MEM) {
     uint8_t x = get_reg8(cpu, r);
     set_reg8(cpu, r, x - 1);
@@ -726,7 +999,7 @@ static CpuState exec_ld_r8_imm8(Gameboy *g, const Instruction *instr,
     cpu->z = fetch_pc(g);
     return EXECUTING;
   case 1:
-    Reg8 r = decode_reg8(instr->shift, cpu->ir);
+    Reg8 r = instr->r8;
     if (r == REG_HL_MEM) {
       store(g, get_reg16(cpu, REG_HL), cpu->z);
       return EXECUTING;
@@ -867,7 +1140,7 @@ static CpuState exec_bit_twiddle_r8(Gameboy *g, const Instruction *instr,
   case 0:
     fail("impossible cycle 0"); // cycle 0 is reading the 0xCB prefix.
   case 1:
-    Reg8 r = decode_reg8(instr->shift, cpu->ir);
+    Reg8 r = instr->r8;
     if (r != REG_HL_MEM) {
       set_reg8(cpu, r, op(cpu, get_reg8(cpu, r)));
       cpu->ir = fetch_pc(g);
@@ -959,8 +1232,8 @@ static CpuState exec_srl_r8(Gameboy *g, const Instruction *instr, int cycle) {
 static CpuState exec_bit_b3_r8(Gameboy *g, const Instruction *instr,
                                int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg8 r = decode_reg8(instr->shift, cpu->ir);
-  int bit = decode_bit_index(instr->shift, cpu->ir);
+  Reg8 r = instr->r8;
+  int bit = instr->bit;
   switch (cycle) {
   case 0:
     fail("impossible cycle 0"); // cycle 0 is reading the 0xCB prefix.
@@ -983,8 +1256,8 @@ static CpuState exec_bit_b3_r8(Gameboy *g, const Instruction *instr,
 static CpuState exec_res_set_b3_r8(Gameboy *g, const Instruction *instr,
                                    int cycle, uint8_t (*op)(int, uint8_t)) {
   Cpu *cpu = &g->cpu;
-  Reg8 r = decode_reg8(instr->shift, cpu->ir);
-  int bit = decode_bit_index(instr->shift, cpu->ir);
+  Reg8 r = instr->r8;
+  int bit = instr->bit;
   switch (cycle) {
   case 0:
     fail("impossible cycle 0"); // cycle 0 is reading the 0xCB prefix.
@@ -1056,7 +1329,7 @@ static CpuState exec_jr_cond_imm8(Gameboy *g, const Instruction *instr,
     cpu->z = fetch_pc(g);
     return EXECUTING;
   case 1:
-    if (!eval_cond(cpu, decode_cond(instr->shift, cpu->ir))) {
+    if (!eval_cond(cpu, instr->cond)) {
       cpu->ir = fetch_pc(g);
       return DONE;
     }
@@ -1075,8 +1348,8 @@ static CpuState exec_stop(Gameboy *g, const Instruction *instr, int cycle) {
 
 static CpuState exec_ld_r8_r8(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg8 src = decode_reg8(instr->shift, cpu->ir);
-  Reg8 dst = decode_reg8_dst(instr->shift, cpu->ir);
+  Reg8 src = instr->r8;
+  Reg8 dst = instr->r8_dst;
 
   if (src == REG_HL_MEM && dst == REG_HL_MEM) {
     // LD [HL], [HL] is HALT
@@ -1116,7 +1389,7 @@ static CpuState exec_halt(Gameboy *g, const Instruction *instr, int cycle) {
 static CpuState exec_op_a_r8(Gameboy *g, const Instruction *instr, int cycle,
                              uint8_t (*op)(Cpu *, uint8_t, uint8_t)) {
   Cpu *cpu = &g->cpu;
-  Reg8 r = decode_reg8(instr->shift, cpu->ir);
+  Reg8 r = instr->r8;
   if (r != REG_HL_MEM) {
     set_reg8(cpu, REG_A, op(cpu, get_reg8(cpu, REG_A), get_reg8(cpu, r)));
     cpu->ir = fetch_pc(g);
@@ -1290,7 +1563,7 @@ static CpuState exec_cp_a_imm8(Gameboy *g, const Instruction *instr,
 
 static CpuState exec_ret_cond(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
-  bool cc = eval_cond(cpu, decode_cond(instr->shift, cpu->ir));
+  bool cc = eval_cond(cpu, instr->cond);
   switch (cycle) {
   case 0:
     return EXECUTING;
@@ -1359,7 +1632,7 @@ static CpuState exec_jp(Gameboy *g, const Instruction *instr, int cycle,
     return EXECUTING;
   case 2:
     if (check_cond) {
-      bool cc = eval_cond(cpu, decode_cond(instr->shift, cpu->ir));
+      bool cc = eval_cond(cpu, instr->cond);
       if (!cc) {
         cpu->ir = fetch_pc(g);
         return DONE;
@@ -1401,7 +1674,7 @@ static CpuState exec_call(Gameboy *g, const Instruction *instr, int cycle,
     return EXECUTING;
   case 2:
     if (check_cond) {
-      bool cc = eval_cond(cpu, decode_cond(instr->shift, cpu->ir));
+      bool cc = eval_cond(cpu, instr->cond);
       if (!cc) {
         cpu->ir = fetch_pc(g);
         return DONE;
@@ -1445,7 +1718,7 @@ static CpuState exec_rst_tgt3(Gameboy *g, const Instruction *instr, int cycle) {
     return EXECUTING;
   case 2:
     store(g, cpu->sp, cpu->pc & 0xFF);
-    cpu->pc = decode_tgt3(instr->shift, cpu->ir);
+    cpu->pc = instr->tgt;
     return EXECUTING;
   default: // 3
     cpu->ir = fetch_pc(g);
@@ -1465,7 +1738,7 @@ static CpuState exec_pop_r16(Gameboy *g, const Instruction *instr, int cycle) {
     cpu->sp++;
     return EXECUTING;
   default: // 2
-    Reg16 r = decode_reg16stk(instr->shift, cpu->ir);
+    Reg16 r = instr->r16;
     set_reg16_low_high(cpu, r, cpu->z, cpu->w);
     cpu->ir = fetch_pc(g);
     return DONE;
@@ -1474,7 +1747,7 @@ static CpuState exec_pop_r16(Gameboy *g, const Instruction *instr, int cycle) {
 
 static CpuState exec_push_r16(Gameboy *g, const Instruction *instr, int cycle) {
   Cpu *cpu = &g->cpu;
-  Reg16 r = decode_reg16stk(instr->shift, cpu->ir);
+  Reg16 r = instr->r16;
   uint16_t x = get_reg16(cpu, r);
   switch (cycle) {
   case 0:
@@ -1683,6 +1956,7 @@ static CpuState exec_unknown(Gameboy *g, const Instruction *instr, int cycle) {
 static const Instruction _unknown_instruction = {
     .mnemonic = "UNKNOWN",
     .exec = exec_unknown,
+    .size = 1,
 };
 
 static const Instruction _instructions[] = {
@@ -2239,19 +2513,7 @@ static int operand_size(Operand operand) {
   }
 }
 
-int instruction_size(const Instruction *instr) {
-  int size = 1;
-  // If the instruction is in the cb_instructions bank,
-  // then add a byte to account for the 0xCB prefix.
-  if (instr >= _cb_instructions &&
-      instr <
-          _cb_instructions + sizeof(_cb_instructions) / sizeof(Instruction)) {
-    size += 1;
-  }
-  size += operand_size(instr->operand1);
-  size += operand_size(instr->operand2);
-  return size;
-}
+int instruction_size(const Instruction *instr) { return instr->size; }
 
 static int operand_op_code_bits(const Operand operand) {
   switch (operand) {
@@ -2302,15 +2564,89 @@ static uint8_t op_code_mask(const Instruction *instr) {
   return 0; // unreachable
 }
 
-const Instruction *find_instruction(const Instruction *bank, uint8_t op_code) {
-  const Instruction *instr = bank;
-  while (instr->mnemonic != NULL) {
+// Returns the first instruction pattern in bank that matches op_code.
+static const Instruction *match_instruction(const Instruction *bank,
+                                            uint8_t op_code) {
+  for (const Instruction *instr = bank; instr->mnemonic != NULL; instr++) {
     if ((op_code & op_code_mask(instr)) == instr->op_code) {
       return instr;
     }
-    instr++;
   }
-  return unknown_instruction;
+  return NULL;
+}
+
+static void decode_operand(Instruction *instr, Operand operand,
+                           uint8_t op_code) {
+  switch (operand) {
+  case R16:
+    instr->r16 = decode_reg16(instr->shift, op_code);
+    break;
+  case R16STK:
+    instr->r16 = decode_reg16stk(instr->shift, op_code);
+    break;
+  case R16MEM:
+    instr->r16 = decode_reg16mem(instr->shift, op_code);
+    break;
+  case R8:
+    instr->r8 = decode_reg8(instr->shift, op_code);
+    break;
+  case COND:
+    instr->cond = decode_cond(instr->shift, op_code);
+    break;
+  case TGT3:
+    instr->tgt = decode_tgt3(instr->shift, op_code);
+    break;
+  case BIT_INDEX:
+    instr->bit = decode_bit_index(instr->shift, op_code);
+    break;
+  case R8_DST:
+    instr->r8_dst = decode_reg8_dst(instr->shift, op_code);
+    break;
+  default:
+    break;
+  }
+}
+
+// Per-op-code copies of the matching instruction patterns,
+// with their size and operands decoded ahead of time.
+static Instruction decoded_instructions[256];
+static Instruction decoded_cb_instructions[256];
+
+// Maps each op code to its decoded instruction, or to unknown_instruction.
+static const Instruction *instruction_table[256];
+static const Instruction *cb_instruction_table[256];
+
+static void init_table(const Instruction **table, Instruction *decoded,
+                       const Instruction *bank, int prefix_size) {
+  for (int op_code = 0; op_code < 256; op_code++) {
+    const Instruction *pattern = match_instruction(bank, op_code);
+    if (pattern == NULL) {
+      table[op_code] = unknown_instruction;
+      continue;
+    }
+    Instruction *instr = &decoded[op_code];
+    *instr = *pattern;
+    instr->size = 1 + prefix_size + operand_size(instr->operand1) +
+                  operand_size(instr->operand2);
+    decode_operand(instr, instr->operand1, op_code);
+    decode_operand(instr, instr->operand2, op_code);
+    table[op_code] = instr;
+  }
+}
+
+// Fills the op code tables before main, so that find_instruction
+// is a single lookup.
+__attribute__((constructor)) static void init_instruction_tables() {
+  init_table(instruction_table, decoded_instructions, _instructions, 0);
+  init_table(cb_instruction_table, decoded_cb_instructions, _cb_instructions,
+             1);
+}
+
+const Instruction *find_instruction(const Instruction *bank, uint8_t op_code) {
+  if (bank == _cb_instructions) {
+    return cb_instruction_table[op_code];
+  }
+  return instruction_table[op_code];
 }
 
 const char *cpu_state_name(CpuState s) {
@@ -2435,8 +2771,8 @@ static const char *mem_name(uint16_t addr) {
   return NULL;
 }
 
-static int format_operand(char *buf, int size, Operand operand, int shift,
-                          const uint8_t *data, int offs) {
+static int format_operand(char *buf, int size, const Instruction *instr,
+                          Operand operand, const uint8_t *data, int offs) {
   switch (operand) {
   case NONE:
     if (size > 0) {
@@ -2454,25 +2790,20 @@ static int format_operand(char *buf, int size, Operand operand, int shift,
   case SP_PLUS_IMM8:
     return snprintf(buf, size, "SP+%d", data[offs]);
   case R16:
-    return snprintf(buf, size, "%s",
-                    reg16_name(decode_reg16(shift, data[offs])));
   case R16STK:
-    return snprintf(buf, size, "%s",
-                    reg16_name(decode_reg16stk(shift, data[offs])));
+    return snprintf(buf, size, "%s", reg16_name(instr->r16));
   case R16MEM:
-    return snprintf(buf, size, "[%s]",
-                    reg16_name(decode_reg16mem(shift, data[offs])));
+    return snprintf(buf, size, "[%s]", reg16_name(instr->r16));
   case R8:
-    return snprintf(buf, size, "%s", reg8_name(decode_reg8(shift, data[offs])));
+    return snprintf(buf, size, "%s", reg8_name(instr->r8));
   case COND:
-    return snprintf(buf, size, "%s", cond_name(decode_cond(shift, data[offs])));
+    return snprintf(buf, size, "%s", cond_name(instr->cond));
   case TGT3:
-    return snprintf(buf, size, "%d", decode_tgt3(shift, data[offs]));
+    return snprintf(buf, size, "%d", instr->tgt);
   case BIT_INDEX:
-    return snprintf(buf, size, "%d", decode_bit_index(shift, data[offs]));
+    return snprintf(buf, size, "%d", instr->bit);
   case R8_DST:
-    return snprintf(buf, size, "%s",
-                    reg8_name(decode_reg8_dst(shift, data[offs])));
+    return snprintf(buf, size, "%s", reg8_name(instr->r8_dst));
   case IMM8:
     return snprintf(buf, size, "%d ($%02X)", data[offs], data[offs]);
   case IMM8_OFFSET: {
@@ -2629,7 +2960,7 @@ static const Instruction *format_instruction(char *out, int out_size,
   }
 
   char buf1[32];
-  format_operand(buf1, sizeof(buf1), instr->operand1, instr->shift, data, offs);
+  format_operand(buf1, sizeof(buf1), instr, instr->operand1, data, offs);
   if (instr->operand2 == NONE) {
     snprintf(out, out_size, "%s %s", instr->mnemonic, buf1);
     return instr;
@@ -2639,7 +2970,7 @@ static const Instruction *format_instruction(char *out, int out_size,
     offs++;
   }
   char buf2[32];
-  format_operand(buf2, sizeof(buf2), instr->operand2, instr->shift, data, offs);
+  format_operand(buf2, sizeof(buf2), instr, instr->operand2, data, offs);
   snprintf(out, out_size, "%s %s, %s", instr->mnemonic, buf1, buf2);
   return instr;
 }
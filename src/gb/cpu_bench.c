@@ -0,0 +1,376 @@
+// Needed for fileno.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gameboy.h"
+#include "time_ns.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Decodes every op code in both instruction banks, iters times,
+// and prints the average time per decode.
+static void bench_find_instruction(int iters) {
+  long sum = 0;
+  double start = monoclock_time_ns();
+  for (int i = 0; i < iters; i++) {
+    for (int op_code = 0; op_code < 256; op_code++) {
+      sum += instruction_size(find_instruction(instructions, op_code));
+      sum += instruction_size(find_instruction(cb_instructions, op_code));
+    }
+  }
+  double ns = monoclock_time_ns() - start;
+  long n = (long)iters * 512;
+  // Print sum so the loop isn't optimized away.
+  printf("find_instruction: %ld decodes, %.2f ns/decode (sum=%ld)\n", n,
+         ns / n, sum);
+}
+
+// Disassembles a buffer containing every op code, iters times,
+// and prints the average time per instruction.
+static void bench_disassemble(int iters) {
+  uint8_t data[3 * 256 + 2];
+  for (int i = 0; i < sizeof(data); i++) {
+    data[i] = i / 3;
+  }
+  long n = 0;
+  double start = monoclock_time_ns();
+  for (int i = 0; i < iters; i++) {
+    for (int offs = 0; offs < 3 * 256; offs += 3) {
+      disassemble(data, sizeof(data), offs);
+      n++;
+    }
+  }
+  double ns = monoclock_time_ns() - start;
+  printf("disassemble: %ld instructions, %.2f ns/instruction\n", n, ns / n);
+}
+
+// A loop that copies bytes between two pages of working RAM.
+static const uint8_t copy_loop[] = {
+    0x21, 0x00, 0xC0, // LD HL, $C000
+    0x11, 0x00, 0xD0, // LD DE, $D000
+    0x7E,             // LD A, [HL]
+    0x12,             // LD [DE], A
+    0x2C,             // INC L
+    0x1C,             // INC E
+    0x18, 0xFA,       // JR -6
+};
+
+// Runs copy_loop for n M cycles of the CPU alone,
+// and prints the average time per M cycle.
+static void bench_cpu_mcycle(long n) {
+  static Gameboy g;
+  memcpy(g.mem, copy_loop, sizeof(copy_loop));
+  double start = monoclock_time_ns();
+  for (long i = 0; i < n; i++) {
+    cpu_mcycle(&g);
+  }
+  double ns = monoclock_time_ns() - start;
+  printf("cpu_mcycle: %ld M cycles, %.2f ns/M cycle\n", n, ns / n);
+}
+
+// Runs copy_loop on the entire Gameboy, with the PPU enabled,
+// for at least n M cycles using the given engine,
+// and prints the average time per M cycle.
+static void bench_mcycle(const char *name, Engine engine, long n) {
+  static Gameboy g;
+  g = (Gameboy){.engine = engine};
+  memcpy(g.mem, copy_loop, sizeof(copy_loop));
+  g.mem[MEM_LCDC] = LCDC_ENABLED;
+  long m = 0;
+  double start = monoclock_time_ns();
+  while (m < n) {
+    m += mcycle(&g);
+  }
+  double ns = monoclock_time_ns() - start;
+  printf("mcycle %s: %ld M cycles, %.2f ns/M cycle\n", name, m, ns / m);
+}
+
+// A loop that switches MBC1 ROM banks back and forth.
+static const uint8_t bank_switch_loop[] = {
+    0x3E, 0x01,       // LD A, 1
+    0xEA, 0x00, 0x20, // LD [$2000], A
+    0x3E, 0x02,       // LD A, 2
+    0xEA, 0x00, 0x20, // LD [$2000], A
+    0x18, 0xF4,       // JR -12
+};
+
+// Runs bank_switch_loop on an MBC1 cartridge for n bank switches,
+// and prints the average time per switch.
+static void bench_rom_bank_switch(long n) {
+  enum { NUM_BANKS = 4 };
+  uint8_t *data = calloc(NUM_BANKS, ROM_BANK_SIZE);
+  memcpy(data, bank_switch_loop, sizeof(bank_switch_loop));
+  Rom rom = {
+      .data = data,
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC1,
+      .rom_size = NUM_BANKS * ROM_BANK_SIZE,
+      .num_rom_banks = NUM_BANKS,
+  };
+  static Gameboy g;
+  g = (Gameboy){.rom = &rom, .engine = ENGINE_INSTRUCTION};
+  // Each iteration of the loop is 5 instructions, with 2 switches.
+  long instrs = n / 2 * 5;
+  double start = monoclock_time_ns();
+  for (long i = 0; i < instrs; i++) {
+    mcycle(&g);
+  }
+  double ns = monoclock_time_ns() - start;
+  printf("ROM bank switch: %ld switches, %.2f ns/switch\n", n, ns / n);
+  free(data);
+}
+
+// Saves and loads the state of a Gameboy with 8 KiB of external RAM
+// to a temporary file n times,
+// and prints the average time per save and per load.
+static void bench_save_state(int n) {
+  enum { NUM_BANKS = 2 };
+  uint8_t *data = calloc(NUM_BANKS, ROM_BANK_SIZE);
+  Rom rom = {
+      .data = data,
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC1_RAM,
+      .rom_size = NUM_BANKS * ROM_BANK_SIZE,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  FILE *f = tmpfile();
+  int fd = fileno(f);
+  double save_ns = 0, load_ns = 0;
+  for (int i = 0; i < n; i++) {
+    lseek(fd, 0, SEEK_SET);
+    double start = monoclock_time_ns();
+    const char *err = save_state(&g, fd);
+    save_ns += monoclock_time_ns() - start;
+    if (err != NULL) {
+      fail("save_state failed: %s", err);
+    }
+    lseek(fd, 0, SEEK_SET);
+    start = monoclock_time_ns();
+    err = load_state(&g, fd);
+    load_ns += monoclock_time_ns() - start;
+    if (err != NULL) {
+      fail("load_state failed: %s", err);
+    }
+  }
+  printf("save state: %d saves, %.2f us/save, %.2f us/load\n", n,
+         save_ns / n / 1000, load_ns / n / 1000);
+  fclose(f);
+  free_gameboy(&g);
+  free(data);
+}
+
+// A loop that enables external RAM, then counts in its first page.
+// It starts at $0101, where init_gameboy starts the CPU.
+static const uint8_t ext_ram_count_loop[] = {
+    0x3E, 0x0A,       // LD A, $0A
+    0xEA, 0x00, 0x00, // LD [$0000], A
+    0x21, 0x00, 0xA0, // LD HL, $A000
+    0x34,             // INC [HL]
+    0x2C,             // INC L
+    0x18, 0xFC,       // JR -4
+};
+
+// Records n frames of a Gameboy with 8 KiB of external RAM,
+// running ext_ram_count_loop,
+// into a Rewind holding 60 seconds, then steps back over them one by one,
+// and prints the average time per record and per step back,
+// and the memory used per minute of history.
+static void bench_rewind(int n) {
+  enum { NUM_BANKS = 2 };
+  uint8_t *data = calloc(NUM_BANKS, ROM_BANK_SIZE);
+  memcpy(data + MEM_HEADER_START + 1, ext_ram_count_loop,
+         sizeof(ext_ram_count_loop));
+  Rom rom = {
+      .data = data,
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC1_RAM,
+      .rom_size = NUM_BANKS * ROM_BANK_SIZE,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  Rewind r = init_rewind(&g, 60 * 60, 60);
+  double record_ns = 0, back_ns = 0;
+  for (int i = 0; i < n; i++) {
+    run_frame(&g, MCYCLES_PER_FRAME);
+    double start = monoclock_time_ns();
+    rewind_record(&r, &g);
+    record_ns += monoclock_time_ns() - start;
+  }
+  long per_minute = rewind_bytes_per_minute(&r);
+  int nback = r.n - 1;
+  for (int i = 0; i < nback; i++) {
+    double start = monoclock_time_ns();
+    rewind_back(&r, &g, 1);
+    back_ns += monoclock_time_ns() - start;
+  }
+  printf("rewind: %d frames, %.2f us/record, %.2f us/back, %.1f KiB/minute\n",
+         n, record_ns / n / 1000, back_ns / nback / 1000, per_minute / 1024.0);
+  free_rewind(&r);
+  free_gameboy(&g);
+  free(data);
+}
+
+// Returns a copy of g with its own external RAM,
+// as a branching search would make without gameboy_fork.
+static Gameboy *copy_gameboy(const Gameboy *g) {
+  Gameboy *c = malloc(sizeof(Gameboy));
+  if (c == NULL) {
+    fail("failed to allocate a Gameboy");
+  }
+  *c = *g;
+  if (g->ext_ram != NULL) {
+    c->ext_ram = malloc(g->rom->ram_size);
+    if (c->ext_ram == NULL) {
+      fail("failed to allocate external RAM");
+    }
+    memcpy(c->ext_ram, g->ext_ram, g->rom->ram_size);
+  }
+  return c;
+}
+
+// Makes n branches of a Gameboy with 8 KiB of external RAM,
+// by plain copies and by gameboy_fork, runs each for a short while,
+// then frees them, and prints the average time per branch
+// to make it, and for all three steps.
+static void bench_fork(int n) {
+  enum { NUM_BANKS = 2, BRANCH_MCYCLES = 1000 };
+  uint8_t *data = calloc(NUM_BANKS, ROM_BANK_SIZE);
+  Rom rom = {
+      .data = data,
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC1_RAM,
+      .rom_size = NUM_BANKS * ROM_BANK_SIZE,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  run_frame(&g, MCYCLES_PER_FRAME);
+  Gameboy **branches = calloc(n, sizeof(Gameboy *));
+  if (branches == NULL) {
+    fail("failed to allocate branches");
+  }
+
+  double start = monoclock_time_ns();
+  for (int i = 0; i < n; i++) {
+    branches[i] = copy_gameboy(&g);
+  }
+  double copy_ns = monoclock_time_ns() - start;
+  for (int i = 0; i < n; i++) {
+    run_frame(branches[i], BRANCH_MCYCLES);
+    free_gameboy(branches[i]);
+    free(branches[i]);
+  }
+  double copy_all_ns = monoclock_time_ns() - start;
+
+  start = monoclock_time_ns();
+  ForkBase base = init_fork_base(&g);
+  for (int i = 0; i < n; i++) {
+    branches[i] = gameboy_fork(&base);
+  }
+  double fork_ns = monoclock_time_ns() - start;
+  for (int i = 0; i < n; i++) {
+    run_frame(branches[i], BRANCH_MCYCLES);
+    gameboy_release(branches[i]);
+  }
+  free_fork_base(&base);
+  double fork_all_ns = monoclock_time_ns() - start;
+
+  printf("branch x%d: copy %.2f us/make, %.2f us/all; "
+         "fork %.2f us/make, %.2f us/all\n",
+         n, copy_ns / n / 1000, copy_all_ns / n / 1000, fork_ns / n / 1000,
+         fork_all_ns / n / 1000);
+  free(branches);
+  free_gameboy(&g);
+  free(data);
+}
+
+// Decodes all 384 tiles of VRAM n times, a pixel at a time
+// and with decode_tile_rows, and prints the average time per tile.
+static void bench_decode_tiles(int n) {
+  enum { NUM_ROWS = NUM_TILES * TILE_HEIGHT };
+  static uint8_t data[NUM_TILES * TILE_SIZE];
+  static uint8_t want[NUM_ROWS][TILE_WIDTH];
+  static uint8_t got[NUM_ROWS][TILE_WIDTH];
+  uint32_t x = 1;
+  for (int i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = x >> 16;
+  }
+  double start = monoclock_time_ns();
+  for (int i = 0; i < n; i++) {
+    for (int row = 0; row < NUM_ROWS; row++) {
+      uint8_t low = data[2 * row];
+      uint8_t high = data[2 * row + 1];
+      for (int px = 0; px < TILE_WIDTH; px++) {
+        int ci = (high >> (7 - px) & 1) << 1 | low >> (7 - px) & 1;
+        want[row][px] = PALLET_IDENTITY >> 2 * ci & 0x3;
+      }
+    }
+  }
+  double pixel_ns = monoclock_time_ns() - start;
+  start = monoclock_time_ns();
+  for (int i = 0; i < n; i++) {
+    decode_tile_rows(data, NUM_ROWS, PALLET_IDENTITY, got[0]);
+  }
+  double rows_ns = monoclock_time_ns() - start;
+  if (memcmp(got, want, sizeof(got)) != 0) {
+    fail("decode_tile_rows and per-pixel decoding differ");
+  }
+  printf("decode tiles: %d x %d tiles, per-pixel %.2f ns/tile, "
+         "decode_tile_rows %.2f ns/tile\n",
+         n, NUM_TILES, pixel_ns / n / NUM_TILES, rows_ns / n / NUM_TILES);
+}
+
+// Runs n frames of a Gameboy looping forever with the LCD on,
+// drawing random tiles, objects and the window,
+// and prints the frames per second.
+static void bench_ppu(const char *name, PpuModel model, int n) {
+  static Gameboy g;
+  g = (Gameboy){.engine = ENGINE_INSTRUCTION, .ppu_model = model};
+  uint32_t x = 1;
+  for (int i = MEM_VRAM_START; i <= MEM_OAM_END; i++) {
+    x = x * 1103515245 + 12345;
+    g.mem[i] = x >> 16;
+  }
+  g.mem[0] = 0x18; // JR -2
+  g.mem[1] = 0xFE;
+  g.mem[MEM_LCDC] = LCDC_ENABLED | LCDC_BG_WIN_ENABLED | LCDC_OBJ_ENABLED |
+                    LCDC_TILE_DATA | LCDC_WIN_ENABLED;
+  g.mem[MEM_SCX] = 3;
+  g.mem[MEM_WY] = 100;
+  g.mem[MEM_WX] = 7;
+  g.mem[MEM_BGP] = PALLET_IDENTITY;
+  double start = monoclock_time_ns();
+  for (int i = 0; i < n; i++) {
+    run_frame(&g, MCYCLES_PER_FRAME);
+  }
+  double ns = monoclock_time_ns() - start;
+  printf("%s: %d frames, %.0f frames/s\n", name, n, n / (ns / 1e9));
+}
+
+int main() {
+  bench_find_instruction(10000);
+  bench_disassemble(1000);
+  bench_cpu_mcycle(10000000);
+  bench_mcycle("ENGINE_MCYCLE", ENGINE_MCYCLE, 10000000);
+  bench_mcycle("ENGINE_INSTRUCTION", ENGINE_INSTRUCTION, 10000000);
+  bench_rom_bank_switch(1000000);
+  bench_save_state(10000);
+  bench_rewind(3600);
+  bench_fork(1);
+  bench_fork(10);
+  bench_fork(1000);
+  bench_decode_tiles(10000);
+  bench_ppu("PPU_SCANLINE", PPU_SCANLINE, 3000);
+  bench_ppu("PPU_FIFO", PPU_FIFO, 3000);
+  return 0;
+}
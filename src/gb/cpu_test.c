@@ -7711,6 +7711,77 @@ void run_store_fetch_tests() {
   _run_exec_tests(store_fetch_tests, ARRAY_SIZE(store_fetch_tests));
 }
 
+// Tests that the memory map is updated when the PPU enters DRAWING mode
+// after VRAM was already accessed directly.
+void run_mem_map_ppu_mode_test() {
+  Gameboy g = {
+      .cpu = {.ir = LD_A_IMM16_MEM},
+      .mem =
+          {
+              MEM_VRAM_START & 0xFF,
+              MEM_VRAM_START >> 8,
+              LD_A_IMM16_MEM,
+              MEM_VRAM_START & 0xFF,
+              MEM_VRAM_START >> 8,
+              [MEM_VRAM_START] = 0xAA,
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = OAM_SCAN,
+          },
+  };
+  step(&g);
+  if (g.cpu.registers[REG_A] != 0xAA) {
+    FAIL("got A=$%02X, expected $AA", g.cpu.registers[REG_A]);
+  }
+  // Tick the PPU into DRAWING.
+  while (ppu_mode(&g) != DRAWING) {
+    ppu_tcycle(&g);
+  }
+  step(&g);
+  if (g.cpu.registers[REG_A] != 0xFF) {
+    FAIL("got A=$%02X, expected $FF", g.cpu.registers[REG_A]);
+  }
+}
+
+// Tests that the memory map is updated when OAM DMA starts and finishes.
+// As on real hardware, the code runs from high RAM,
+// since that is all that is accessible during DMA.
+void run_mem_map_dma_test() {
+  Gameboy g = {
+      .cpu = {.ir = LD_A_IMM16_MEM, .pc = HIGH_RAM_START},
+      .mem =
+          {
+              [HIGH_RAM_START] = MEM_WRAM_START & 0xFF,
+              MEM_WRAM_START >> 8,
+              LD_IMM16_MEM_A,
+              MEM_DMA & 0xFF,
+              MEM_DMA >> 8,
+              LD_A_IMM16_MEM,
+              MEM_WRAM_START & 0xFF,
+              MEM_WRAM_START >> 8,
+              [MEM_WRAM_START] = 0xC0,
+          },
+  };
+  step(&g);
+  if (g.cpu.registers[REG_A] != 0xC0) {
+    FAIL("got A=$%02X, expected $C0", g.cpu.registers[REG_A]);
+  }
+  step(&g); // Start the DMA.
+  step(&g);
+  if (g.cpu.registers[REG_A] != 0xFF) {
+    FAIL("during DMA got A=$%02X, expected $FF", g.cpu.registers[REG_A]);
+  }
+  while (g.dma_ticks_remaining > 0) {
+    mcycle(&g);
+  }
+  // Go back and re-run the last load.
+  g.cpu.ir = LD_A_IMM16_MEM;
+  g.cpu.pc = HIGH_RAM_START + 6;
+  step(&g);
+  if (g.cpu.registers[REG_A] != 0xC0) {
+    FAIL("after DMA got A=$%02X, expected $C0", g.cpu.registers[REG_A]);
+  }
+}
+
 struct mbc_test {
   const char *name;
   CartType cart_type;
@@ -7724,8 +7795,11 @@ void _run_mbc_tests(struct mbc_test mbc_tests[], int n) {
     struct mbc_test *test = &mbc_tests[i];
     int rom_size = ROM_BANK_SIZE * test->num_banks;
     uint8_t *data = calloc(1, rom_size);
+    // address 0x2000 is MBC1 ROM bank register.
+    data[0] = 0x00;
+    data[1] = 0x20;
     for (int j = 0; j < test->num_banks; j++) {
-      data[ROM_BANK_SIZE * j] = j;
+      data[ROM_BANK_SIZE * j + 2] = j;
     }
     Rom rom = {
         .data = data,
@@ -7740,16 +7814,12 @@ void _run_mbc_tests(struct mbc_test mbc_tests[], int n) {
                 .ir = LD_IMM16_MEM_A,
                 .registers = {[REG_A] = test->switch_to_bank},
             },
-        .mem =
-            {
-                // address 0x2000 is MBC1 ROM bank register.
-                [0] = 0x00,
-                [1] = 0x20,
-            },
         .rom = &rom,
+        .mbc = {.rom_bank = 1},
     };
     Gameboy want = g;
-    want.mem[MEM_ROM_N_START] = test->expected_bank;
+    want.mbc.rom_bank_reg = test->switch_to_bank;
+    want.mbc.rom_bank = test->expected_bank;
     want.cpu.ir = 0;
     want.cpu.pc = 3;
 
@@ -7759,6 +7829,11 @@ void _run_mbc_tests(struct mbc_test mbc_tests[], int n) {
     if (diff != NULL) {
       FAIL("%s: Unexpected ROM bank switch:\n%s", test->name, diff);
     }
+    int got_bank = gameboy_peek(&g, MEM_ROM_N_START + 2);
+    if (got_bank != test->expected_bank) {
+      FAIL("%s: got bank %d mapped, expected %d", test->name, got_bank,
+           test->expected_bank);
+    }
 
     free(data);
   }
@@ -7828,6 +7903,8 @@ int main() {
   run_halt_ime_true_pending_true_test();
 
   run_store_fetch_tests();
+  run_mem_map_ppu_mode_test();
+  run_mem_map_dma_test();
 
   run_mbc1_tests();
 
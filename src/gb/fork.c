@@ -0,0 +1,83 @@
+// Needed for mmap and shm_open.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gameboy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Returns the size of the mapping for g and its external RAM.
+static size_t fork_size(const Gameboy *g) {
+  return sizeof(Gameboy) + (g->ext_ram == NULL ? 0 : g->rom->ram_size);
+}
+
+// Returns a new shared memory object of the given size,
+// which is unlinked so it is freed once it is closed and unmapped.
+static int open_shm(size_t size) {
+  // Forks may be made from many threads at once.
+  static atomic_int n = 0;
+  char name[64];
+  int fd = -1;
+  do {
+    snprintf(name, sizeof(name), "/gbfork-%ld-%d", (long)getpid(),
+             atomic_fetch_add_explicit(&n, 1, memory_order_relaxed));
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  } while (fd < 0 && errno == EEXIST);
+  if (fd < 0) {
+    fail("failed to create shared memory: %s", strerror(errno));
+  }
+  shm_unlink(name);
+  if (ftruncate(fd, size) != 0) {
+    fail("failed to resize shared memory: %s", strerror(errno));
+  }
+  return fd;
+}
+
+ForkBase init_fork_base(Gameboy *g) {
+  gameboy_sync(g);
+  size_t size = fork_size(g);
+  int fd = open_shm(size);
+  uint8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    fail("failed to map shared memory: %s", strerror(errno));
+  }
+  Gameboy *frozen = (Gameboy *)p;
+  *frozen = *g;
+  if (frozen->ext_ram != NULL) {
+    frozen->ext_ram = p + sizeof(Gameboy);
+    frozen->ext_ram_mapped = false;
+    memcpy(frozen->ext_ram, g->ext_ram, size - sizeof(Gameboy));
+  }
+  if (mprotect(p, size, PROT_READ) != 0) {
+    fail("failed to protect shared memory: %s", strerror(errno));
+  }
+  return (ForkBase){.fd = fd, .size = size, .g = (const Gameboy *)p};
+}
+
+void free_fork_base(ForkBase *b) {
+  munmap((void *)b->g, b->size);
+  close(b->fd);
+  *b = (ForkBase){.fd = -1};
+}
+
+Gameboy *gameboy_fork(const ForkBase *b) {
+  uint8_t *p =
+      mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, b->fd, 0);
+  if (p == MAP_FAILED) {
+    fail("failed to map fork: %s", strerror(errno));
+  }
+  Gameboy *g = (Gameboy *)p;
+  // The memory map is rebuilt on the first access,
+  // since it was built for a different address.
+  if (g->ext_ram != NULL) {
+    g->ext_ram = p + sizeof(Gameboy);
+  }
+  return g;
+}
+
+void gameboy_release(Gameboy *g) { munmap(g, fork_size(g)); }
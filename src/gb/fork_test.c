@@ -0,0 +1,67 @@
+#include "count_rom_test.h"
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+static void run_fork_test(Engine engine) {
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  run_frame(&g, MCYCLES_PER_FRAME);
+  ForkBase base = init_fork_base(&g);
+  uint64_t base_hash = state_hash(&g);
+
+  Gameboy *a = gameboy_fork(&base);
+  Gameboy *b = gameboy_fork(&base);
+  if (a->ext_ram == g.ext_ram || a->ext_ram == b->ext_ram) {
+    FAIL("forks share external RAM");
+  }
+  run_frame(a, MCYCLES_PER_FRAME);
+  run_frame(&g, MCYCLES_PER_FRAME);
+  if (state_hash(a) != state_hash(&g)) {
+    FAIL("fork state hash %016llx, wanted %016llx",
+         (unsigned long long)state_hash(a), (unsigned long long)state_hash(&g));
+  }
+  char *diff = gameboy_diff(a, &g);
+  if (diff != NULL) {
+    FAIL("fork differs from the original:\n%s", diff);
+  }
+  if (state_hash(b) != base_hash) {
+    FAIL("running a fork changed another fork");
+  }
+  if (state_hash(base.g) != base_hash) {
+    FAIL("running a fork or the original changed the base");
+  }
+
+  // Forks of forks, and forks outliving their base.
+  ForkBase base2 = init_fork_base(a);
+  free_fork_base(&base);
+  Gameboy *c = gameboy_fork(&base2);
+  free_fork_base(&base2);
+  gameboy_release(a);
+  run_frame(c, MCYCLES_PER_FRAME);
+  run_frame(&g, MCYCLES_PER_FRAME);
+  if (state_hash(c) != state_hash(&g)) {
+    FAIL("fork of fork state hash %016llx, wanted %016llx",
+         (unsigned long long)state_hash(c), (unsigned long long)state_hash(&g));
+  }
+  gameboy_release(b);
+  gameboy_release(c);
+  free_gameboy(&g);
+}
+
+int main() {
+  run_fork_test(ENGINE_MCYCLE);
+  run_fork_test(ENGINE_INSTRUCTION);
+  return 0;
+}
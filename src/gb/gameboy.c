@@ -1,12 +1,20 @@
+// Needed for mmap.
+#define _POSIX_C_SOURCE 200809L
+
 #include "gameboy.h"
 
 #include "buf/buffer.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void fail(const char *fmt, ...) {
   va_list args;
@@ -79,38 +87,100 @@ const char *cart_type_string(CartType cart_type) {
   }
 }
 
-Rom read_rom(const char *path) {
-  FILE *in = fopen(path, "r");
-  if (in == NULL) {
-    fail("failed to open %s: %s", path, strerror(errno));
+bool cart_has_battery(CartType cart_type) {
+  switch (cart_type) {
+  case CART_MBC1_RAM_BATTERY:
+  case CART_MBC2_BATTERY:
+  case CART_ROM_RAM_BATTERY:
+  case CART_MMM01_RAM_BATTERY:
+  case CART_MBC3_TIMER_BATTERY:
+  case CART_MBC3_TIMER_RAM_BATTERY:
+  case CART_MBC3_RAM_BATTERY:
+  case CART_MBC5_RAM_BATTERY:
+  case CART_MBC5_RUMBLE_RAM_BATTERY:
+  case CART_MBC7_SENSOR_RUMBLE_RAM_BATTERY:
+  case CART_HuC1_RAM_BATTERY:
+    return true;
+  default:
+    return false;
   }
-  int size = 0;
-  uint8_t *data = NULL;
-  for (;;) {
-    char buf[4096];
-    int n = fread(buf, 1, sizeof(buf), in);
-    data = realloc(data, size + n);
-    memcpy(data + size, buf, n);
-    size += n;
-    if (n < sizeof(buf)) {
-      break;
+}
+
+// Reads all size bytes of the file into newly allocated memory of cap bytes,
+// and fills the rest with $FF.
+static uint8_t *read_all(int fd, const char *path, int size, int cap) {
+  uint8_t *data = malloc(cap > 0 ? cap : 1);
+  if (data == NULL) {
+    fail("failed to allocate %d bytes for %s", cap, path);
+  }
+  memset(data + size, 0xFF, cap - size);
+  int n = 0;
+  while (n < size) {
+    ssize_t m = read(fd, data + n, size - n);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m < 0) {
+      fail("failed to read from %s: %s", path, strerror(errno));
+    }
+    if (m == 0) {
+      fail("failed to read from %s: unexpected end of file", path);
     }
+    n += m;
   }
-  if (ferror(in)) {
-    fail("failed to read from %s: %s", path, strerror(errno));
+  return data;
+}
+
+// Returns the byte of the header at addr,
+// or 0 if it is beyond the end of the ROM data.
+static uint8_t header_byte(const Rom *rom, int addr) {
+  return addr < rom->size ? rom->data[addr] : 0;
+}
+
+Rom read_rom(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fail("failed to open %s: %s", path, strerror(errno));
   }
-  if (fclose(in) != 0) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fail("failed to stat %s: %s", path, strerror(errno));
+  }
+  if (st.st_size > INT_MAX - ROM_BANK_SIZE) {
+    fail("%s is too big: %lld bytes", path, (long long)st.st_size);
+  }
+  Rom rom = {.size = st.st_size};
+  // Banks are served whole from data, so a file ending mid-bank is
+  // read into memory padded with $FF to the end of its last bank.
+  int padded_size =
+      (rom.size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE * ROM_BANK_SIZE;
+  // Otherwise, map the file, so that all processes running the same ROM
+  // share the same memory.
+  void *data = MAP_FAILED;
+  if (rom.size > 0 && rom.size == padded_size) {
+    data = mmap(NULL, rom.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (data != MAP_FAILED) {
+    rom.data = data;
+    rom.mapped = true;
+  } else {
+    rom.data = read_all(fd, path, rom.size, padded_size);
+  }
+  if (close(fd) != 0) {
     fail("failed to close %s: %s", path, strerror(errno));
   }
-  Rom rom = {
-      .data = data,
-      .size = size,
-      .gbc = data[MEM_HEADER_GBC_FLAG],
-      .cart_type = data[MEM_HEADER_CART_TYPE],
-  };
-  memcpy(rom.title, data + MEM_HEADER_TITLE_START, sizeof(rom.title) - 1);
 
-  switch (data[MEM_HEADER_ROM_SIZE]) {
+  rom.gbc = header_byte(&rom, MEM_HEADER_GBC_FLAG);
+  rom.cart_type = header_byte(&rom, MEM_HEADER_CART_TYPE);
+  rom.header_checksum = header_byte(&rom, MEM_HEADER_CHECKSUM);
+  rom.global_checksum = header_byte(&rom, MEM_HEADER_GLOBAL_CHECKSUM) << 8 |
+                        header_byte(&rom, MEM_HEADER_GLOBAL_CHECKSUM + 1);
+  for (int i = 0; i < sizeof(rom.title) - 1; i++) {
+    rom.title[i] = header_byte(&rom, MEM_HEADER_TITLE_START + i);
+  }
+
+  uint8_t rom_size = header_byte(&rom, MEM_HEADER_ROM_SIZE);
+  switch (rom_size) {
   case 0:
     rom.rom_size = 1 << 15;
     rom.num_rom_banks = 2;
@@ -148,11 +218,11 @@ Rom read_rom(const char *path) {
     rom.num_rom_banks = 512;
     break;
   default:
-    fprintf(stderr, "Unknown ROM size indicator: %d\n",
-            data[MEM_HEADER_ROM_SIZE]);
+    fprintf(stderr, "Unknown ROM size indicator: %d\n", rom_size);
   }
 
-  switch (data[MEM_HEADER_RAM_SIZE]) {
+  uint8_t ram_size = header_byte(&rom, MEM_HEADER_RAM_SIZE);
+  switch (ram_size) {
   case 0:
     rom.ram_size = 0;
     break;
@@ -171,23 +241,32 @@ Rom read_rom(const char *path) {
   case 1:
   // unused -- fallthrough intended
   default:
-    fprintf(stderr, "Unknown RAM size indicator: %d\n",
-            data[MEM_HEADER_RAM_SIZE]);
+    fprintf(stderr, "Unknown RAM size indicator: %d\n", ram_size);
   }
+  // The header is only read from the file itself.
+  rom.size = padded_size;
   return rom;
 }
 
-void free_rom(Rom *rom) { free((void *)rom->data); }
+void free_rom(Rom *rom) {
+  if (rom->mapped) {
+    munmap((void *)rom->data, rom->size);
+  } else {
+    free((void *)rom->data);
+  }
+  rom->data = NULL;
+}
 
 Gameboy init_gameboy(const Rom *rom) {
   Gameboy g = {};
   g.rom = rom;
-
-  int rom_size = MEM_ROM_END + 1;
-  if (rom->size < rom_size) {
-    rom_size = rom->size;
+  g.mbc.rom_bank = 1;
+  if (rom->ram_size > 0) {
+    g.ext_ram = calloc(1, rom->ram_size);
+    if (g.ext_ram == NULL) {
+      fail("failed to allocate %d bytes of external RAM", rom->ram_size);
+    }
   }
-  memcpy(g.mem, rom->data, rom_size);
 
   // Starting state of DMG after running the boot ROM and ending at 0x0101.
   g.cpu.registers[REG_B] = 0x00;
@@ -212,6 +291,67 @@ Gameboy init_gameboy(const Rom *rom) {
   return g;
 }
 
+void free_gameboy(Gameboy *g) {
+  if (g->ext_ram_mapped) {
+    sync_save_file(g);
+    munmap(g->ext_ram, g->rom->ram_size);
+  } else {
+    free(g->ext_ram);
+  }
+  g->ext_ram = NULL;
+  g->ext_ram_mapped = false;
+}
+
+char *save_file_path(const char *rom_path) {
+  const char *base = strrchr(rom_path, '/');
+  base = base == NULL ? rom_path : base + 1;
+  const char *ext = strrchr(base, '.');
+  int n = ext == NULL ? strlen(rom_path) : ext - rom_path;
+  char *path = malloc(n + sizeof(".sav"));
+  if (path == NULL) {
+    fail("failed to allocate save file path");
+  }
+  memcpy(path, rom_path, n);
+  strcpy(path + n, ".sav");
+  return path;
+}
+
+void map_save_file(Gameboy *g, const char *path) {
+  int size = g->rom->ram_size;
+  if (size == 0 || g->ext_ram_mapped) {
+    return;
+  }
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    fail("failed to open %s: %s", path, strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fail("failed to stat %s: %s", path, strerror(errno));
+  }
+  // Only ever grow the file, so a save for a different RAM size is kept.
+  if (st.st_size < size && ftruncate(fd, size) != 0) {
+    fail("failed to resize %s: %s", path, strerror(errno));
+  }
+  void *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ram == MAP_FAILED) {
+    fail("failed to map %s: %s", path, strerror(errno));
+  }
+  if (close(fd) != 0) {
+    fail("failed to close %s: %s", path, strerror(errno));
+  }
+  free(g->ext_ram);
+  g->ext_ram = ram;
+  g->ext_ram_mapped = true;
+  mem_map_cart_changed(g);
+}
+
+void sync_save_file(const Gameboy *g) {
+  if (g->ext_ram_mapped && msync(g->ext_ram, g->rom->ram_size, MS_SYNC) != 0) {
+    fail("failed to sync save file: %s", strerror(errno));
+  }
+}
+
 static void do_oam_dma(Gameboy *g) {
   if (g->dma_ticks_remaining <= 0) {
     return;
@@ -223,22 +363,44 @@ static void do_oam_dma(Gameboy *g) {
   uint16_t offs = DMA_MCYCLES - g->dma_ticks_remaining;
   uint16_t src = g->mem[MEM_DMA] * 0x100 + offs;
   uint16_t dst = MEM_OAM_START + offs;
-  g->mem[dst] = g->mem[src];
+  g->mem[dst] = gameboy_peek(g, src);
   g->dma_ticks_remaining--;
+  if (g->dma_ticks_remaining == 0) {
+    mem_map_invalidate(g);
+  }
+}
+
+static int tima_shift(const Gameboy *g) {
+  return 2 * (g->mem[MEM_TAC] & TAC_FREQ_MASK) + 1;
 }
 
 // Returns the value of the tima counter bit, which is AND
 // of the TIMA enabled bit of TAC and the corresponding
 // frequency bit of the system counter.
 static bool tima_bit(const Gameboy *g) {
-  int tima_shift = 2 * (g->mem[MEM_TAC] & TAC_FREQ_MASK) + 1;
-  bool counter_bit = (g->counter >> tima_shift) & 0x1;
+  bool counter_bit = (g->counter >> tima_shift(g)) & 0x1;
   bool tima_enabled = g->mem[MEM_TAC] & TAC_TIMA_ENABLED;
   return counter_bit && tima_enabled;
 }
 
+// Increments TIMA n times, reloading it from TMA
+// and requesting a timer interrupt each time it overflows.
+static void inc_tima(Gameboy *g, int n) {
+  while (n > 0) {
+    int room = 0x100 - g->mem[MEM_TIMA];
+    if (n < room) {
+      g->mem[MEM_TIMA] += n;
+      return;
+    }
+    n -= room;
+    g->mem[MEM_TIMA] = g->mem[MEM_TMA];
+    g->mem[MEM_IF] |= IF_TIMER;
+  }
+}
+
 static bool inc_counter(Gameboy *g, bool tima_bit_start) {
   g->counter++;
+  g->tcycles++;
   g->mem[MEM_DIV] = g->counter >> 8;
 
   // TIMA increments based on a falling edge,
@@ -246,34 +408,255 @@ static bool inc_counter(Gameboy *g, bool tima_bit_start) {
   // and compare to the current.
   bool tima_bit_end = tima_bit(g);
   if (tima_bit_start && !tima_bit_end) {
-    g->mem[MEM_TIMA]++;
-    if (g->mem[MEM_TIMA] == 0) {
-      g->mem[MEM_TIMA] = g->mem[MEM_TMA];
-      g->mem[MEM_IF] |= IF_TIMER;
-    }
+    inc_tima(g, 1);
   }
   return tima_bit_end;
 }
 
-void mcycle(Gameboy *g) {
+// Increments the counter n times; the same as n calls to inc_counter.
+static bool advance_counter(Gameboy *g, int n, bool tima_bit_start) {
+  if (n == 0) {
+    return tima_bit_start;
+  }
+  // The first increment can see a falling edge from a TIMA bit
+  // that was changed by the CPU writing DIV or TAC.
+  inc_counter(g, tima_bit_start);
+  n--;
+  // After that, the TIMA bit only falls when the counter
+  // reaches a multiple of twice the frequency bit.
+  if (g->mem[MEM_TAC] & TAC_TIMA_ENABLED) {
+    int shift = tima_shift(g) + 1;
+    inc_tima(g, ((g->counter + n) >> shift) - (g->counter >> shift));
+  }
+  g->counter += n;
+  g->tcycles += n;
+  g->mem[MEM_DIV] = g->counter >> 8;
+  return tima_bit(g);
+}
+
+// Returns a lower bound on the number of counter increments
+// until TIMA next overflows, or INT_MAX if it cannot.
+static int tima_overflow_tcycles(const Gameboy *g, bool tima_bit_start) {
+  if (!(g->mem[MEM_TAC] & TAC_TIMA_ENABLED)) {
+    return INT_MAX;
+  }
+  if (tima_bit_start != tima_bit(g)) {
+    return 1;
+  }
+  int period = 2 << tima_shift(g);
+  int first = period - g->counter % period;
+  return first + (0xFF - g->mem[MEM_TIMA]) * period;
+}
+
+// Runs the part of an M cycle that precedes the CPU's.
+//
+// We increment the counter once before calling cpu_mcycle,
+// so that if the CPU writes to DIV, resetting the counter,
+// the reset resets this single count.
+// Additionally, TIMA is incremented based on a falling edge detector
+// so we need to track the previous bit value of tima_bit()
+// and pass it to inc_counter so it can detect a falling edge.
+static void start_mcycle(Gameboy *g) {
+  g->tima_bit = inc_counter(g, tima_bit(g));
+}
+
+// Runs the part of an M cycle that follows the CPU's.
+static void finish_mcycle(Gameboy *g) {
+  do_oam_dma(g);
+  ppu_tcycle(g);
+
+  for (int i = 0; i < 3; i++) {
+    ppu_tcycle(g);
+    g->tima_bit = inc_counter(g, g->tima_bit);
+  }
+}
+
+static bool cpu_in_instruction(const Gameboy *g) {
+  return g->cpu.state == EXECUTING || g->cpu.state == INTERRUPTING;
+}
+
+static int run_mcycles(Gameboy *g) {
+  int n = 0;
   do {
-    // We increment the counter once before calling cpu_mcycle,
-    // so that if the CPU writes to DIV, resetting the counter,
-    // the reset resets this single count.
-    // Additionally, TIMA is incremented based on a falling edge detector
-    // so we need to track the previous bit value of tima_bit()
-    // and pass it to inc_counter so it can detect a falling edge.
-    bool tb = inc_counter(g, tima_bit(g));
+    start_mcycle(g);
+    cpu_mcycle(g);
+    finish_mcycle(g);
+    n++;
+  } while (cpu_in_instruction(g));
+  return n;
+}
 
+enum {
+  // The most halves of M cycles that the CPU runs ahead,
+  // even if nothing else is scheduled.
+  MAX_LAG = 1 << 16,
+};
+
+// Returns a lower bound on the number of halves of M cycles
+// until the given T cycle of the rest of the system,
+// counting from 1.
+static int tcycle_halves(int t) {
+  if (t == INT_MAX) {
+    return MAX_LAG;
+  }
+  // Every other half has 4 T cycles of the PPU, or 3 of the counter,
+  // and the others 1 of the counter.
+  int halves = 2 * ((t + 3) / 4) - 1;
+  return halves < MAX_LAG ? halves : MAX_LAG;
+}
+
+// Returns a lower bound on the number of halves of M cycles
+// until the rest of the system next raises an enabled interrupt.
+static int schedule(const Gameboy *g) {
+  if (g->dma_ticks_remaining > 0) {
+    // DMA doesn't raise interrupts, but it can't be advanced in bulk,
+    // so don't let the CPU get far ahead.
+    return 1;
+  }
+  uint8_t enabled = g->mem[MEM_IE];
+  int next = MAX_LAG;
+  if (enabled & (IF_VBLANK | IF_LCD)) {
+    int ppu = tcycle_halves(ppu_irq_tcycles(g, enabled));
+    next = ppu < next ? ppu : next;
+  }
+  if (enabled & IF_TIMER) {
+    bool tima_bit_start = g->mid_mcycle ? g->tima_bit : tima_bit(g);
+    int timer = tcycle_halves(tima_overflow_tcycles(g, tima_bit_start));
+    next = timer < next ? timer : next;
+  }
+  return next;
+}
+
+// Runs the lagging halves of M cycles of the rest of the system,
+// and schedules the next event.
+static void catch_up(Gameboy *g) {
+  // OAM DMA copies a byte each M cycle, so step through it.
+  for (; g->lag > 0 && g->dma_ticks_remaining > 0; g->lag--) {
+    if (g->mid_mcycle) {
+      finish_mcycle(g);
+    } else {
+      start_mcycle(g);
+    }
+    g->mid_mcycle = !g->mid_mcycle;
+  }
+  if (g->lag > 0) {
+    // The counter and the PPU don't interact,
+    // so each can be advanced all at once.
+    int finishes = g->mid_mcycle ? (g->lag + 1) / 2 : g->lag / 2;
+    int starts = g->lag - finishes;
+    bool tima_bit_start = g->mid_mcycle ? g->tima_bit : tima_bit(g);
+    g->tima_bit = advance_counter(g, starts + 3 * finishes, tima_bit_start);
+    ppu_advance(g, 4 * finishes);
+    g->mid_mcycle = g->mid_mcycle != (g->lag % 2 == 1);
+    g->lag = 0;
+  }
+  g->next_event = schedule(g);
+}
+
+uint64_t gameboy_tcycles(const Gameboy *g) {
+  // As catch_up advances the counter.
+  int finishes = g->mid_mcycle ? (g->lag + 1) / 2 : g->lag / 2;
+  int starts = g->lag - finishes;
+  return g->tcycles + starts + 3 * finishes;
+}
+
+void gameboy_sync(Gameboy *g) {
+  if (g->lag > 0) {
+    catch_up(g);
+  }
+}
+
+// Returns the number of M cycles that the CPU can stay halted
+// before the rest of the system needs to catch up,
+// because it may raise an interrupt that wakes the CPU.
+static int halted_mcycles(const Gameboy *g) {
+  if (g->cpu.state != HALTED || g->mem[MEM_IF] & g->mem[MEM_IE]) {
+    return 0;
+  }
+  // The CPU checks for interrupts after the first half of each M cycle.
+  int n = (g->next_event - g->lag) / 2;
+  return n > 0 ? n : 0;
+}
+
+static int run_instruction(Gameboy *g) {
+  // A halted CPU does nothing until an interrupt is pending,
+  // so skip ahead to the next M cycle that might raise one.
+  int n = halted_mcycles(g);
+  if (n > 0) {
+    g->lag += 2 * n;
+    return n;
+  }
+  do {
+    g->lag++;
+    // Calling an interrupt reads IF directly, not through fetch,
+    // and a higher priority interrupt can arrive while it is in progress.
+    if (g->lag >= g->next_event || g->cpu.state == INTERRUPTING) {
+      catch_up(g);
+    }
     cpu_mcycle(g);
-    do_oam_dma(g);
-    ppu_tcycle(g);
+    g->lag++;
+    n++;
+  } while (cpu_in_instruction(g));
+  return n;
+}
 
-    for (int i = 0; i < 3; i++) {
-      ppu_tcycle(g);
-      tb = inc_counter(g, tb);
+static int run_lockstep(Gameboy *g) {
+  // Only g counts stats, not the copies of it that run alongside.
+  Gameboy want = *g;
+  want.stats = NULL;
+  // want runs the instruction again after g, so it needs its own external RAM,
+  // or read-modify-writes of it would be applied twice.
+  int ext_ram_size = g->ext_ram == NULL ? 0 : g->rom->ram_size;
+  if (ext_ram_size > 0) {
+    want.ext_ram = malloc(ext_ram_size);
+    if (want.ext_ram == NULL) {
+      fail("failed to allocate external RAM");
     }
-  } while (g->cpu.state == EXECUTING || g->cpu.state == INTERRUPTING);
+    memcpy(want.ext_ram, g->ext_ram, ext_ram_size);
+    want.ext_ram_mapped = false;
+  }
+  gameboy_sync(&want);
+  want.engine = ENGINE_MCYCLE;
+  int n = run_instruction(g);
+  // ENGINE_INSTRUCTION can skip many M cycles of a halted CPU at once.
+  int want_n = 0;
+  do {
+    want_n += run_mcycles(&want);
+  } while (want_n < n);
+  // Compare a synced copy, so that g keeps running ahead as it would under
+  // ENGINE_INSTRUCTION.
+  Gameboy got = *g;
+  got.stats = NULL;
+  gameboy_sync(&got);
+  char *diff = gameboy_diff(&got, &want);
+  if (diff != NULL || n != want_n) {
+    fail("ENGINE_INSTRUCTION diverged from ENGINE_MCYCLE at PC $%04X "
+         "(%d M cycles, wanted %d):\n%s",
+         g->cpu.pc, n, want_n, diff == NULL ? "" : diff);
+  }
+  if (ext_ram_size > 0) {
+    free(want.ext_ram);
+  }
+  return n;
+}
+
+int mcycle(Gameboy *g) {
+  int n = 0;
+  switch (g->engine) {
+  case ENGINE_INSTRUCTION:
+    n = run_instruction(g);
+    break;
+  case ENGINE_LOCKSTEP:
+    n = run_lockstep(g);
+    break;
+  default:
+    n = run_mcycles(g);
+    break;
+  }
+  if (g->stats != NULL) {
+    g->stats->mcycles += n;
+  }
+  return n;
 }
 
 char *gameboy_diff(const Gameboy *a, const Gameboy *b) {
@@ -350,6 +733,20 @@ char *gameboy_diff(const Gameboy *a, const Gameboy *b) {
       }
     }
   }
+  if (a->ppu.wy_hit != b->ppu.wy_hit) {
+    bprintf(&buf, "ppu.wy_hit: %d != %d\n", a->ppu.wy_hit, b->ppu.wy_hit);
+  }
+  if (a->ppu.win_line != b->ppu.win_line) {
+    bprintf(&buf, "ppu.win_line: %d != %d\n", a->ppu.win_line,
+            b->ppu.win_line);
+  }
+  if (a->ppu.mode3_extra != b->ppu.mode3_extra) {
+    bprintf(&buf, "ppu.mode3_extra: %d != %d\n", a->ppu.mode3_extra,
+            b->ppu.mode3_extra);
+  }
+  if (memcmp(&a->ppu.fifo, &b->ppu.fifo, sizeof(PixelFifo)) != 0) {
+    bprintf(&buf, "ppu.fifo differs\n");
+  }
   if (a->dma_ticks_remaining != b->dma_ticks_remaining) {
     bprintf(&buf, "dma_ticks_remaining: %d != %d\n", a->dma_ticks_remaining,
             b->dma_ticks_remaining);
@@ -360,6 +757,26 @@ char *gameboy_diff(const Gameboy *a, const Gameboy *b) {
   if (a->dpad != b->dpad) {
     bprintf(&buf, "dpad: %02X != %02X\n", a->dpad, b->dpad);
   }
+  if (a->mbc.rom_bank0 != b->mbc.rom_bank0) {
+    bprintf(&buf, "mbc.rom_bank0: %d != %d\n", a->mbc.rom_bank0,
+            b->mbc.rom_bank0);
+  }
+  if (a->mbc.rom_bank != b->mbc.rom_bank) {
+    bprintf(&buf, "mbc.rom_bank: %d != %d\n", a->mbc.rom_bank,
+            b->mbc.rom_bank);
+  }
+  if (a->mbc.ram_bank != b->mbc.ram_bank) {
+    bprintf(&buf, "mbc.ram_bank: %d != %d\n", a->mbc.ram_bank,
+            b->mbc.ram_bank);
+  }
+  if (a->mbc.ram_enabled != b->mbc.ram_enabled) {
+    bprintf(&buf, "mbc.ram_enabled: %d != %d\n", a->mbc.ram_enabled,
+            b->mbc.ram_enabled);
+  }
+  if (a->tcycles != b->tcycles) {
+    bprintf(&buf, "tcycles: %llu != %llu\n", (unsigned long long)a->tcycles,
+            (unsigned long long)b->tcycles);
+  }
   if (a->counter != b->counter) {
     bprintf(&buf, "counter: %d != %d\n", a->counter, b->counter);
   }
@@ -369,6 +786,14 @@ char *gameboy_diff(const Gameboy *a, const Gameboy *b) {
               a->mem[i], b->mem[i], b->mem[i]);
     }
   }
+  if (a->ext_ram != NULL && b->ext_ram != NULL && a->rom == b->rom) {
+    for (int i = 0; i < a->rom->ram_size; i++) {
+      if (a->ext_ram[i] != b->ext_ram[i]) {
+        bprintf(&buf, "ext_ram[$%05X]: %d ($%02X) != %d ($%02X)\n", i,
+                a->ext_ram[i], a->ext_ram[i], b->ext_ram[i], b->ext_ram[i]);
+      }
+    }
+  }
 
   // Try to print a nicer diff of the LCD.
   int ymin = SCREEN_HEIGHT;
@@ -415,3 +840,63 @@ char *gameboy_diff(const Gameboy *a, const Gameboy *b) {
   }
   return buf.data;
 }
+
+void stats_add_frame_ns(GameboyStats *s, double ns) {
+  s->ns += ns;
+  if (ns > s->max_frame_ns) {
+    s->max_frame_ns = ns;
+  }
+}
+
+// The memory regions that stats_report sums CPU memory accesses over.
+// Each is a whole number of pages, so some regions are merged.
+static const struct {
+  const char *name;
+  uint16_t start, end;
+} stats_regions[] = {
+    {"rom0", MEM_ROM0_START, MEM_ROM0_END},
+    {"rom_n", MEM_ROM_N_START, MEM_ROM_N_END},
+    {"vram", MEM_TILE_BLOCK0_START, MEM_TILE_MAP1_END},
+    {"ext_ram", MEM_EXT_RAM_START, MEM_EXT_RAM_END},
+    {"wram", MEM_WRAM_START, MEM_WRAM_END},
+    {"echo_ram", MEM_ECHO_RAM_START, MEM_ECHO_RAM_END},
+    // OAM and the prohibited area.
+    {"oam", MEM_OAM_START, MEM_PROHIBITED_END},
+    // I/O, high RAM, and IE.
+    {"io_high_ram", MEM_IO_START, MEM_IE},
+};
+
+static long sum_pages(const long *counts, uint16_t start, uint16_t end) {
+  long n = 0;
+  for (int i = start / MEM_PAGE_SIZE; i <= end / MEM_PAGE_SIZE; i++) {
+    n += counts[i];
+  }
+  return n;
+}
+
+char *stats_report(const GameboyStats *s) {
+  static const char *mode_names[] = {
+      [HBLANK] = "hblank",
+      [VBLANK] = "vblank",
+      [OAM_SCAN] = "oam_scan",
+      [DRAWING] = "drawing",
+  };
+  Buffer buf = {};
+  bprintf(&buf, "instructions %ld\n", s->instructions);
+  bprintf(&buf, "mcycles %ld\n", s->mcycles);
+  bprintf(&buf, "frames %ld\n", s->ppu_modes[VBLANK]);
+  for (int i = 0; i < 4; i++) {
+    bprintf(&buf, "ppu_modes.%s %ld\n", mode_names[i], s->ppu_modes[i]);
+  }
+  for (int i = 0; i < sizeof(stats_regions) / sizeof(stats_regions[0]); i++) {
+    uint16_t start = stats_regions[i].start;
+    uint16_t end = stats_regions[i].end;
+    bprintf(&buf, "fetches.%s %ld\n", stats_regions[i].name,
+            sum_pages(s->fetches, start, end));
+    bprintf(&buf, "stores.%s %ld\n", stats_regions[i].name,
+            sum_pages(s->stores, start, end));
+  }
+  bprintf(&buf, "ns %.0f\n", s->ns);
+  bprintf(&buf, "max_frame_ns %.0f\n", s->max_frame_ns);
+  return buf.data;
+}
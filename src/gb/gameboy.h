@@ -23,6 +23,9 @@ enum : uint16_t {
   MEM_HEADER_CART_TYPE = 0x0147,
   MEM_HEADER_ROM_SIZE = 0x0148,
   MEM_HEADER_RAM_SIZE = 0x0149,
+  MEM_HEADER_CHECKSUM = 0x014D,
+  // The 2-byte, big-endian, checksum of the entire ROM.
+  MEM_HEADER_GLOBAL_CHECKSUM = 0x014E,
 
   // Rom bank N (depending which is mapped in by the Memory Bank Controller.)
   MEM_ROM_N_START = 0x4000,
@@ -91,7 +94,11 @@ enum : uint16_t {
   LCDC_OBJ_ENABLED = 1 << 1,
   LCDC_OBJ_SIZE = 1 << 2,
   LCDC_BG_TILE_MAP = 1 << 3,
+  // If set, background and window tile numbers index block 0-1,
+  // otherwise they are signed and index blocks 1-2.
+  LCDC_TILE_DATA = 1 << 4,
   LCDC_WIN_ENABLED = 1 << 5,
+  LCDC_WIN_TILE_MAP = 1 << 6,
   LCDC_ENABLED = 1 << 7,
 
   MEM_STAT = 0xFF41,
@@ -169,20 +176,36 @@ typedef enum {
 
 const char *cart_type_string(CartType cart_type);
 
+// Returns whether carts of this type have a battery
+// to keep external RAM between power offs.
+bool cart_has_battery(CartType cart_type);
+
 typedef struct {
   const uint8_t *data;
+  // The size of data, which is whole ROM banks for a Rom from read_rom.
   int size;
+  // Whether data is mapped read-only from the ROM file,
+  // rather than allocated.
+  bool mapped;
   char title[MEM_HEADER_TITLE_END - MEM_HEADER_TITLE_START + 1];
   bool gbc;
   CartType cart_type;
   int rom_size;
   int num_rom_banks;
   int ram_size;
+  uint8_t header_checksum;
+  uint16_t global_checksum;
 } Rom;
 
 // Reads and returns the Rom at path.
 // If there is an error reading the file, fail() is called.
-// The memory allocated for the returned Rom
+// The file is mapped into memory if possible,
+// so that processes running the same ROM share it,
+// and otherwise read into allocated memory.
+// A file that does not end on a ROM bank boundary is read into memory
+// padded with $FF to the end of its last bank.
+// Header fields beyond the end of a short file read as 0.
+// The memory for the returned Rom
 // can be freed with free_rom();
 Rom read_rom(const char *path);
 
@@ -334,6 +357,11 @@ enum {
   TILE_BIG_HEIGHT = 16,
   TILE_MAP_WIDTH = 32,
   TILE_MAP_HEIGHT = 32,
+  // The tiles in VRAM tile blocks 0-2, 16 bytes each.
+  NUM_TILES = 384,
+  TILE_SIZE = 16,
+  // A BGP or OBP value that maps each color index to itself.
+  PALLET_IDENTITY = 0xE4,
 
   OBJ_FLAG_PRIO = 1 << 7,
   OBJ_FLAG_Y_FLIP = 1 << 6,
@@ -357,13 +385,61 @@ typedef struct {
   uint8_t flags;
 } Object;
 
+// The state of a PPU_FIFO PPU part way through drawing a line.
+// Fields are fixed-width, as they are saved in save states as is.
+typedef struct {
+  // Color indices of background pixels, of which the last bg_n
+  // are waiting to be drawn.
+  uint8_t bg[TILE_WIDTH];
+  uint8_t bg_n;
+  // Object pixels to mix with the next 8 drawn pixels,
+  // each a color index and flags (see OBJ_PX_* in ppu.c), or 0 if none.
+  uint8_t obj[TILE_WIDTH];
+  // The number of pixels drawn to the line.
+  uint8_t x;
+  // The number of pixels yet to drop from the start of the line,
+  // or of the window, before drawing.
+  uint8_t discard;
+  // T cycles left until drawing resumes after fetching objects.
+  uint8_t stall;
+  // The index in Ppu.objs of the next object to fetch.
+  uint8_t next_obj;
+  // Whether the background fetcher is fetching the window.
+  uint8_t in_window;
+  // The step of the background fetcher, counted in T cycles,
+  // and the tile column that it is fetching, relative to SCX or the window.
+  uint8_t fetch_step;
+  uint8_t fetch_x;
+  // The address of the tile row being fetched, and its bytes.
+  uint16_t fetch_addr;
+  uint8_t fetch_low;
+  uint8_t fetch_high;
+} PixelFifo;
+
 typedef struct {
   // Ticks counts the number of tcycles in the current mode.
   // (Mode is the lower 2 bits of the STAT register.)
   int ticks;
-  // Objects on the current scanline.
+  // Objects on the current scanline, in drawing priority order:
+  // sorted by X, and by OAM order for equal X.
   Object objs[MAX_SCANLINE_OBJS];
   int nobjs;
+  // Whether LY has equaled WY this frame; the window shows only after.
+  bool wy_hit;
+  // The next line of the window to draw. Unlike LY-WY,
+  // it only counts lines on which the window was drawn.
+  int win_line;
+  // Tiles decoded from VRAM to a color index per pixel,
+  // each valid only if its tile_decoded is set.
+  // Stores to tile data clear tile_decoded; see ppu_tile_changed.
+  uint8_t tiles[NUM_TILES][TILE_HEIGHT][TILE_WIDTH];
+  bool tile_decoded[NUM_TILES];
+  // Under PPU_FIFO, the number of T cycles that drawing the current line
+  // took beyond the 171 of PPU_SCANLINE. HBLANK is that much shorter,
+  // so lines take the same time either way.
+  int mode3_extra;
+  // Used under PPU_FIFO.
+  PixelFifo fifo;
 } Ppu;
 
 enum {
@@ -384,12 +460,212 @@ enum {
   DMA_MCYCLES = 160,
 };
 
+enum {
+  EXT_RAM_BANK_SIZE = MEM_EXT_RAM_END - MEM_EXT_RAM_START + 1,
+
+  // MBC3 real-time clock registers, selected by RAM bank numbers.
+  RTC_S = 0x08,
+  RTC_M = 0x09,
+  RTC_H = 0x0A,
+  RTC_DL = 0x0B,
+  RTC_DH = 0x0C,
+  NUM_RTC_REGS = RTC_DH - RTC_S + 1,
+
+  // Bits of RTC_DH.
+  RTC_DH_DAY_HIGH = 1 << 0,
+  RTC_DH_HALT = 1 << 6,
+  RTC_DH_DAY_CARRY = 1 << 7,
+
+  // The RTC counts seconds of emulated time, not host time,
+  // so that runs are deterministic.
+  RTC_TCYCLES_PER_SECOND = 1 << 22,
+};
+
+// The MBC3 real-time clock.
+typedef struct {
+  // The clock registers, indexed by register number - RTC_S.
+  uint8_t regs[NUM_RTC_REGS];
+  // The registers as of the last latch, which is what the CPU reads.
+  uint8_t latched[NUM_RTC_REGS];
+  // The value of Gameboy.tcycles when regs were last brought up to date.
+  // The clock is only brought up to date when it is accessed.
+  uint64_t synced;
+  // T cycles into the current second.
+  int subsecond;
+} Rtc;
+
+// The state of the cartridge's memory bank controller.
+// See mbc.c for the mapper of each CartType.
+typedef struct {
+  // Registers written by the CPU through the ROM address space.
+  // Their meaning depends on the mapper.
+  bool ram_enabled;
+  uint16_t rom_bank_reg;
+  uint8_t ram_bank_reg;
+  bool mode;
+  uint8_t latch;
+
+  // The ROM banks mapped at MEM_ROM0_START and MEM_ROM_N_START.
+  int rom_bank0;
+  int rom_bank;
+  // The external RAM bank mapped at MEM_EXT_RAM_START, 0-15.
+  int ram_bank;
+  // The MBC3 RTC register mapped at MEM_EXT_RAM_START instead of RAM, or 0.
+  int rtc_reg;
+
+  Rtc rtc;
+} Mbc;
+
+enum {
+  SERIAL_OUT_SIZE = 1024,
+  // Writing this to MEM_SERIAL_CONTROL starts a transfer
+  // using the internal clock.
+  SERIAL_START_INTERNAL = 0x81,
+};
+
+// How mcycle executes the Gameboy.
+typedef enum {
+  // Each M cycle of the CPU is followed by the corresponding 4 T cycles
+  // of the rest of the system. This is the default.
+  ENGINE_MCYCLE,
+  // The CPU runs ahead of the rest of the system,
+  // which is then advanced in bulk before it can next raise an interrupt,
+  // or sooner, if the CPU accesses memory that depends on it.
+  // Call gameboy_sync before inspecting the Gameboy after mcycle.
+  // The result is the same as ENGINE_MCYCLE.
+  ENGINE_INSTRUCTION,
+  // Runs ENGINE_MCYCLE and ENGINE_INSTRUCTION in lockstep,
+  // comparing them with gameboy_diff after each instruction
+  // and calling fail() if they differ.
+  ENGINE_LOCKSTEP,
+} Engine;
+
+// How the PPU draws lines.
+typedef enum {
+  // Each line is drawn all at once at the end of drawing mode,
+  // which always takes the same time. This is the default.
+  PPU_SCANLINE,
+  // Each line is drawn a pixel per T cycle through a pixel FIFO,
+  // as by the hardware, so registers written while drawing
+  // take effect part way through the line, and drawing mode takes longer
+  // with fine scrolling, objects, and the window.
+  // Slower than PPU_SCANLINE, but more accurate.
+  PPU_FIFO,
+} PpuModel;
+
+enum { MEM_PAGE_SIZE = 0x100, NUM_MEM_PAGES = MEM_SIZE / MEM_PAGE_SIZE };
+
+// The CPU's view of memory as a table of 256-byte pages,
+// indexed by the high byte of the address.
+// Pages that the CPU can currently read or write as plain memory
+// point directly at the backing bytes.
+// All other pages are NULL, and accesses to them go through
+// the handler of the memory region containing the address.
+typedef struct {
+  // The address of the Gameboy that the map was built for.
+  // If this is not the address of the Gameboy holding the map,
+  // the map is stale and is rebuilt before the next CPU memory access.
+  // This is the case for a zero-initialized Gameboy
+  // and for a Gameboy that was copied from another.
+  const void *owner;
+  const uint8_t *fetch[NUM_MEM_PAGES];
+  uint8_t *store[NUM_MEM_PAGES];
+} MemMap;
+
+// An instruction run, and the M cycles spent running it,
+// at the ROM bank and address of a key, as from profile_key.
+typedef struct {
+  uint32_t key;
+  long mcycles;
+} ProfileCount;
+
+// A call in a Profile's call tree,
+// to the routine at the ROM bank and address of a key, as from profile_key.
+typedef struct {
+  uint32_t key;
+  // The index of the calling node, or -1 for the root.
+  int parent;
+  // The M cycles spent in this call but not in the calls it made.
+  long self;
+} ProfileNode;
+
+// A profile of the code run by a Gameboy's CPU, which attributes the M cycles
+// of each instruction to its address and ROM bank, and to the stack of calls
+// leading to it, as tracked by CALL, RST, interrupt dispatch, and RET.
+// M cycles spent halted are not attributed.
+// Calls are matched to RETs by the stack pointer,
+// so code that returns some other way leaves the tree too deep.
+typedef struct {
+  // M cycles by instruction, a hash table of cap entries,
+  // a power of 2, in which unused entries have key 0.
+  ProfileCount *counts;
+  int ncounts;
+  int counts_cap;
+
+  // The call tree, with the root at index 0,
+  // and the indices+1 of its nodes, hashed by parent and key,
+  // in a table of slots_cap entries, a power of 2.
+  ProfileNode *nodes;
+  int nnodes;
+  int nodes_cap;
+  int *slots;
+  int slots_cap;
+  // The node of the running code, its depth,
+  // and the number of calls made deeper than PROFILE_MAX_DEPTH,
+  // which are not in the tree.
+  int node;
+  int depth;
+  int lost;
+
+  // The key and the SP at the start of the running instruction.
+  uint32_t start;
+  uint16_t start_sp;
+} Profile;
+
+enum { PROFILE_MAX_DEPTH = 64 };
+
+// Counts of what a Gameboy has done, for profiling.
+// Counting costs an increment per instruction, CPU memory access,
+// and PPU mode change, and nothing if Gameboy.stats is NULL.
+typedef struct {
+  long instructions;
+  long mcycles;
+  // CPU memory accesses, by page; see MemMap.
+  long fetches[NUM_MEM_PAGES];
+  long stores[NUM_MEM_PAGES];
+  // Changes to each PpuMode.
+  // A frame is a change to VBLANK.
+  long ppu_modes[4];
+
+  // The wall time spent running, and the most spent running one frame,
+  // in nanoseconds.
+  // These are not counted by the Gameboy, but by its caller,
+  // which can read the clock once per frame.
+  double ns;
+  double max_frame_ns;
+
+  // If non-NULL, the CPU also fills in this Profile.
+  Profile *profile;
+} GameboyStats;
+
 typedef struct {
   Cpu cpu;
   Ppu ppu;
   Mem mem;
+  MemMap mem_map;
   int dma_ticks_remaining;
   const Rom *rom;
+  // ROM is not copied into mem; the CPU reads it from rom->data
+  // through the banks selected by mbc.
+  // If rom or its data is NULL, for example in tests,
+  // mem is used for both ROM and external RAM instead.
+  Mbc mbc;
+  // The cartridge's rom->ram_size bytes of external RAM,
+  // or NULL if it has none.
+  // Copies of a Gameboy share the same external RAM.
+  uint8_t *ext_ram;
+  // Whether ext_ram is mapped from a save file; see map_save_file.
+  bool ext_ram_mapped;
   uint8_t lcd[SCREEN_HEIGHT][SCREEN_WIDTH];
 
   // Bit mask of BUTTON_{A, B, START, SELECT}.
@@ -400,12 +676,51 @@ typedef struct {
   // A 1 bit means the button is pressed.
   uint8_t dpad;
 
+  // The bytes sent over the serial port since serial_len was reset to 0,
+  // which test ROMs use to report results.
+  // Bytes sent once it is full are dropped.
+  uint8_t serial_out[SERIAL_OUT_SIZE];
+  int serial_len;
+
   // The system counter is incremented ever T-cycle.
   // The DIV register is the upper 8 bits of the counter.
   uint16_t counter;
 
+  // The number of T cycles that the counter has run,
+  // which is not reset by writing DIV.
+  uint64_t tcycles;
+
+  // The TIMA bit (see tima_bit() in gameboy.c) as of the last counter
+  // increment, for detecting falling edges across the CPU's part of an M
+  // cycle.
+  bool tima_bit;
+
+  Engine engine;
+  // Like engine, set this after init_gameboy, before running.
+  PpuModel ppu_model;
+
+  // The rest of the system is run in two halves for each M cycle of the CPU:
+  // the counter increment before the CPU's part, and the rest after it.
+  // Under ENGINE_INSTRUCTION, lag is the number of these halves
+  // that the rest of the system is behind the CPU.
+  int lag;
+
+  // Whether the rest of the system has run the first half of an M cycle,
+  // but not the second.
+  bool mid_mcycle;
+
+  // A lower bound on the number of halves of M cycles
+  // after which the rest of the system can next raise an enabled interrupt.
+  // The CPU runs ahead at most this far before catching the rest up.
+  // Set to 0 to reschedule after changing registers that affect it.
+  int next_event;
+
   // For debugging; can set this to true to cause the debugger to break.
   bool trap;
+
+  // If non-NULL, stats counts what the Gameboy does.
+  // Copies of a Gameboy share the same stats.
+  GameboyStats *stats;
 } Gameboy;
 
 // Returns a new Gameboy for the given Rom.
@@ -413,11 +728,82 @@ typedef struct {
 // so rom must outlive the use of the returned Gameboy.
 Gameboy init_gameboy(const Rom *rom);
 
+// Frees any memory allocated for the Gameboy by init_gameboy,
+// and writes back external RAM mapped by map_save_file.
+void free_gameboy(Gameboy *g);
+
+// Returns the path of the save file for the ROM file at rom_path:
+// rom_path with its extension replaced by .sav.
+// The returned string must be freed by the caller.
+char *save_file_path(const char *rom_path);
+
+// Replaces the Gameboy's external RAM with a shared mapping of the file at
+// path, so that stores to it persist in the file without any copying.
+// The file is created, or extended with zeros, if it is shorter than the
+// external RAM. Its existing contents become the initial RAM.
+// This should be called before the Gameboy runs,
+// and does nothing if the cartridge has no external RAM.
+// If there is an error, fail() is called.
+void map_save_file(Gameboy *g, const char *path);
+
+// Writes back any stores to external RAM mapped by map_save_file,
+// waiting until they reach the file.
+// It is safe to call from a thread other than the one running g,
+// for example to bound what is lost on a crash.
+// This is done by free_gameboy, so need not be called before it.
+void sync_save_file(const Gameboy *g);
+
+// Marks the memory map stale, to be rebuilt before the next CPU memory
+// access. This must be called when a change affects which memory the CPU can
+// access directly, for example starting or finishing an OAM DMA.
+void mem_map_invalidate(Gameboy *g);
+
+// Updates the memory map after a change in the PPU mode or enabled bit,
+// which determine whether the CPU can access VRAM.
+void mem_map_ppu_changed(Gameboy *g);
+
+// Updates the memory map after a change in the cartridge's mapped
+// ROM or external RAM banks.
+void mem_map_cart_changed(Gameboy *g);
+
+// Returns the memory backing the ROM bank mapped at start,
+// which is either MEM_ROM0_START or MEM_ROM_N_START,
+// or NULL if the bank is beyond the end of the ROM data.
+const uint8_t *mbc_rom(const Gameboy *g, uint16_t start);
+
+// Returns the memory backing the external RAM bank mapped
+// at MEM_EXT_RAM_START if the CPU can access it directly,
+// or NULL if accesses must go through mbc_ram_fetch and mbc_ram_store.
+uint8_t *mbc_ram(const Gameboy *g);
+
+// Handles a CPU store to the ROM address space,
+// which writes the memory bank controller's registers.
+// Returns false if the cartridge's mapper is not supported.
+bool mbc_store(Gameboy *g, uint16_t addr, uint8_t x);
+
+// Handle CPU accesses to external RAM that mbc_ram doesn't map.
+uint8_t mbc_ram_fetch(Gameboy *g, uint16_t addr);
+void mbc_ram_store(Gameboy *g, uint16_t addr, uint8_t x);
+
+// Returns the byte at addr as the CPU sees it,
+// including the mapped ROM bank,
+// but without any side effects or access restrictions.
+uint8_t gameboy_peek(const Gameboy *g, uint16_t addr);
+
+// Copies the CPU's view of all of memory, as with gameboy_peek, into view.
+void gameboy_mem_view(const Gameboy *g, Mem view);
+
 void ppu_enable(Gameboy *g);
 bool ppu_enabled(const Gameboy *g);
 PpuMode ppu_mode(const Gameboy *g);
 
-// Executes a single "M cycle" of the entire Gameboy.
+// Executes the next instruction of the entire Gameboy,
+// using g->engine, and returns the number of M cycles it took.
+// Under ENGINE_INSTRUCTION, while the CPU is halted,
+// a single call can run many M cycles, up to the next interrupt.
+// With ENGINE_MCYCLE, each of those is a single "M cycle" of the entire
+// Gameboy, as follows.
+//
 // The Gameboy clock ticks at 2²² Hz.
 // Each clock tick is referred to as a T cycle.
 // The PPU, for example, makes progress every T cycle.
@@ -426,11 +812,332 @@ PpuMode ppu_mode(const Gameboy *g);
 // This function executes a single M cycle of the CPU
 // followed by 4 T cycles of the PPU,
 // and any relevant cycles of other systems such as OAM DMA.
-void mcycle(Gameboy *g);
+int mcycle(Gameboy *g);
+
+// Returns the number of T cycles that g has run, as tcycles would be
+// after gameboy_sync, but without syncing.
+uint64_t gameboy_tcycles(const Gameboy *g);
+
+// Advances the rest of the system to catch up with the CPU,
+// if it has run ahead under ENGINE_INSTRUCTION.
+// Between calls to mcycle, this brings the entire Gameboy
+// to the same state as ENGINE_MCYCLE.
+// CPU memory accesses that can observe or affect the rest of the system
+// call this first.
+void gameboy_sync(Gameboy *g);
+
+enum {
+  // The version of the save state format written by save_state.
+  // This must be incremented whenever the format changes.
+  STATE_VERSION = 3,
+};
+
+// Writes a save state of g to fd with a single writev,
+// unless it is interrupted, after first syncing g.
+// The state holds everything needed to continue running g
+// on a new Gameboy for the same Rom, including external RAM,
+// but not the ROM itself.
+// Returns NULL on success, or a description of the error with errno set.
+const char *save_state(Gameboy *g, int fd);
+
+// Reads a save state written by save_state from fd into g,
+// which must be a Gameboy for the same Rom, for example from init_gameboy.
+// Returns NULL on success, or a description of the error,
+// in which case g is unchanged.
+const char *load_state(Gameboy *g, int fd);
+
+enum {
+  // The M cycles in a frame of 154 lines of 456 T cycles each.
+  MCYCLES_PER_FRAME = 154 * 456 / 4,
+};
+
+// Runs g until the PPU next enters VBLANK, or for at most max_mcycles,
+// and returns the number of M cycles run.
+// If the LCD is off, it runs for MCYCLES_PER_FRAME instead.
+// The Gameboy is synced on return.
+long run_frame(Gameboy *g, long max_mcycles);
+
+// Adds the wall time of a frame to s.
+void stats_add_frame_ns(GameboyStats *s, double ns);
+
+// Returns a machine-readable report of s,
+// with a line for each count of its name, a space, and its value.
+// CPU memory accesses are summed by memory region.
+// The returned string must be freed by the caller.
+char *stats_report(const GameboyStats *s);
+
+// Returns the profile key of the code at addr as currently mapped in g:
+// its address in the low 16 bits, and above that 1 plus its ROM bank,
+// or 0 if addr is not in ROM.
+uint32_t profile_key(const Gameboy *g, uint16_t addr);
+
+// Returns a new, empty Profile, starting at the instruction boundary of g.
+// To profile, set it as the profile of g's stats between calls to mcycle.
+Profile init_profile(const Gameboy *g);
+
+// Frees the memory allocated for the Profile.
+void free_profile(Profile *p);
+
+// Adds the M cycles of the instruction that just finished to p.
+// op_code is that of the instruction, plus 0x100 for a 0xCB-prefixed one,
+// or -1 for an interrupt dispatch.
+// This is called by the CPU.
+void profile_instruction(Profile *p, const Gameboy *g, int op_code,
+                         int mcycles);
+
+// Returns a human-readable report of p, listing at most n instructions
+// by M cycles, with their disassembly,
+// and at most n routines by M cycles spent in them and their callees.
+// Code is disassembled from ROM, or from memory as g currently maps it.
+// The returned string must be freed by the caller.
+char *profile_report(const Profile *p, const Gameboy *g, int n);
+
+// Writes the call tree of p to a file at path as folded stacks,
+// the input format of flame graph tools:
+// a line for each node with self M cycles, of the routines called from
+// the root to it, separated by semicolons, a space, and the M cycles.
+// A routine is named by its ROM bank and address, BB:AAAA,
+// or only its address if not in ROM, and the root is "root".
+// If there is an error, fail() is called.
+void write_profile_stacks(const Profile *p, const char *path);
+
+// Returns a hash of the LCD.
+uint64_t lcd_hash(const Gameboy *g);
+
+// Returns a hash of the CPU registers and the CPU's view of memory,
+// including all of external RAM.
+// The Gameboy must be synced.
+uint64_t state_hash(const Gameboy *g);
+
+// The buttons held from the start of a frame.
+typedef struct {
+  long frame;
+  uint8_t buttons;
+  uint8_t dpad;
+} Input;
+
+// A script of joypad inputs.
+typedef struct {
+  // Sorted by increasing frame.
+  Input *inputs;
+  int n;
+  // The index of the next Input to apply.
+  int next;
+} InputScript;
+
+// Reads an InputScript from the file at path.
+// Each line is a frame number followed by the names of the buttons
+// (A, B, START, SELECT, UP, DOWN, LEFT, RIGHT)
+// held from the start of that frame until the frame of the next line.
+// Frame numbers must increase.
+// Blank lines and lines starting with # are ignored.
+// If there is an error, fail() is called.
+InputScript read_input_script(const char *path);
+
+// Frees the memory allocated by read_input_script.
+void free_input_script(InputScript *s);
+
+// Sets the buttons of g to those held at the start of frame.
+// Calls must be in increasing frame order.
+void apply_input_script(InputScript *s, Gameboy *g, long frame);
+
+// One snapshot in a Rewind history.
+typedef struct {
+  // The snapshot XORed with that of its keyframe, or with zeros if it is a
+  // keyframe, encoded as alternating runs of zero and non-zero bytes.
+  uint8_t *data;
+  int size;
+  bool key;
+} RewindFrame;
+
+// A bounded history of per-frame snapshots of a Gameboy,
+// for stepping back to the state of a recent frame.
+// A snapshot is the entire Gameboy but its memory map, and external RAM.
+// Consecutive frames differ in few bytes, so each snapshot is stored
+// as a delta against the most recent keyframe, which makes recording
+// a frame and stepping back to any frame cost one or two decodes.
+typedef struct {
+  // The most frames held, and the frames from one keyframe to the next.
+  // Fewer keyframes take less memory, but make deltas larger,
+  // as they drift further from their keyframe.
+  int max_frames;
+  int key_interval;
+
+  // A ring of n frames from oldest, at index start, to newest.
+  RewindFrame *frames;
+  int start;
+  int n;
+  // The number of frames recorded since the newest keyframe.
+  int since_key;
+
+  // The size of a decoded snapshot.
+  int snap_size;
+  // The decoded newest keyframe.
+  uint8_t *key;
+  // Space for decoding, and encoding, a single snapshot.
+  uint8_t *snap;
+  uint8_t *enc;
+
+  // The total size of the encoded frames.
+  long bytes;
+} Rewind;
+
+// Returns a new, empty Rewind for g holding at most max_frames frames,
+// with a keyframe every key_interval frames.
+// A Rewind must only be used with the Gameboy it was created for.
+Rewind init_rewind(const Gameboy *g, int max_frames, int key_interval);
+
+// Frees the memory allocated for the Rewind.
+void free_rewind(Rewind *r);
+
+// Syncs g and records its state as the newest frame.
+// If r is full, the oldest keyframe and the frames that depend on it
+// are dropped first.
+void rewind_record(Rewind *r, Gameboy *g);
+
+// Restores g to the state of the frame recorded n frames before the newest,
+// so 0 is the newest, and drops the frames newer than it.
+// Returns false and leaves g unchanged if there are not that many frames.
+bool rewind_back(Rewind *r, Gameboy *g, int n);
+
+// Returns the average memory used by r for each minute of history
+// at the Gameboy's frame rate, or 0 if r is empty.
+long rewind_bytes_per_minute(const Rewind *r);
+
+// A Gameboy state frozen in shared memory,
+// from which any number of Gameboys can be forked cheaply,
+// for example to explore different inputs from the same state.
+typedef struct {
+  // The shared memory object holding the frozen Gameboy,
+  // followed by its external RAM.
+  int fd;
+  size_t size;
+  // The frozen Gameboy, mapped read-only.
+  const Gameboy *g;
+} ForkBase;
+
+// Returns a ForkBase holding a copy of g, after first syncing g.
+// Changes to g after this do not affect the ForkBase.
+// If there is an error, fail() is called.
+ForkBase init_fork_base(Gameboy *g);
+
+// Frees the ForkBase. Gameboys forked from it remain valid.
+void free_fork_base(ForkBase *b);
+
+// Returns a new Gameboy with the state of b.
+// Rather than copying, it is a private mapping of b's memory,
+// so it shares the pages of b that it has not written,
+// and the kernel copies each page on its first write.
+// The Gameboy has its own external RAM, and must be released with
+// gameboy_release, not free_gameboy.
+// If there is an error, fail() is called.
+Gameboy *gameboy_fork(const ForkBase *b);
+
+// Releases a Gameboy returned by gameboy_fork.
+void gameboy_release(Gameboy *g);
+
+// The joypad state from a T cycle on.
+typedef struct {
+  uint64_t tcycle;
+  uint8_t buttons;
+  uint8_t dpad;
+} MovieInput;
+
+// A recording of the changes to the joypad state of a Gameboy,
+// keyed by the T cycle, as from gameboy_tcycles, at which they were made,
+// for replaying the run bit-exactly.
+typedef struct {
+  // The state_hash of the Gameboy when recording started.
+  uint64_t start_hash;
+  // Sorted by increasing tcycle.
+  MovieInput *inputs;
+  int n;
+  int cap;
+  // The index of the next MovieInput to play.
+  int next;
+  // Whether recording has ended,
+  // and if so the T cycle and the state_hash at the end.
+  bool has_end;
+  uint64_t end_tcycle;
+  uint64_t end_hash;
+} Movie;
+
+// Returns a new Movie to record a run of g from its current state,
+// after first syncing g.
+Movie init_movie(Gameboy *g);
+
+// Frees the memory allocated for the Movie.
+void free_movie(Movie *m);
+
+// Records the joypad state of g, if it changed since the last call.
+// This is called before each call to mcycle,
+// from the thread running g.
+void movie_record(Movie *m, const Gameboy *g);
+
+// Drops the inputs recorded after the current T cycle of g,
+// for example after g was rewound.
+void movie_truncate(Movie *m, const Gameboy *g);
+
+// Ends the recording at the start of the next instruction of g,
+// first running g out of any instruction in progress or HALT,
+// for at most MCYCLES_PER_FRAME, and then syncing g.
+// It must be called between calls to mcycle, from the thread running g.
+void movie_end(Movie *m, Gameboy *g);
+
+// Writes the Movie to a text file at path.
+// The first line is "gbmovie" and the version, 1,
+// and the second is "start" and the start hash in hex.
+// Each input is a line with its T cycle followed by the names of its
+// buttons, as with read_input_script,
+// and the last line is "end", the end T cycle, and the end hash in hex.
+// If there is an error, fail() is called.
+void write_movie(const Movie *m, const char *path);
+
+// Reads a Movie written by write_movie from the file at path.
+// If there is an error, fail() is called.
+Movie read_movie(const char *path);
+
+// Sets the joypad state of g to that of m at g's current T cycle,
+// overriding any other changes to it.
+// This is called before each call to mcycle.
+// g may also be rewound, for example with rewind_back or load_state.
+void movie_play(Movie *m, Gameboy *g);
+
+// Returns whether g has reached the end of m.
+bool movie_done(const Movie *m, const Gameboy *g);
+
+// Runs g as with run_frame, calling movie_play before each instruction,
+// and stopping early if the end of the movie is reached.
+long run_movie_frame(Movie *m, Gameboy *g, long max_mcycles);
 
 // Executes a single T cycle of the PPU.
 void ppu_tcycle(Gameboy *g);
 
+// Marks the decoded tile holding the VRAM tile data at addr as stale.
+// This must be called after tile data in mem changes, other than by
+// storing through the CPU, which calls it.
+void ppu_tile_changed(Gameboy *g, uint16_t addr);
+
+// Marks all decoded tiles as stale, as ppu_tile_changed for all tile data.
+void ppu_tiles_changed(Gameboy *g);
+
+// Decodes n rows of 2-bit-per-pixel tile data, each a low and a high byte,
+// into 8 pixels per row, mapping the color index of each pixel
+// through pallet, a BGP or OBP value.
+// With PALLET_IDENTITY, out holds the color indices themselves.
+void decode_tile_rows(const uint8_t *data, int n, uint8_t pallet,
+                      uint8_t *out);
+
+// Executes n T cycles of the PPU.
+// This is the same as n calls to ppu_tcycle,
+// but skips over the T cycles in which the PPU does no work.
+void ppu_advance(Gameboy *g, int n);
+
+// Returns a lower bound on the number of T cycles
+// until the PPU can next set one of the IF bits in mask,
+// or INT_MAX if it cannot.
+int ppu_irq_tcycles(const Gameboy *g, uint8_t mask);
+
 // Executes a single M cycle of the CPU.
 void cpu_mcycle(Gameboy *g);
 
@@ -1,8 +1,13 @@
+// Needed for mkstemp.
+#define _POSIX_C_SOURCE 200809L
+
 #include "gameboy.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define FAIL(...)                                                              \
   do {                                                                         \
@@ -80,8 +85,556 @@ static void run_lcd_diff_test1() {
   free(diff);
 }
 
+// A program that samples the timer and PPU registers and VRAM into WRAM,
+// with timer and VBLANK interrupts, loaded at address 0.
+static const uint8_t sampler_program[] = {
+    // 0x0000
+    0x31, 0xFE, 0xFF, // LD SP, $FFFE
+    0x3E, 0x05,       // LD A, $05 (TIMA enabled, 16 T cycles)
+    0xE0, 0x07,       // LDH [TAC], A
+    0x3E, 0x05,       // LD A, $05 (VBLANK and TIMER)
+    0xE0, 0xFF,       // LDH [IE], A
+    0x21, 0x00, 0xC0, // LD HL, $C000
+    0xFB,             // EI
+    // 0x000F loop:
+    0xF0, 0x04,       // LDH A, [DIV]
+    0x22,             // LD [HL+], A
+    0xF0, 0x44,       // LDH A, [LY]
+    0x22,             // LD [HL+], A
+    0xF0, 0x41,       // LDH A, [STAT]
+    0x22,             // LD [HL+], A
+    0xF0, 0x05,       // LDH A, [TIMA]
+    0x22,             // LD [HL+], A
+    0xFA, 0x00, 0x80, // LD A, [$8000]
+    0x22,             // LD [HL+], A
+    0xEA, 0x01, 0x80, // LD [$8001], A
+    0x3C,             // INC A
+    0xE0, 0x04,       // LDH [DIV], A
+    0x76,             // HALT
+    0x18, 0xE7,       // JR loop
+    [0x40] = 0xD9,    // RETI
+    [0x50] = 0xD9,    // RETI
+};
+
+// Runs the sampler program under ENGINE_LOCKSTEP,
+// which fails if ENGINE_INSTRUCTION and ENGINE_MCYCLE ever differ.
+static void run_engine_lockstep_test(PpuModel model) {
+  static Gameboy g;
+  g = (Gameboy){
+      .engine = ENGINE_LOCKSTEP,
+      .ppu_model = model,
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = OAM_SCAN,
+              // Under PPU_FIFO, these make drawing take longer on some lines.
+              [MEM_SCX] = 3,
+              [MEM_OAM_START] = 40,
+              [MEM_OAM_START + 1] = 60,
+          },
+  };
+  memcpy(g.mem, sampler_program, sizeof(sampler_program));
+  long mcycles = 0;
+  while (mcycles < 40000) {
+    mcycles += mcycle(&g);
+  }
+  uint16_t hl = get_reg16(&g.cpu, REG_HL);
+  if (hl < MEM_WRAM_START + 100) {
+    FAIL("the program only sampled up to $%04X", hl);
+  }
+}
+
+static const uint8_t halt_program[] = {
+    0x3E, 0x07, // LD A, $07 (TIMA enabled, 256 T cycles)
+    0xE0, 0x07, // LDH [TAC], A
+    0x3E, 0x05, // LD A, $05 (VBLANK and TIMER)
+    0xE0, 0xFF, // LDH [IE], A
+    // 0x0008 loop:
+    0x76,       // HALT
+    0x04,       // INC B
+    0xAF,       // XOR A
+    0xE0, 0x0F, // LDH [IF], A
+    0x18, 0xF9, // JR loop
+};
+
+// Runs the halt program under ENGINE_LOCKSTEP,
+// checking that ENGINE_INSTRUCTION skips over halted M cycles
+// with the same result as ENGINE_MCYCLE.
+static void run_halt_skip_test() {
+  static Gameboy g = {
+      .engine = ENGINE_LOCKSTEP,
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = OAM_SCAN,
+          },
+  };
+  memcpy(g.mem, halt_program, sizeof(halt_program));
+  long mcycles = 0;
+  int max_n = 0;
+  while (mcycles < 60000) {
+    int n = mcycle(&g);
+    mcycles += n;
+    max_n = n > max_n ? n : max_n;
+  }
+  if (max_n < 1000) {
+    FAIL("the longest mcycle call was %d M cycles", max_n);
+  }
+  // 3 frames and 3 timer overflows, give or take.
+  if (g.cpu.registers[REG_B] < 5) {
+    FAIL("woke up %d times", g.cpu.registers[REG_B]);
+  }
+}
+
+// Enables cartridge RAM, then increments its first byte and B forever.
+static const uint8_t ext_ram_inc_program[] = {
+    0x3E, 0x0A,       // LD A, $0A
+    0xEA, 0x00, 0x00, // LD [$0000], A
+    0x21, 0x00, 0xA0, // LD HL, $A000
+    0x34,             // INC [HL]
+    0x04,             // INC B
+    0x18, 0xFC,       // JR -4
+};
+
+// Runs the ext_ram_inc program under ENGINE_LOCKSTEP,
+// checking that each INC [HL] of cartridge RAM is applied once,
+// though both engines run it.
+static void run_lockstep_ext_ram_test() {
+  static uint8_t data[2 * ROM_BANK_SIZE];
+  memset(data, 0, sizeof(data));
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, ext_ram_inc_program,
+         sizeof(ext_ram_inc_program));
+  Rom rom = {
+      .data = data,
+      .size = sizeof(data),
+      .cart_type = CART_MBC1_RAM,
+      .num_rom_banks = 2,
+      .ram_size = EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  g.engine = ENGINE_LOCKSTEP;
+  long mcycles = 0;
+  while (mcycles < 10000) {
+    mcycles += mcycle(&g);
+  }
+  gameboy_sync(&g);
+  // The run can stop between INC [HL] and INC B.
+  uint8_t ahead = g.ext_ram[0] - g.cpu.registers[REG_B];
+  if (g.cpu.registers[REG_B] == 0 || ahead > 1) {
+    FAIL("got $%02X in RAM after $%02X increments", g.ext_ram[0],
+         g.cpu.registers[REG_B]);
+  }
+  free_gameboy(&g);
+}
+
+static const uint8_t inc_program[] = {
+    0x21, 0x00, 0xC0, // LD HL, $C000
+    // 0x0003 loop:
+    0x34,       // INC [HL]
+    0x18, 0xFD, // JR loop
+};
+
+static void run_stats_test(Engine engine) {
+  enum { FRAMES = 3 };
+  static GameboyStats stats;
+  stats = (GameboyStats){};
+  static Gameboy g;
+  g = (Gameboy){
+      .engine = engine,
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = OAM_SCAN,
+          },
+      .stats = &stats,
+  };
+  memcpy(g.mem, inc_program, sizeof(inc_program));
+  long mcycles = 0;
+  for (int i = 0; i < FRAMES; i++) {
+    mcycles += run_frame(&g, LONG_MAX);
+  }
+  if (stats.mcycles != mcycles) {
+    FAIL("counted %ld M cycles, wanted %ld", stats.mcycles, mcycles);
+  }
+  // Each INC [HL] reads and writes $C000 once.
+  // The zero IR runs a NOP before the LD.
+  long incs = stats.stores[MEM_WRAM_START / MEM_PAGE_SIZE];
+  long jrs = stats.instructions - 2 - incs;
+  if (jrs != incs && jrs != incs - 1) {
+    FAIL("counted %ld instructions for %ld INCs", stats.instructions, incs);
+  }
+  if (stats.fetches[MEM_WRAM_START / MEM_PAGE_SIZE] != incs) {
+    FAIL("counted %ld WRAM fetches, wanted %ld",
+         stats.fetches[MEM_WRAM_START / MEM_PAGE_SIZE], incs);
+  }
+  // Each instruction takes an M cycle per byte fetched from ROM,
+  // including the next op code, but INC [HL] takes 2 more and JR 1 more.
+  long rom_fetches = 1 + 3 + incs + 2 * jrs;
+  if (stats.fetches[0] != rom_fetches) {
+    FAIL("counted %ld ROM fetches, wanted %ld", stats.fetches[0], rom_fetches);
+  }
+  if (stats.mcycles != rom_fetches + 2 * incs + jrs) {
+    FAIL("counted %ld M cycles for %ld instructions", stats.mcycles,
+         stats.instructions);
+  }
+  if (stats.ppu_modes[VBLANK] != FRAMES ||
+      stats.ppu_modes[DRAWING] != FRAMES * SCREEN_HEIGHT ||
+      stats.ppu_modes[HBLANK] != FRAMES * SCREEN_HEIGHT) {
+    FAIL("counted %ld VBLANK, %ld DRAWING, and %ld HBLANK, wanted %d, %d, "
+         "and %d",
+         stats.ppu_modes[VBLANK], stats.ppu_modes[DRAWING],
+         stats.ppu_modes[HBLANK], FRAMES, FRAMES * SCREEN_HEIGHT,
+         FRAMES * SCREEN_HEIGHT);
+  }
+
+  char *report = stats_report(&stats);
+  char want[64];
+  snprintf(want, sizeof(want), "\nstores.wram %ld\n", incs);
+  if (strncmp(report, "instructions ", 13) != 0 ||
+      strstr(report, "\nframes 3\n") == NULL ||
+      strstr(report, want) == NULL) {
+    FAIL("bad report:\n%s", report);
+  }
+  free(report);
+
+  // Turning the LCD off changes the mode to 0 once.
+  long hblanks = stats.ppu_modes[HBLANK] + (ppu_mode(&g) != HBLANK);
+  g.mem[MEM_LCDC] &= ~LCDC_ENABLED;
+  for (long n = 0; n < MCYCLES_PER_FRAME;) {
+    n += mcycle(&g);
+  }
+  gameboy_sync(&g);
+  if (stats.ppu_modes[HBLANK] != hblanks ||
+      stats.ppu_modes[VBLANK] != FRAMES) {
+    FAIL("counted %ld HBLANK and %ld VBLANK with the LCD off, wanted %ld "
+         "and %d",
+         stats.ppu_modes[HBLANK], stats.ppu_modes[VBLANK], hblanks, FRAMES);
+  }
+}
+
+// Writes n bytes of data to a new temporary file and returns its path,
+// which must be freed by the caller.
+static char *write_temp_rom(const uint8_t *data, int n) {
+  char *path = strdup("/tmp/gameboy_test_rom_XXXXXX");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    FAIL("failed to create temp file");
+  }
+  if (write(fd, data, n) != n) {
+    FAIL("failed to write temp file");
+  }
+  close(fd);
+  return path;
+}
+
+static void run_read_rom_test() {
+  enum { SIZE = 2 * ROM_BANK_SIZE };
+  uint8_t *data = calloc(1, SIZE);
+  memcpy(data + MEM_HEADER_TITLE_START, "TESTING", 7);
+  data[MEM_HEADER_CART_TYPE] = CART_MBC1_RAM;
+  data[MEM_HEADER_ROM_SIZE] = 0;
+  data[MEM_HEADER_RAM_SIZE] = 2;
+  data[SIZE - 1] = 0x42;
+  char *path = write_temp_rom(data, SIZE);
+  Rom rom = read_rom(path);
+  if (rom.size != SIZE || memcmp(rom.data, data, SIZE) != 0) {
+    FAIL("read %d bytes, wanted the %d bytes written", rom.size, SIZE);
+  }
+  if (strcmp(rom.title, "TESTING") != 0) {
+    FAIL("got title %s, wanted TESTING", rom.title);
+  }
+  if (rom.cart_type != CART_MBC1_RAM || rom.num_rom_banks != 2 ||
+      rom.ram_size != 8192) {
+    FAIL("got cart type %d, %d ROM banks, %d bytes of RAM, wanted %d, 2, 8192",
+         rom.cart_type, rom.num_rom_banks, rom.ram_size, CART_MBC1_RAM);
+  }
+  free_rom(&rom);
+  unlink(path);
+  free(path);
+  free(data);
+}
+
+static void run_read_short_rom_test() {
+  // The file ends before the header.
+  // Reading it must not go past the end.
+  uint8_t data[MEM_HEADER_TITLE_START + 3] = {};
+  memcpy(data + MEM_HEADER_TITLE_START, "ABC", 3);
+  char *path = write_temp_rom(data, sizeof(data));
+  Rom rom = read_rom(path);
+  // The data is padded to a whole bank.
+  if (rom.size != ROM_BANK_SIZE) {
+    FAIL("got %d bytes, wanted %d", rom.size, ROM_BANK_SIZE);
+  }
+  if (strcmp(rom.title, "ABC") != 0) {
+    FAIL("got title %s, wanted ABC", rom.title);
+  }
+  if (rom.cart_type != CART_ROM_ONLY || rom.ram_size != 0) {
+    FAIL("got cart type %d with %d bytes of RAM, wanted 0 and 0",
+         rom.cart_type, rom.ram_size);
+  }
+  free_rom(&rom);
+  unlink(path);
+  free(path);
+}
+
+// Runs code from a ROM file shorter than a bank.
+static void run_short_rom_code_test() {
+  const uint8_t program[] = {
+      0x3E, 0x42,       // LD A, $42
+      0xEA, 0x00, 0xC0, // LD [$C000], A
+      0x18, 0xFE,       // JR -2
+  };
+  uint8_t data[MEM_HEADER_START + 1 + sizeof(program)] = {};
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, program, sizeof(program));
+  char *path = write_temp_rom(data, sizeof(data));
+  Rom rom = read_rom(path);
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  for (int i = 0; i < 10; i++) {
+    mcycle(&g);
+  }
+  gameboy_sync(&g);
+  if (g.mem[MEM_WRAM_START] != 0x42) {
+    FAIL("got $%02X at $C000, wanted $42", g.mem[MEM_WRAM_START]);
+  }
+  if (gameboy_peek(&g, sizeof(data)) != 0xFF) {
+    FAIL("got $%02X past the end of the ROM, wanted $FF",
+         gameboy_peek(&g, sizeof(data)));
+  }
+  free_gameboy(&g);
+  free_rom(&rom);
+  unlink(path);
+  free(path);
+}
+
+static void run_save_file_test() {
+  const char *paths[][2] = {
+      {"game.gb", "game.sav"},
+      {"dir/game.gbc", "dir/game.sav"},
+      {"dir.d/game", "dir.d/game.sav"},
+  };
+  for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+    char *got = save_file_path(paths[i][0]);
+    if (strcmp(got, paths[i][1]) != 0) {
+      FAIL("save_file_path(%s)=%s, wanted %s", paths[i][0], got, paths[i][1]);
+    }
+    free(got);
+  }
+
+  enum { RAM_SIZE = 4 * EXT_RAM_BANK_SIZE };
+  // Start with a short save file to check that it is extended.
+  uint8_t old_save[] = {0x01, 0x02, 0x03};
+  char *path = write_temp_rom(old_save, sizeof(old_save));
+  uint8_t rom_data[2 * ROM_BANK_SIZE] = {};
+  Rom rom = {
+      .data = rom_data,
+      .size = sizeof(rom_data),
+      .cart_type = CART_MBC1_RAM_BATTERY,
+      .num_rom_banks = 2,
+      .ram_size = RAM_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  map_save_file(&g, path);
+  if (gameboy_peek(&g, MEM_EXT_RAM_START) != 0xFF) {
+    FAIL("disabled RAM is readable");
+  }
+  mbc_store(&g, 0x0000, 0x0A);
+  if (gameboy_peek(&g, MEM_EXT_RAM_START + 2) != 0x03) {
+    FAIL("got $%02X, wanted the saved $03",
+         gameboy_peek(&g, MEM_EXT_RAM_START + 2));
+  }
+  mbc_store(&g, 0x6000, 0x01);
+  mbc_store(&g, 0x4000, 0x03);
+  mbc_ram_store(&g, MEM_EXT_RAM_END, 0x42);
+  free_gameboy(&g);
+
+  FILE *f = fopen(path, "rb");
+  uint8_t saved[RAM_SIZE + 1];
+  int n = fread(saved, 1, sizeof(saved), f);
+  fclose(f);
+  if (n != RAM_SIZE) {
+    FAIL("save file is %d bytes, wanted %d", n, RAM_SIZE);
+  }
+  if (saved[0] != 0x01 || saved[RAM_SIZE - 1] != 0x42) {
+    FAIL("save file has $%02X and $%02X, wanted $01 and $42", saved[0],
+         saved[RAM_SIZE - 1]);
+  }
+  unlink(path);
+  free(path);
+}
+
+static void run_input_script_test() {
+  const char script_text[] = "# Hold A then walk right.\n"
+                             "2 A\n"
+                             "\n"
+                             "5 RIGHT B\n"
+                             "7\n";
+  char *path = write_temp_rom((const uint8_t *)script_text,
+                              sizeof(script_text) - 1);
+  InputScript script = read_input_script(path);
+  const struct {
+    uint8_t buttons, dpad;
+  } want[] = {
+      {0, 0},
+      {0, 0},
+      {BUTTON_A, 0},
+      {BUTTON_A, 0},
+      {BUTTON_A, 0},
+      {BUTTON_B, BUTTON_RIGHT},
+      {BUTTON_B, BUTTON_RIGHT},
+      {0, 0},
+  };
+  Gameboy g = {};
+  for (int frame = 0; frame < sizeof(want) / sizeof(want[0]); frame++) {
+    apply_input_script(&script, &g, frame);
+    if (g.buttons != want[frame].buttons || g.dpad != want[frame].dpad) {
+      FAIL("frame %d: got buttons $%02X and dpad $%02X, wanted $%02X and "
+           "$%02X",
+           frame, g.buttons, g.dpad, want[frame].buttons, want[frame].dpad);
+    }
+  }
+  free_input_script(&script);
+  unlink(path);
+  free(path);
+}
+
+// Selects the buttons and stores the joypad state to WRAM forever.
+static const uint8_t joypad_program[] = {
+    0x21, 0x00, 0xC0, // LD HL, $C000
+    0x3E, 0x10,       // LD A, $10
+    0xE0, 0x00,       // LDH [P1], A
+    0xF0, 0x00,       // LDH A, [P1]
+    0x22,             // LD [HL+], A
+    0xCB, 0xAC,       // RES 5, H
+    0x18, 0xF5,       // JR -11
+};
+
+// Records a run with button presses at odd times under ENGINE_MCYCLE,
+// then replays it from a file under engine.
+static void run_movie_test(Engine engine) {
+  static uint8_t data[2 * ROM_BANK_SIZE];
+  memset(data, 0, sizeof(data));
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, joypad_program, sizeof(joypad_program));
+  Rom rom = {.data = data, .size = sizeof(data), .num_rom_banks = 2};
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  Movie m = init_movie(&g);
+  const uint8_t presses[] = {BUTTON_A, BUTTON_A | BUTTON_B, 0, BUTTON_START};
+  long mcycles = 0;
+  for (int i = 0; i < sizeof(presses); i++) {
+    while (mcycles < (i + 1) * 1237) {
+      movie_record(&m, &g);
+      mcycles += mcycle(&g);
+    }
+    g.buttons = presses[i];
+  }
+  while (mcycles < 2 * MCYCLES_PER_FRAME) {
+    movie_record(&m, &g);
+    mcycles += mcycle(&g);
+  }
+  movie_end(&m, &g);
+  if (m.n != sizeof(presses)) {
+    FAIL("recorded %d inputs, wanted %d", m.n, (int)sizeof(presses));
+  }
+  char *path = write_temp_rom(NULL, 0);
+  write_movie(&m, path);
+  Movie want = m;
+  m = read_movie(path);
+  if (m.start_hash != want.start_hash || m.n != want.n ||
+      memcmp(m.inputs, want.inputs, m.n * sizeof(MovieInput)) != 0 ||
+      !m.has_end || m.end_tcycle != want.end_tcycle ||
+      m.end_hash != want.end_hash) {
+    FAIL("read movie differs from the one written");
+  }
+
+  free_gameboy(&g);
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  if (state_hash(&g) != m.start_hash) {
+    FAIL("start hash %016llx, wanted %016llx",
+         (unsigned long long)state_hash(&g), (unsigned long long)m.start_hash);
+  }
+  // Live input is overridden by the movie.
+  g.buttons = BUTTON_SELECT;
+  while (!movie_done(&m, &g)) {
+    run_movie_frame(&m, &g, LONG_MAX);
+  }
+  if (g.tcycles != m.end_tcycle) {
+    FAIL("ended at T cycle %llu, wanted %llu", (unsigned long long)g.tcycles,
+         (unsigned long long)m.end_tcycle);
+  }
+  if (state_hash(&g) != m.end_hash) {
+    FAIL("end hash %016llx, wanted %016llx",
+         (unsigned long long)state_hash(&g), (unsigned long long)m.end_hash);
+  }
+  free_movie(&m);
+  free_movie(&want);
+  free_gameboy(&g);
+  unlink(path);
+  free(path);
+}
+
+// Records a run of the halt program that is ended while halted,
+// then replays it under engine, which must stop exactly at the end.
+static void run_movie_halted_end_test(Engine engine) {
+  static uint8_t data[2 * ROM_BANK_SIZE];
+  memset(data, 0, sizeof(data));
+  // The Gameboy starts at $0101, after executing the NOP at $0100.
+  memcpy(data + MEM_HEADER_START + 1, halt_program, sizeof(halt_program));
+  Rom rom = {.data = data, .size = sizeof(data), .num_rom_banks = 2};
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  Movie m = init_movie(&g);
+  long mcycles = 0;
+  while (mcycles < MCYCLES_PER_FRAME || g.cpu.state != HALTED) {
+    mcycles += mcycle(&g);
+  }
+  movie_end(&m, &g);
+  if (g.cpu.state != DONE) {
+    FAIL("movie ended in CPU state %d, wanted DONE", g.cpu.state);
+  }
+
+  free_gameboy(&g);
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  while (!movie_done(&m, &g)) {
+    run_movie_frame(&m, &g, LONG_MAX);
+  }
+  if (g.tcycles != m.end_tcycle || state_hash(&g) != m.end_hash) {
+    FAIL("ended at T cycle %llu, wanted %llu",
+         (unsigned long long)g.tcycles, (unsigned long long)m.end_tcycle);
+  }
+  free_movie(&m);
+  free_gameboy(&g);
+}
+
 int main() {
+  // Turn off trap messages for VRAM accesses during DRAWING.
+  extern bool shhhh;
+  shhhh = true;
+
   run_lcd_diff_test0();
   run_lcd_diff_test1();
+  run_engine_lockstep_test(PPU_SCANLINE);
+  run_engine_lockstep_test(PPU_FIFO);
+  run_halt_skip_test();
+  run_lockstep_ext_ram_test();
+  run_stats_test(ENGINE_MCYCLE);
+  run_stats_test(ENGINE_INSTRUCTION);
+  run_stats_test(ENGINE_LOCKSTEP);
+  run_read_rom_test();
+  run_read_short_rom_test();
+  run_short_rom_code_test();
+  run_save_file_test();
+  run_input_script_test();
+  run_movie_test(ENGINE_MCYCLE);
+  run_movie_test(ENGINE_INSTRUCTION);
+  run_movie_halted_end_test(ENGINE_MCYCLE);
+  run_movie_halted_end_test(ENGINE_INSTRUCTION);
   return 0;
 }
\ No newline at end of file
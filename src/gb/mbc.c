@@ -0,0 +1,255 @@
+#include "gameboy.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A memory bank controller.
+typedef struct {
+  const char *name;
+  // Writes x to the register at addr in the ROM address space,
+  // and updates the mapped banks of g->mbc.
+  void (*store)(Gameboy *g, uint16_t addr, uint8_t x);
+} Mapper;
+
+// Indices of Rtc.regs.
+enum { SECONDS, MINUTES, HOURS, DAYS_LOW, DAYS_HIGH };
+
+// The bits of each RTC register that can be written.
+static const uint8_t rtc_masks[NUM_RTC_REGS] = {
+    [SECONDS] = 0x3F,
+    [MINUTES] = 0x3F,
+    [HOURS] = 0x1F,
+    [DAYS_LOW] = 0xFF,
+    [DAYS_HIGH] = RTC_DH_DAY_HIGH | RTC_DH_HALT | RTC_DH_DAY_CARRY,
+};
+
+// Advances the RTC registers to the current emulated time.
+static void rtc_sync(Gameboy *g) {
+  Rtc *rtc = &g->mbc.rtc;
+  uint64_t elapsed = g->tcycles - rtc->synced;
+  rtc->synced = g->tcycles;
+  uint8_t *r = rtc->regs;
+  if (r[DAYS_HIGH] & RTC_DH_HALT) {
+    return;
+  }
+  uint64_t t = rtc->subsecond + elapsed;
+  rtc->subsecond = t % RTC_TCYCLES_PER_SECOND;
+  uint64_t secs = t / RTC_TCYCLES_PER_SECOND;
+  if (secs == 0) {
+    return;
+  }
+  // Out of range values written by the CPU are just carried.
+  secs += r[SECONDS];
+  r[SECONDS] = secs % 60;
+  uint64_t mins = secs / 60 + r[MINUTES];
+  r[MINUTES] = mins % 60;
+  uint64_t hours = mins / 60 + r[HOURS];
+  r[HOURS] = hours % 24;
+  uint64_t days =
+      hours / 24 + r[DAYS_LOW] + (r[DAYS_HIGH] & RTC_DH_DAY_HIGH) * 256;
+  r[DAYS_LOW] = days;
+  r[DAYS_HIGH] = r[DAYS_HIGH] & ~RTC_DH_DAY_HIGH | (days >> 8) & 1;
+  if (days >= 512) {
+    r[DAYS_HIGH] |= RTC_DH_DAY_CARRY;
+  }
+}
+
+static bool ram_enable(uint8_t x) { return (x & 0xF) == 0xA; }
+
+// ROM only carts, with or without RAM, have no registers.
+static void rom_only_store(Gameboy *g, uint16_t addr, uint8_t x) {}
+
+// MBC1 has a 5-bit ROM bank register and a 2-bit register
+// that selects either the RAM bank or the upper bits of the ROM bank,
+// depending on the banking mode.
+static void mbc1_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  Mbc *mbc = &g->mbc;
+  if (addr <= 0x1FFF) {
+    mbc->ram_enabled = ram_enable(x);
+  } else if (addr <= 0x3FFF) {
+    mbc->rom_bank_reg = x & 0x1F;
+  } else if (addr <= 0x5FFF) {
+    mbc->ram_bank_reg = x & 0x3;
+  } else {
+    mbc->mode = x & 0x1;
+  }
+  int low = mbc->rom_bank_reg == 0 ? 1 : mbc->rom_bank_reg;
+  int high = mbc->ram_bank_reg << 5;
+  mbc->rom_bank = (high | low) % g->rom->num_rom_banks;
+  mbc->rom_bank0 = mbc->mode ? high % g->rom->num_rom_banks : 0;
+  mbc->ram_bank = mbc->mode ? mbc->ram_bank_reg : 0;
+}
+
+// MBC3 has a 7-bit ROM bank register and a register
+// that selects either a RAM bank or a real-time clock register.
+static void mbc3_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  Mbc *mbc = &g->mbc;
+  if (addr <= 0x1FFF) {
+    mbc->ram_enabled = ram_enable(x);
+  } else if (addr <= 0x3FFF) {
+    mbc->rom_bank_reg = x & 0x7F;
+  } else if (addr <= 0x5FFF) {
+    mbc->ram_bank_reg = x;
+  } else {
+    // Writing 0 then 1 latches the clock.
+    if (mbc->latch == 0 && x == 1) {
+      rtc_sync(g);
+      for (int i = 0; i < NUM_RTC_REGS; i++) {
+        mbc->rtc.latched[i] = mbc->rtc.regs[i];
+      }
+    }
+    mbc->latch = x;
+  }
+  int bank = mbc->rom_bank_reg == 0 ? 1 : mbc->rom_bank_reg;
+  mbc->rom_bank = bank % g->rom->num_rom_banks;
+  mbc->rom_bank0 = 0;
+  bool rtc = mbc->ram_bank_reg >= RTC_S && mbc->ram_bank_reg <= RTC_DH;
+  // RAM banks are selected by the low bits, and there are at most 16.
+  mbc->ram_bank = rtc ? 0 : mbc->ram_bank_reg & 0xF;
+  mbc->rtc_reg = rtc ? mbc->ram_bank_reg : 0;
+}
+
+// MBC5 has a 9-bit ROM bank register, split across two addresses,
+// and a 4-bit RAM bank register.
+// Unlike the others, it can map ROM bank 0 at MEM_ROM_N_START.
+static void mbc5_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  Mbc *mbc = &g->mbc;
+  if (addr <= 0x1FFF) {
+    mbc->ram_enabled = ram_enable(x);
+  } else if (addr <= 0x2FFF) {
+    mbc->rom_bank_reg = mbc->rom_bank_reg & 0x100 | x;
+  } else if (addr <= 0x3FFF) {
+    mbc->rom_bank_reg = (x & 0x1) << 8 | mbc->rom_bank_reg & 0xFF;
+  } else if (addr <= 0x5FFF) {
+    mbc->ram_bank_reg = x & 0xF;
+  }
+  mbc->rom_bank = mbc->rom_bank_reg % g->rom->num_rom_banks;
+  mbc->rom_bank0 = 0;
+  mbc->ram_bank = mbc->ram_bank_reg;
+}
+
+static const Mapper rom_only = {.name = "ROM only", .store = rom_only_store};
+static const Mapper mbc1 = {.name = "MBC1", .store = mbc1_store};
+static const Mapper mbc3 = {.name = "MBC3", .store = mbc3_store};
+static const Mapper mbc5 = {.name = "MBC5", .store = mbc5_store};
+
+// Returns the Mapper for the cart type, or NULL if it is not supported.
+static const Mapper *find_mapper(CartType cart_type) {
+  switch (cart_type) {
+  case CART_ROM_ONLY:
+  case CART_ROM_RAM:
+  case CART_ROM_RAM_BATTERY:
+    return &rom_only;
+  case CART_MBC1:
+  case CART_MBC1_RAM:
+  case CART_MBC1_RAM_BATTERY:
+    return &mbc1;
+  case CART_MBC3_TIMER_BATTERY:
+  case CART_MBC3_TIMER_RAM_BATTERY:
+  case CART_MBC3:
+  case CART_MBC3_RAM:
+  case CART_MBC3_RAM_BATTERY:
+    return &mbc3;
+  case CART_MBC5:
+  case CART_MBC5_RAM:
+  case CART_MBC5_RAM_BATTERY:
+  case CART_MBC5_RUMBLE:
+  case CART_MBC5_RUMBLE_RAM:
+  case CART_MBC5_RUMBLE_RAM_BATTERY:
+    return &mbc5;
+  default:
+    return NULL;
+  }
+}
+
+// Whether g has a cartridge to map; see Gameboy.mbc.
+static bool has_cart(const Gameboy *g) {
+  return g->rom != NULL && g->rom->data != NULL;
+}
+
+bool mbc_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  const Mapper *mapper = has_cart(g) ? find_mapper(g->rom->cart_type) : NULL;
+  if (mapper == NULL) {
+    return false;
+  }
+  mapper->store(g, addr, x);
+  mem_map_cart_changed(g);
+  return true;
+}
+
+const uint8_t *mbc_rom(const Gameboy *g, uint16_t start) {
+  if (!has_cart(g)) {
+    return g->mem + start;
+  }
+  int bank = start < MEM_ROM_N_START ? g->mbc.rom_bank0 : g->mbc.rom_bank;
+  long offs = (long)bank * ROM_BANK_SIZE;
+  if (offs + ROM_BANK_SIZE > g->rom->size) {
+    return NULL;
+  }
+  return g->rom->data + offs;
+}
+
+// Returns whether external RAM is mapped at MEM_EXT_RAM_START,
+// rather than an RTC register or nothing.
+static bool ram_mapped(const Gameboy *g) {
+  if (g->ext_ram == NULL || g->mbc.rtc_reg != 0) {
+    return false;
+  }
+  // Without an MBC, RAM is always enabled.
+  return g->mbc.ram_enabled || find_mapper(g->rom->cart_type) == &rom_only;
+}
+
+uint8_t *mbc_ram(const Gameboy *g) {
+  if (!has_cart(g)) {
+    return (uint8_t *)g->mem + MEM_EXT_RAM_START;
+  }
+  int num_banks = g->rom->ram_size / EXT_RAM_BANK_SIZE;
+  if (!ram_mapped(g) || num_banks == 0) {
+    return NULL;
+  }
+  return g->ext_ram + g->mbc.ram_bank % num_banks * EXT_RAM_BANK_SIZE;
+}
+
+// Returns the RTC register mapped at MEM_EXT_RAM_START, or NULL.
+static uint8_t *rtc_reg(Gameboy *g, uint8_t *regs) {
+  if (!g->mbc.ram_enabled || g->mbc.rtc_reg == 0) {
+    return NULL;
+  }
+  return &regs[g->mbc.rtc_reg - RTC_S];
+}
+
+uint8_t mbc_ram_fetch(Gameboy *g, uint16_t addr) {
+  uint8_t *bank = mbc_ram(g);
+  if (bank != NULL) {
+    return bank[addr - MEM_EXT_RAM_START];
+  }
+  uint8_t *reg = rtc_reg(g, g->mbc.rtc.latched);
+  if (reg != NULL) {
+    return *reg;
+  }
+  if (ram_mapped(g)) {
+    // RAM smaller than a bank repeats.
+    return g->ext_ram[(addr - MEM_EXT_RAM_START) % g->rom->ram_size];
+  }
+  return 0xFF;
+}
+
+void mbc_ram_store(Gameboy *g, uint16_t addr, uint8_t x) {
+  uint8_t *bank = mbc_ram(g);
+  if (bank != NULL) {
+    bank[addr - MEM_EXT_RAM_START] = x;
+    return;
+  }
+  uint8_t *reg = rtc_reg(g, g->mbc.rtc.regs);
+  if (reg != NULL) {
+    rtc_sync(g);
+    if (g->mbc.rtc_reg == RTC_S) {
+      g->mbc.rtc.subsecond = 0;
+    }
+    *reg = x & rtc_masks[g->mbc.rtc_reg - RTC_S];
+    return;
+  }
+  if (ram_mapped(g)) {
+    g->ext_ram[(addr - MEM_EXT_RAM_START) % g->rom->ram_size] = x;
+  }
+}
@@ -0,0 +1,178 @@
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+// Returns ROM data with the number of each bank
+// in the first two bytes of the bank.
+static uint8_t *numbered_banks(int num_banks) {
+  uint8_t *data = calloc(num_banks, ROM_BANK_SIZE);
+  for (int i = 0; i < num_banks; i++) {
+    data[i * ROM_BANK_SIZE] = i & 0xFF;
+    data[i * ROM_BANK_SIZE + 1] = i >> 8;
+  }
+  return data;
+}
+
+static int bank_at(const Gameboy *g, uint16_t start) {
+  return gameboy_peek(g, start) | gameboy_peek(g, start + 1) << 8;
+}
+
+static void check_banks(const Gameboy *g, int want0, int want_n) {
+  int got0 = bank_at(g, MEM_ROM0_START);
+  int got_n = bank_at(g, MEM_ROM_N_START);
+  if (got0 != want0 || got_n != want_n) {
+    FAIL("got ROM banks %d and %d, wanted %d and %d", got0, got_n, want0,
+         want_n);
+  }
+}
+
+static void run_mbc1_test() {
+  enum { NUM_BANKS = 64 };
+  Rom rom = {
+      .data = numbered_banks(NUM_BANKS),
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC1_RAM,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = 4 * EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  check_banks(&g, 0, 1);
+
+  mbc_store(&g, 0x2000, 0x03);
+  mbc_store(&g, 0x4000, 0x01);
+  check_banks(&g, 0, 0x23);
+
+  // Mode 1 maps the upper bits into bank 0, and selects RAM banks.
+  mbc_store(&g, 0x6000, 0x01);
+  check_banks(&g, 0x20, 0x23);
+
+  if (gameboy_peek(&g, MEM_EXT_RAM_START) != 0xFF) {
+    FAIL("disabled RAM read $%02X, wanted $FF",
+         gameboy_peek(&g, MEM_EXT_RAM_START));
+  }
+  mbc_ram_store(&g, MEM_EXT_RAM_START, 0x42);
+  mbc_store(&g, 0x0000, 0x0A);
+  if (mbc_ram_fetch(&g, MEM_EXT_RAM_START) != 0) {
+    FAIL("store to disabled RAM was not ignored");
+  }
+  mbc_ram_store(&g, MEM_EXT_RAM_START, 0x42);
+  if (g.ext_ram[EXT_RAM_BANK_SIZE] != 0x42) {
+    FAIL("store did not go to RAM bank 1");
+  }
+  mbc_store(&g, 0x6000, 0x00);
+  if (gameboy_peek(&g, MEM_EXT_RAM_START) != 0) {
+    FAIL("mode 0 did not map RAM bank 0");
+  }
+  free_gameboy(&g);
+  free((void *)rom.data);
+}
+
+static void run_mbc3_test() {
+  enum { NUM_BANKS = 128 };
+  Rom rom = {
+      .data = numbered_banks(NUM_BANKS),
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC3_TIMER_RAM_BATTERY,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = 4 * EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+
+  mbc_store(&g, 0x2000, 0x00);
+  check_banks(&g, 0, 1);
+  mbc_store(&g, 0x2000, 0x7F);
+  check_banks(&g, 0, 0x7F);
+
+  mbc_store(&g, 0x0000, 0x0A);
+  mbc_store(&g, 0x4000, 0x03);
+  mbc_ram_store(&g, MEM_EXT_RAM_START + 1, 0x42);
+  if (g.ext_ram[3 * EXT_RAM_BANK_SIZE + 1] != 0x42) {
+    FAIL("store did not go to RAM bank 3");
+  }
+
+  // Set the clock to 23:59:30 on day 511.
+  const uint8_t set[NUM_RTC_REGS] = {30, 59, 23, 0xFF, RTC_DH_DAY_HIGH};
+  for (int i = 0; i < NUM_RTC_REGS; i++) {
+    mbc_store(&g, 0x4000, RTC_S + i);
+    mbc_ram_store(&g, MEM_EXT_RAM_START, set[i]);
+  }
+  // Run for 45 seconds of emulated time.
+  g.tcycles += 45L * RTC_TCYCLES_PER_SECOND;
+
+  // The CPU reads the latched registers.
+  mbc_store(&g, 0x4000, RTC_S);
+  if (mbc_ram_fetch(&g, MEM_EXT_RAM_START) != 0) {
+    FAIL("read unlatched seconds");
+  }
+  mbc_store(&g, 0x6000, 0x00);
+  mbc_store(&g, 0x6000, 0x01);
+  const uint8_t want[NUM_RTC_REGS] = {15, 0, 0, 0, RTC_DH_DAY_CARRY};
+  for (int i = 0; i < NUM_RTC_REGS; i++) {
+    mbc_store(&g, 0x4000, RTC_S + i);
+    uint8_t got = mbc_ram_fetch(&g, MEM_EXT_RAM_START);
+    if (got != want[i]) {
+      FAIL("RTC register $%02X is %d ($%02X), wanted %d ($%02X)", RTC_S + i,
+           got, got, want[i], want[i]);
+    }
+  }
+
+  // A halted clock does not advance.
+  mbc_store(&g, 0x4000, RTC_DH);
+  mbc_ram_store(&g, MEM_EXT_RAM_START, RTC_DH_HALT);
+  g.tcycles += 10L * RTC_TCYCLES_PER_SECOND;
+  mbc_store(&g, 0x6000, 0x00);
+  mbc_store(&g, 0x6000, 0x01);
+  mbc_store(&g, 0x4000, RTC_S);
+  if (mbc_ram_fetch(&g, MEM_EXT_RAM_START) != 15) {
+    FAIL("halted clock advanced to %d seconds",
+         mbc_ram_fetch(&g, MEM_EXT_RAM_START));
+  }
+  free_gameboy(&g);
+  free((void *)rom.data);
+}
+
+static void run_mbc5_test() {
+  enum { NUM_BANKS = 512 };
+  Rom rom = {
+      .data = numbered_banks(NUM_BANKS),
+      .size = NUM_BANKS * ROM_BANK_SIZE,
+      .cart_type = CART_MBC5_RAM,
+      .num_rom_banks = NUM_BANKS,
+      .ram_size = 16 * EXT_RAM_BANK_SIZE,
+  };
+  static Gameboy g;
+  g = init_gameboy(&rom);
+
+  mbc_store(&g, 0x2000, 0x00);
+  check_banks(&g, 0, 0);
+  mbc_store(&g, 0x3000, 0x01);
+  check_banks(&g, 0, 0x100);
+  mbc_store(&g, 0x2000, 0xFF);
+  check_banks(&g, 0, 0x1FF);
+
+  mbc_store(&g, 0x0000, 0x0A);
+  mbc_store(&g, 0x4000, 0x0F);
+  mbc_ram_store(&g, MEM_EXT_RAM_END, 0x42);
+  if (g.ext_ram[16 * EXT_RAM_BANK_SIZE - 1] != 0x42) {
+    FAIL("store did not go to RAM bank 15");
+  }
+  free_gameboy(&g);
+  free((void *)rom.data);
+}
+
+int main() {
+  run_mbc1_test();
+  run_mbc3_test();
+  run_mbc5_test();
+  return 0;
+}
@@ -1,5 +1,14 @@
 #include "gameboy.h"
 
+#include <limits.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static void store(Gameboy *g, uint16_t addr, uint8_t x) {
   if (g->dma_ticks_remaining > 0 && addr >= MEM_OAM_START &&
       addr <= MEM_OAM_END) {
@@ -36,7 +45,13 @@ static void set_ppu_mode(Gameboy *g, PpuMode mode) {
       mode == 2 && (g->mem[MEM_STAT] & STAT_MODE_2_IRQ)) {
     g->mem[MEM_IF] |= IF_LCD;
   }
+  PpuMode prev = ppu_mode(g);
   store(g, MEM_STAT, (fetch(g, MEM_STAT) & ~0x3) | mode);
+  mem_map_ppu_changed(g);
+  // While the LCD is off, mode 0 is set every T cycle.
+  if (g->stats != NULL && mode != prev) {
+    g->stats->ppu_modes[mode]++;
+  }
 }
 
 bool ppu_enabled(const Gameboy *g) { return g->mem[MEM_LCDC] & LCDC_ENABLED; }
@@ -56,6 +71,13 @@ static void do_oam_scan(Gameboy *g) {
   }
   int h = obj_height(g);
   int LY = fetch(g, MEM_LY);
+  if (LY == 0) {
+    ppu->wy_hit = false;
+    ppu->win_line = 0;
+  }
+  if (LY == fetch(g, MEM_WY)) {
+    ppu->wy_hit = true;
+  }
   uint16_t addr = MEM_OAM_START;
   ppu->nobjs = 0;
   while (addr <= MEM_OAM_END) {
@@ -65,122 +87,442 @@ static void do_oam_scan(Gameboy *g) {
     o.tile = fetch(g, addr++);
     o.flags = fetch(g, addr++);
     // The PPU only checks the Y coordinate of the object.
-    if (o.y - 16 <= LY && o.y - 16 + h > LY && ppu->nobjs < MAX_SCANLINE_OBJS) {
-      ppu->objs[ppu->nobjs++] = o;
+    if (o.y - 16 > LY || o.y - 16 + h <= LY ||
+        ppu->nobjs == MAX_SCANLINE_OBJS) {
+      continue;
+    }
+    // Keep objs sorted by X, and by OAM order for equal X.
+    int i = ppu->nobjs++;
+    for (; i > 0 && ppu->objs[i - 1].x > o.x; i--) {
+      ppu->objs[i] = ppu->objs[i - 1];
     }
+    ppu->objs[i] = o;
   }
   ppu->ticks = 0;
   set_ppu_mode(g, DRAWING);
 }
 
-static int tile_from_map(const Gameboy *g, uint16_t map_base, int x, int y) {
-  int map_x = x / TILE_WIDTH;
-  int map_y = y / TILE_HEIGHT;
-  return fetch(g, map_base + (map_y * TILE_MAP_WIDTH) + map_x);
+void ppu_tile_changed(Gameboy *g, uint16_t addr) {
+  g->ppu.tile_decoded[(addr - MEM_TILE_BLOCK0_START) / TILE_SIZE] = false;
 }
 
-static int tile_color_index(const Gameboy *g, uint16_t tile_addr, int x,
-                            int y) {
-  int tile_x = x % TILE_WIDTH;
-  int tile_y = y % TILE_HEIGHT;
-  uint8_t low = fetch(g, tile_addr + tile_y * 2);
-  uint8_t high = fetch(g, tile_addr + tile_y * 2 + 1);
-  uint8_t px_low = low >> (7 - tile_x) & 1;
-  uint8_t px_high = high >> (7 - tile_x) & 1;
-  return px_high << 1 | px_low;
+void ppu_tiles_changed(Gameboy *g) {
+  memset(g->ppu.tile_decoded, 0, sizeof(g->ppu.tile_decoded));
 }
 
-static uint8_t tile_map_px(const Gameboy *g, uint16_t map_base, int x, int y) {
-  int i = tile_from_map(g, map_base, x, y);
-  uint16_t addr = 0;
-  if ((fetch(g, MEM_LCDC) >> 4) & 1) {
-    addr = MEM_TILE_BLOCK0_START + i * 16;
-  } else {
-    i = (int8_t)(uint8_t)i; // sign-extend the lower 8 bits of i.
-    addr = MEM_TILE_BLOCK2_START + i * 16;
+static const uint64_t BYTE_ONES = 0x0101010101010101;
+
+// Returns the 8 bits of x spread one per byte, 0 or 1,
+// with bit 7, the leftmost pixel, in the lowest byte.
+static inline uint64_t spread_bits(uint8_t x) {
+  // Each byte of the multiplier shifts a copy of x 9 bits further,
+  // so that bit 7-i of x lands at bit 7 of byte i.
+  return (x * 0x8040201008040201 >> 7) & BYTE_ONES;
+}
+
+static void decode_tile_row(const uint8_t data[2], uint8_t pallet,
+                            uint8_t out[TILE_WIDTH]) {
+  uint64_t b0 = spread_bits(data[0]);
+  uint64_t b1 = spread_bits(data[1]);
+  // Each byte of a mask is 0 or 1, so multiplying by a 2-bit color
+  // sets the color in the bytes of the mask without carrying.
+  uint64_t px = (BYTE_ONES & ~(b0 | b1)) * (pallet & 0x3) |
+                (b0 & ~b1) * (pallet >> 2 & 0x3) |
+                (b1 & ~b0) * (pallet >> 4 & 0x3) | (b0 & b1) * (pallet >> 6);
+  for (int i = 0; i < TILE_WIDTH; i++) {
+    out[i] = px >> 8 * i;
   }
-  int color_index = tile_color_index(g, addr, x, y);
-  uint8_t pallet = fetch(g, MEM_BGP);
-  return (pallet >> 2 * color_index) & 0x3;
 }
 
-static int get_obj_color_index(const Gameboy *g, const Object *o, int x,
-                               int y) {
-  int obj_px_x = x - (o->x - TILE_WIDTH);
-  if (obj_px_x < 0 || obj_px_x >= TILE_WIDTH) {
-    fail("obj_px_x=%d\n", obj_px_x);
+#if defined(__AVX2__)
+// Decodes 4 rows, as decode_tile_row.
+static void decode_tile_row4(const uint8_t data[8], uint8_t pallet,
+                             uint8_t out[4 * TILE_WIDTH]) {
+  // Lane i of each row tests bit 7-i.
+  const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+  __m256i low = _mm256_set_epi64x(data[6] * BYTE_ONES, data[4] * BYTE_ONES,
+                                  data[2] * BYTE_ONES, data[0] * BYTE_ONES);
+  __m256i high = _mm256_set_epi64x(data[7] * BYTE_ONES, data[5] * BYTE_ONES,
+                                   data[3] * BYTE_ONES, data[1] * BYTE_ONES);
+  __m256i b0 = _mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits);
+  __m256i b1 = _mm256_cmpeq_epi8(_mm256_and_si256(high, bits), bits);
+  __m256i c0 = _mm256_set1_epi8(pallet & 0x3);
+  __m256i c1 = _mm256_set1_epi8(pallet >> 2 & 0x3);
+  __m256i c2 = _mm256_set1_epi8(pallet >> 4 & 0x3);
+  __m256i c3 = _mm256_set1_epi8(pallet >> 6);
+  __m256i px = _mm256_or_si256(
+      _mm256_or_si256(_mm256_andnot_si256(_mm256_or_si256(b0, b1), c0),
+                      _mm256_and_si256(_mm256_andnot_si256(b1, b0), c1)),
+      _mm256_or_si256(_mm256_and_si256(_mm256_andnot_si256(b0, b1), c2),
+                      _mm256_and_si256(_mm256_and_si256(b0, b1), c3)));
+  _mm256_storeu_si256((__m256i *)out, px);
+}
+#elif defined(__SSE2__)
+// Decodes 2 rows, as decode_tile_row.
+static void decode_tile_row2(const uint8_t data[4], uint8_t pallet,
+                             uint8_t out[2 * TILE_WIDTH]) {
+  // Lane i of each row tests bit 7-i.
+  const __m128i bits = _mm_set1_epi64x(0x0102040810204080);
+  __m128i low = _mm_set_epi64x(data[2] * BYTE_ONES, data[0] * BYTE_ONES);
+  __m128i high = _mm_set_epi64x(data[3] * BYTE_ONES, data[1] * BYTE_ONES);
+  __m128i b0 = _mm_cmpeq_epi8(_mm_and_si128(low, bits), bits);
+  __m128i b1 = _mm_cmpeq_epi8(_mm_and_si128(high, bits), bits);
+  __m128i c0 = _mm_set1_epi8(pallet & 0x3);
+  __m128i c1 = _mm_set1_epi8(pallet >> 2 & 0x3);
+  __m128i c2 = _mm_set1_epi8(pallet >> 4 & 0x3);
+  __m128i c3 = _mm_set1_epi8(pallet >> 6);
+  __m128i px = _mm_or_si128(
+      _mm_or_si128(_mm_andnot_si128(_mm_or_si128(b0, b1), c0),
+                   _mm_and_si128(_mm_andnot_si128(b1, b0), c1)),
+      _mm_or_si128(_mm_and_si128(_mm_andnot_si128(b0, b1), c2),
+                   _mm_and_si128(_mm_and_si128(b0, b1), c3)));
+  _mm_storeu_si128((__m128i *)out, px);
+}
+#endif
+
+void decode_tile_rows(const uint8_t *data, int n, uint8_t pallet,
+                      uint8_t *out) {
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+    decode_tile_row4(data + 2 * i, pallet, out + TILE_WIDTH * i);
   }
-  if (o->flags & OBJ_FLAG_X_FLIP) {
-    obj_px_x = TILE_WIDTH - obj_px_x - 1;
+#elif defined(__SSE2__)
+  for (; i + 2 <= n; i += 2) {
+    decode_tile_row2(data + 2 * i, pallet, out + TILE_WIDTH * i);
   }
+#endif
+  for (; i < n; i++) {
+    decode_tile_row(data + 2 * i, pallet, out + TILE_WIDTH * i);
+  }
+}
+
+// Returns row y of the pixels of tile i, first decoding it if it is stale.
+static const uint8_t *tile_row(Gameboy *g, int i, int y) {
+  Ppu *ppu = &g->ppu;
+  if (!ppu->tile_decoded[i]) {
+    const uint8_t *data = &g->mem[MEM_TILE_BLOCK0_START + i * TILE_SIZE];
+    decode_tile_rows(data, TILE_HEIGHT, PALLET_IDENTITY, ppu->tiles[i][0]);
+    ppu->tile_decoded[i] = true;
+  }
+  return ppu->tiles[i][y];
+}
+
+// Returns the index in Ppu.tiles of background tile number n.
+static int bg_tile(uint8_t lcdc, uint8_t n) {
+  if (lcdc & LCDC_TILE_DATA) {
+    return n;
+  }
+  // Tile numbers are signed, relative to block 2.
+  return (MEM_TILE_BLOCK2_START - MEM_TILE_BLOCK0_START) / TILE_SIZE +
+         (int8_t)n;
+}
+
+// Draws the pixels from x to end-1 of a line from the tile map at map,
+// starting at pixel map_x, map_y of the map,
+// and sets bg to the color index of each pixel.
+static void draw_map_span(Gameboy *g, int y, int x, int end, uint16_t map,
+                          int map_x, int map_y, uint8_t bg[SCREEN_WIDTH]) {
+  uint8_t lcdc = fetch(g, MEM_LCDC);
+  map += map_y / TILE_HEIGHT * TILE_MAP_WIDTH;
+  uint8_t bgp = fetch(g, MEM_BGP);
+  uint8_t colors[4];
+  for (int i = 0; i < 4; i++) {
+    colors[i] = bgp >> 2 * i & 0x3;
+  }
+  uint8_t *lcd = g->lcd[y];
+  for (map_x -= x; x < end;) {
+    int mx = (x + map_x) % (TILE_MAP_WIDTH * TILE_WIDTH);
+    uint8_t n = fetch(g, map + mx / TILE_WIDTH);
+    const uint8_t *row = tile_row(g, bg_tile(lcdc, n), map_y % TILE_HEIGHT);
+    for (int i = mx % TILE_WIDTH; i < TILE_WIDTH && x < end; i++) {
+      bg[x] = row[i];
+      lcd[x++] = colors[row[i]];
+    }
+  }
+}
+
+// Draws line y of the background and, over its right part, the window,
+// a tile row at a time, and sets bg to the color index of each pixel.
+static void draw_bg_line(Gameboy *g, int y, uint8_t bg[SCREEN_WIDTH]) {
+  Ppu *ppu = &g->ppu;
+  uint8_t lcdc = fetch(g, MEM_LCDC);
+  // The window's left edge is at WX-7, and it is off the screen past 166.
+  int win_x = SCREEN_WIDTH;
+  int wx = fetch(g, MEM_WX);
+  if (lcdc & LCDC_WIN_ENABLED && ppu->wy_hit && wx <= SCREEN_WIDTH + 6) {
+    win_x = wx < 7 ? 0 : wx - 7;
+  }
+  if (win_x > 0) {
+    uint16_t map = lcdc & LCDC_BG_TILE_MAP ? MEM_TILE_MAP1_START
+                                           : MEM_TILE_MAP0_START;
+    int scx = fetch(g, MEM_SCX);
+    int bgy = (y + fetch(g, MEM_SCY)) % (TILE_MAP_HEIGHT * TILE_HEIGHT);
+    draw_map_span(g, y, 0, win_x, map, scx, bgy, bg);
+  }
+  if (win_x < SCREEN_WIDTH) {
+    uint16_t map = lcdc & LCDC_WIN_TILE_MAP ? MEM_TILE_MAP1_START
+                                            : MEM_TILE_MAP0_START;
+    draw_map_span(g, y, win_x, SCREEN_WIDTH, map, win_x - (wx - 7),
+                  ppu->win_line, bg);
+    ppu->win_line++;
+  }
+}
 
+enum {
+  // In the object line buffer, marks a pixel drawn by an object.
+  OBJ_PX_DRAWN = 1 << 7,
+  // In the object line buffer, marks a pixel of an object
+  // that is hidden behind background color indices 1-3.
+  OBJ_PX_BEHIND_BG = 1 << 6,
+  // In PixelFifo.obj, marks a pixel drawn with OBP1.
+  OBJ_PX_OBP1 = 1 << 5,
+};
+
+// Draws the objects on line y over the background,
+// whose color indices are in bg.
+// Where objects overlap, the one first in Ppu.objs is drawn:
+// the one with the smallest X, or the first in OAM for equal X.
+static void draw_obj_line(Gameboy *g, int y, const uint8_t bg[SCREEN_WIDTH]) {
+  const Ppu *ppu = &g->ppu;
   int h = obj_height(g);
-  int obj_px_y = y - (o->y - TILE_BIG_HEIGHT);
-  if (obj_px_y < 0 || obj_px_y >= h) {
-    fail("obj_px_y=%d\n", obj_px_y, h);
+  uint8_t obp[2] = {fetch(g, MEM_OBP0), fetch(g, MEM_OBP1)};
+  // The pixels of objects, at their X coordinate, which is 8 past the screen X.
+  // Objects are drawn from last to first, so each overwrites those behind it.
+  uint8_t line[UINT8_MAX + 1 + TILE_WIDTH] = {};
+  for (int i = ppu->nobjs - 1; i >= 0; i--) {
+    const Object *o = &ppu->objs[i];
+    int obj_y = y - (o->y - TILE_BIG_HEIGHT);
+    if (obj_y < 0 || obj_y >= h) {
+      fail("obj_y=%d h=%d\n", obj_y, h);
+    }
+    if (o->flags & OBJ_FLAG_Y_FLIP) {
+      obj_y = h - obj_y - 1;
+    }
+    int tile = obj_y < TILE_HEIGHT ? o->tile : o->tile + 1;
+    const uint8_t *row = tile_row(g, tile, obj_y % TILE_HEIGHT);
+    uint8_t pallet = obp[(o->flags & OBJ_FLAG_PALLET) != 0];
+    uint8_t mark = OBJ_PX_DRAWN;
+    if (o->flags & OBJ_FLAG_PRIO) {
+      mark |= OBJ_PX_BEHIND_BG;
+    }
+    uint8_t *px = &line[o->x];
+    for (int x = 0; x < TILE_WIDTH; x++) {
+      int ci = row[o->flags & OBJ_FLAG_X_FLIP ? TILE_WIDTH - 1 - x : x];
+      if (ci > 0) {
+        px[x] = mark | pallet >> 2 * ci & 0x3;
+      }
+    }
   }
-  if (o->flags & OBJ_FLAG_Y_FLIP) {
-    obj_px_y = h - obj_px_y - 1;
+  const uint8_t *px = &line[TILE_WIDTH];
+  uint8_t *lcd = g->lcd[y];
+  for (int x = 0; x < SCREEN_WIDTH; x++) {
+    if (px[x] & OBJ_PX_DRAWN && (!(px[x] & OBJ_PX_BEHIND_BG) || bg[x] == 0)) {
+      lcd[x] = px[x] & 0x3;
+    }
   }
+}
+
+enum {
+  // T cycles that the PPU_FIFO spends before the first fetch of a line,
+  // which the hardware spends on a fetch that it throws away.
+  FIFO_START_TCYCLES = 6,
+  // T cycles for the background fetcher to fetch a tile row:
+  // 2 each for the tile number, the low byte, and the high byte.
+  FIFO_FETCH_TCYCLES = 6,
+  // T cycles that drawing stalls to fetch an object.
+  FIFO_OBJ_TCYCLES = 6,
+  // T cycles spent drawing a line under PPU_SCANLINE.
+  SCANLINE_DRAWING_TCYCLES = 171,
+};
+
+// Starts drawing a line under PPU_FIFO.
+static void start_fifo_line(Gameboy *g) {
+  g->ppu.fifo = (PixelFifo){
+      .discard = fetch(g, MEM_SCX) % TILE_WIDTH,
+      .stall = FIFO_START_TCYCLES,
+  };
+}
 
-  int tile = o->tile;
-  if (obj_px_y >= TILE_HEIGHT) {
-    tile++;
+// Returns the screen X at which the window starts on this line,
+// or SCREEN_WIDTH if it does not show.
+static int window_x(const Gameboy *g) {
+  int wx = fetch(g, MEM_WX);
+  if (!(fetch(g, MEM_LCDC) & LCDC_WIN_ENABLED) || !g->ppu.wy_hit ||
+      wx > SCREEN_WIDTH + 6) {
+    return SCREEN_WIDTH;
   }
-  return tile_color_index(g, MEM_TILE_BLOCK0_START + tile * 16, obj_px_x,
-                          obj_px_y);
+  return wx < 7 ? 0 : wx - 7;
 }
 
-static int get_obj_px(const Gameboy *g, int x, int y) {
-  int color_index = 0;
-  const Object *obj = NULL;
-  for (int i = 0; i < g->ppu.nobjs; i++) {
-    const Object *o = &g->ppu.objs[i];
-    if (o->x - 8 > x || o->x - 8 + TILE_WIDTH <= x) {
-      continue;
+// Mixes the row of the next object into the object FIFO.
+static void fetch_fifo_obj(Gameboy *g) {
+  Ppu *ppu = &g->ppu;
+  PixelFifo *f = &ppu->fifo;
+  const Object *o = &ppu->objs[f->next_obj++];
+  int h = obj_height(g);
+  int obj_y = fetch(g, MEM_LY) - (o->y - TILE_BIG_HEIGHT);
+  if (obj_y < 0 || obj_y >= h) {
+    fail("obj_y=%d h=%d\n", obj_y, h);
+  }
+  if (o->flags & OBJ_FLAG_Y_FLIP) {
+    obj_y = h - obj_y - 1;
+  }
+  int tile = obj_y < TILE_HEIGHT ? o->tile : o->tile + 1;
+  uint16_t addr =
+      MEM_TILE_BLOCK0_START + tile * TILE_SIZE + obj_y % TILE_HEIGHT * 2;
+  uint8_t data[2] = {fetch(g, addr), fetch(g, addr + 1)};
+  uint8_t row[TILE_WIDTH];
+  decode_tile_rows(data, 1, PALLET_IDENTITY, row);
+  uint8_t flags = OBJ_PX_DRAWN;
+  if (o->flags & OBJ_FLAG_PRIO) {
+    flags |= OBJ_PX_BEHIND_BG;
+  }
+  if (o->flags & OBJ_FLAG_PALLET) {
+    flags |= OBJ_PX_OBP1;
+  }
+  // Pixels left of the drawn pixels are cut off,
+  // and earlier objects keep their opaque pixels.
+  int start = o->x - TILE_WIDTH;
+  for (int x = f->x > start ? f->x - start : 0; x < TILE_WIDTH; x++) {
+    int ci = row[o->flags & OBJ_FLAG_X_FLIP ? TILE_WIDTH - 1 - x : x];
+    uint8_t *px = &f->obj[start + x - f->x];
+    if (ci > 0 && (*px & 0x3) == 0) {
+      *px = flags | ci;
     }
-    int ci = get_obj_color_index(g, o, x, y);
-    if (ci > 0 && (obj == NULL || obj->x > o->x)) {
-      color_index = ci;
-      obj = o;
+  }
+}
+
+// Steps the background fetcher by a T cycle,
+// pushing a tile row to the background FIFO once it is fetched and empty.
+static void step_fifo_fetcher(Gameboy *g) {
+  Ppu *ppu = &g->ppu;
+  PixelFifo *f = &ppu->fifo;
+  if (f->fetch_step < FIFO_FETCH_TCYCLES) {
+    f->fetch_step++;
+  }
+  uint8_t lcdc = fetch(g, MEM_LCDC);
+  switch (f->fetch_step) {
+  case 2: {
+    uint16_t map;
+    int map_x, map_y;
+    if (f->in_window) {
+      map = lcdc & LCDC_WIN_TILE_MAP ? MEM_TILE_MAP1_START
+                                     : MEM_TILE_MAP0_START;
+      map_x = f->fetch_x;
+      map_y = ppu->win_line;
+    } else {
+      map = lcdc & LCDC_BG_TILE_MAP ? MEM_TILE_MAP1_START
+                                    : MEM_TILE_MAP0_START;
+      map_x = (fetch(g, MEM_SCX) / TILE_WIDTH + f->fetch_x) % TILE_MAP_WIDTH;
+      map_y = (fetch(g, MEM_LY) + fetch(g, MEM_SCY)) %
+              (TILE_MAP_HEIGHT * TILE_HEIGHT);
     }
+    uint8_t n = fetch(g, map + map_y / TILE_HEIGHT * TILE_MAP_WIDTH + map_x);
+    f->fetch_addr = MEM_TILE_BLOCK0_START + bg_tile(lcdc, n) * TILE_SIZE +
+                    map_y % TILE_HEIGHT * 2;
+    break;
   }
-  if (obj == NULL || color_index == 0) {
-    return -1; // transparent
+  case 4:
+    f->fetch_low = fetch(g, f->fetch_addr);
+    break;
+  case FIFO_FETCH_TCYCLES:
+    if (f->bg_n > 0) {
+      break;
+    }
+    f->fetch_high = fetch(g, f->fetch_addr + 1);
+    uint8_t data[2] = {f->fetch_low, f->fetch_high};
+    decode_tile_rows(data, 1, PALLET_IDENTITY, f->bg);
+    f->bg_n = TILE_WIDTH;
+    f->fetch_step = 0;
+    f->fetch_x++;
+    break;
   }
-  uint16_t pallet_addr = obj->flags & OBJ_FLAG_PALLET ? MEM_OBP1 : MEM_OBP0;
-  uint8_t pallet = fetch(g, pallet_addr);
-  return (pallet >> 2 * color_index) & 0x3;
+}
+
+// Pops a pixel from the FIFOs and draws it, unless it is discarded.
+static void pop_fifo_pixel(Gameboy *g) {
+  PixelFifo *f = &g->ppu.fifo;
+  uint8_t bg = f->bg[TILE_WIDTH - f->bg_n--];
+  if (f->discard > 0) {
+    f->discard--;
+    return;
+  }
+  uint8_t obj = f->obj[0];
+  memmove(f->obj, f->obj + 1, TILE_WIDTH - 1);
+  f->obj[TILE_WIDTH - 1] = 0;
+  uint8_t px = fetch(g, MEM_BGP) >> 2 * bg & 0x3;
+  if (obj & OBJ_PX_DRAWN && (!(obj & OBJ_PX_BEHIND_BG) || bg == 0)) {
+    uint8_t pallet = fetch(g, obj & OBJ_PX_OBP1 ? MEM_OBP1 : MEM_OBP0);
+    px = pallet >> 2 * (obj & 0x3) & 0x3;
+  }
+  g->lcd[fetch(g, MEM_LY)][f->x++] = px;
+}
+
+// Runs a T cycle of drawing under PPU_FIFO.
+static void do_fifo_drawing(Gameboy *g) {
+  Ppu *ppu = &g->ppu;
+  PixelFifo *f = &ppu->fifo;
+  if (ppu->ticks == 1) {
+    start_fifo_line(g);
+  }
+  if (f->stall > 0) {
+    f->stall--;
+    return;
+  }
+  if (f->next_obj < ppu->nobjs &&
+      ppu->objs[f->next_obj].x <= f->x + TILE_WIDTH) {
+    fetch_fifo_obj(g);
+    f->stall = FIFO_OBJ_TCYCLES - 1;
+    return;
+  }
+  if (!f->in_window && f->x >= window_x(g)) {
+    int wx = fetch(g, MEM_WX);
+    f->in_window = true;
+    f->bg_n = 0;
+    f->fetch_step = 0;
+    f->fetch_x = 0;
+    f->discard = wx < 7 ? 7 - wx : 0;
+    // Restarting the fetcher takes this T cycle.
+    return;
+  }
+  step_fifo_fetcher(g);
+  if (f->bg_n > 0) {
+    pop_fifo_pixel(g);
+  }
+  if (f->x < SCREEN_WIDTH) {
+    return;
+  }
+  if (f->in_window) {
+    ppu->win_line++;
+  }
+  ppu->mode3_extra = ppu->ticks - SCANLINE_DRAWING_TCYCLES;
+  ppu->ticks = 0;
+  set_ppu_mode(g, HBLANK);
 }
 
 static void do_drawing(Gameboy *g) {
   Ppu *ppu = &g->ppu;
-  if (ppu->ticks < 171) {
+  if (g->ppu_model == PPU_FIFO) {
+    do_fifo_drawing(g);
     return;
   }
-  // For the time being, just burn 172 cycles and then just draw a scanline.
-  uint16_t bg_tile_map_base = MEM_TILE_MAP0_START;
-  if (fetch(g, MEM_LCDC) & LCDC_BG_TILE_MAP) {
-    bg_tile_map_base = MEM_TILE_MAP1_START;
+  if (ppu->ticks < SCANLINE_DRAWING_TCYCLES) {
+    return;
   }
+  // For the time being, just burn 172 cycles and then just draw a scanline.
   int y = fetch(g, MEM_LY);
-  int bgy = (y + fetch(g, MEM_SCY)) % (TILE_MAP_HEIGHT * TILE_HEIGHT);
-  for (int x = 0; x < SCREEN_WIDTH; x++) {
-    int bgx = (x + fetch(g, MEM_SCX)) % (TILE_MAP_WIDTH * TILE_WIDTH);
-    int obj_px = get_obj_px(g, x, y);
-    if (obj_px >= 0) {
-      g->lcd[y][x] = obj_px;
-    } else {
-      g->lcd[y][x] = tile_map_px(g, bg_tile_map_base, bgx, bgy);
-    }
-  }
+  uint8_t bg[SCREEN_WIDTH];
+  draw_bg_line(g, y, bg);
+  draw_obj_line(g, y, bg);
+  ppu->mode3_extra = 0;
   ppu->ticks = 0;
   set_ppu_mode(g, HBLANK);
 }
 
 static void do_hblank(Gameboy *g) {
   Ppu *ppu = &g->ppu;
-  if (ppu->ticks < 203) {
+  if (ppu->ticks < 203 - ppu->mode3_extra) {
     return;
   }
   ppu->ticks = 0;
@@ -238,6 +580,103 @@ void ppu_tcycle(Gameboy *g) {
   }
 }
 
+// Returns the number of T cycles until ppu_tcycle next does work
+// on an enabled PPU, or INT_MAX if it never will.
+static int tcycles_until_work(const Gameboy *g) {
+  int ticks = g->ppu.ticks;
+  switch (ppu_mode(g)) {
+  case OAM_SCAN:
+    return ticks < 79 ? 79 - ticks : INT_MAX;
+  case DRAWING:
+    if (g->ppu_model == PPU_FIFO) {
+      return 1;
+    }
+    return ticks < 171 ? 171 - ticks : 1;
+  case HBLANK: {
+    int end = 203 - g->ppu.mode3_extra;
+    return ticks < end ? end - ticks : 1;
+  }
+  case VBLANK:
+    return ticks < 455 ? 455 - ticks : 1;
+  }
+  return 1;
+}
+
+void ppu_advance(Gameboy *g, int n) {
+  if (!ppu_enabled(g)) {
+    // The first T cycle resets LY, which can set STAT_LC_EQ_LYC;
+    // the second clears it again. After that, it is a no-op.
+    for (int i = 0; i < n && i < 2; i++) {
+      if (ppu_mode(g) == 0 && g->ppu.ticks == 0 && g->mem[MEM_LY] == 0 &&
+          !(g->mem[MEM_STAT] & STAT_LC_EQ_LYC)) {
+        break;
+      }
+      ppu_tcycle(g);
+    }
+    return;
+  }
+  while (n > 0) {
+    int work = tcycles_until_work(g);
+    if (n < work) {
+      g->ppu.ticks += n;
+      return;
+    }
+    g->ppu.ticks += work - 1;
+    n -= work;
+    ppu_tcycle(g);
+  }
+}
+
+enum {
+  LINE_TCYCLES = 79 + 171 + 203,
+  VBLANK_LINE_TCYCLES = 455,
+};
+
+// Returns the number of T cycles until an enabled PPU enters VBLANK.
+static int tcycles_until_vblank(const Gameboy *g) {
+  int t = tcycles_until_work(g);
+  if (t == INT_MAX) {
+    return t;
+  }
+  int y = g->mem[MEM_LY];
+  switch (ppu_mode(g)) {
+  case OAM_SCAN:
+    t += 171 + 203;
+    break;
+  case DRAWING:
+    // Drawing and HBLANK take the same time together under either PpuModel.
+    t = 171 + 203 - g->ppu.ticks;
+    break;
+  case HBLANK:
+    break;
+  case VBLANK:
+    if (y < YMAX) {
+      t += (YMAX - y) * VBLANK_LINE_TCYCLES;
+    }
+    return t + SCREEN_HEIGHT * LINE_TCYCLES;
+  }
+  // HBLANK of line 143 and above enters VBLANK.
+  if (y < 143) {
+    t += (143 - y) * LINE_TCYCLES;
+  }
+  return t;
+}
+
+int ppu_irq_tcycles(const Gameboy *g, uint8_t mask) {
+  if (!ppu_enabled(g)) {
+    // Resetting LY can match LYC.
+    return mask & IF_LCD ? 1 : INT_MAX;
+  }
+  if (mask & IF_LCD) {
+    // Any mode change or LY change can raise a STAT interrupt.
+    return tcycles_until_work(g);
+  }
+  if (mask & IF_VBLANK) {
+    return tcycles_until_vblank(g);
+  }
+  return INT_MAX;
+}
+
 const char *ppu_mode_name(PpuMode mode) {
   switch (mode) {
   case OAM_SCAN:
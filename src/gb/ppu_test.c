@@ -1,5 +1,6 @@
 #include "gameboy.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -131,7 +132,8 @@ static void run_cycle_count_tests() {
                           [MEM_LCDC] = LCDC_ENABLED,
                           [MEM_STAT] = DRAWING,
                       },
-                  .ppu = {.ticks = 0},
+                  // LY and WY are both 0.
+                  .ppu = {.ticks = 0, .wy_hit = true},
               },
           .cycles = 79,
       },
@@ -322,9 +324,417 @@ static void run_cycle_count_tests() {
   _run_ppu_test(__func__, ARRAY_SIZE(tests), tests);
 }
 
+static void run_advance_test(PpuModel model) {
+  static const Gameboy init = {
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = STAT_MODE_0_IRQ | STAT_MODE_1_IRQ |
+                           STAT_MODE_2_IRQ | STAT_LYC_IRQ,
+              [MEM_LYC] = 5,
+              // Under PPU_FIFO, these make drawing take longer on some lines.
+              [MEM_SCX] = 5,
+              [MEM_OAM_START] = 20,
+              [MEM_OAM_START + 1] = 30,
+              [MEM_OAM_START + 4] = 24,
+              [MEM_OAM_START + 5] = 100,
+          },
+  };
+  static Gameboy a, b;
+  const int frames_tcycles = 2 * 154 * 456;
+  const int steps[] = {1, 3, 80, 455, 5000};
+  for (int i = 0; i < ARRAY_SIZE(steps); i++) {
+    a = init;
+    a.ppu_model = model;
+    b = a;
+    for (int t = 0; t < frames_tcycles; t += steps[i]) {
+      ppu_advance(&a, steps[i]);
+      for (int j = 0; j < steps[i]; j++) {
+        ppu_tcycle(&b);
+      }
+      char *diff = gameboy_diff(&a, &b);
+      if (diff != NULL) {
+        FAIL("steps of %d, T cycle %d: diff:\n%s\n", steps[i], t, diff);
+      }
+    }
+  }
+
+  const uint8_t masks[] = {IF_VBLANK, IF_LCD};
+  for (int i = 0; i < ARRAY_SIZE(masks); i++) {
+    a = init;
+    a.ppu_model = model;
+    for (int t = 0; t < frames_tcycles;) {
+      int n = ppu_irq_tcycles(&a, masks[i]);
+      a.mem[MEM_IF] = 0;
+      for (int j = 0; j < n - 1; j++, t++) {
+        ppu_tcycle(&a);
+        if (a.mem[MEM_IF] & masks[i]) {
+          FAIL("mask %02X, T cycle %d: IF=%02X before %d T cycles", masks[i],
+               t, a.mem[MEM_IF], n);
+        }
+      }
+      ppu_tcycle(&a);
+      t++;
+    }
+  }
+}
+
+// Returns the color index of pixel x of the tile row with bytes low, high.
+static int tile_px(uint8_t low, uint8_t high, int x) {
+  return (high >> (7 - x) & 1) << 1 | low >> (7 - x) & 1;
+}
+
+// Returns the color index of pixel x, y of the tile at tile_addr.
+static int ref_tile_px(const Gameboy *g, uint16_t tile_addr, int x, int y) {
+  const uint8_t *row = &g->mem[tile_addr + y % TILE_HEIGHT * 2];
+  return tile_px(row[0], row[1], x % TILE_WIDTH);
+}
+
+// The window state that the reference renderer keeps between lines.
+typedef struct {
+  bool wy_hit;
+  int win_line;
+} RefWindow;
+
+// Renders line y of g's memory a pixel at a time,
+// as the PPU did before it decoded tiles a row at a time.
+static void ref_line(const Gameboy *g, int y, RefWindow *win,
+                     uint8_t lcd[SCREEN_WIDTH]) {
+  const uint8_t *mem = g->mem;
+  uint8_t lcdc = mem[MEM_LCDC];
+  int h = lcdc & LCDC_OBJ_SIZE ? 16 : 8;
+  uint16_t bg_map =
+      lcdc & LCDC_BG_TILE_MAP ? MEM_TILE_MAP1_START : MEM_TILE_MAP0_START;
+  uint16_t win_map =
+      lcdc & LCDC_WIN_TILE_MAP ? MEM_TILE_MAP1_START : MEM_TILE_MAP0_START;
+  if (y == mem[MEM_WY]) {
+    win->wy_hit = true;
+  }
+  int wx = mem[MEM_WX];
+  bool show_win = lcdc & LCDC_WIN_ENABLED && win->wy_hit && wx <= 166;
+  const uint8_t *objs[MAX_SCANLINE_OBJS];
+  int nobjs = 0;
+  for (int a = MEM_OAM_START; a <= MEM_OAM_END; a += 4) {
+    if (mem[a] - 16 <= y && mem[a] - 16 + h > y && nobjs < ARRAY_SIZE(objs)) {
+      objs[nobjs++] = &mem[a];
+    }
+  }
+  for (int x = 0; x < SCREEN_WIDTH; x++) {
+    uint16_t map = bg_map;
+    int map_x = (x + mem[MEM_SCX]) % 256;
+    int map_y = (y + mem[MEM_SCY]) % 256;
+    if (show_win && x >= wx - 7) {
+      map = win_map;
+      map_x = x - (wx - 7);
+      map_y = win->win_line;
+    }
+    int n = mem[map + map_y / 8 * 32 + map_x / 8];
+    uint16_t addr = lcdc & LCDC_TILE_DATA ? 0x8000 + n * 16
+                                          : 0x9000 + (int8_t)n * 16;
+    int bg_ci = ref_tile_px(g, addr, map_x, map_y);
+    int px = mem[MEM_BGP] >> 2 * bg_ci & 3;
+    const uint8_t *best = NULL;
+    int best_ci = 0;
+    for (int i = 0; i < nobjs; i++) {
+      const uint8_t *o = objs[i];
+      if (o[1] - 8 > x || o[1] <= x) {
+        continue;
+      }
+      int px_x = x - (o[1] - 8);
+      if (o[3] & OBJ_FLAG_X_FLIP) {
+        px_x = 7 - px_x;
+      }
+      int px_y = y - (o[0] - 16);
+      if (o[3] & OBJ_FLAG_Y_FLIP) {
+        px_y = h - 1 - px_y;
+      }
+      int tile = o[2] + (px_y >= 8);
+      int ci = ref_tile_px(g, 0x8000 + tile * 16, px_x, px_y);
+      if (ci > 0 && (best == NULL || best[1] > o[1])) {
+        best = o;
+        best_ci = ci;
+      }
+    }
+    if (best != NULL && (!(best[3] & OBJ_FLAG_PRIO) || bg_ci == 0)) {
+      uint16_t pallet = best[3] & OBJ_FLAG_PALLET ? MEM_OBP1 : MEM_OBP0;
+      px = mem[pallet] >> 2 * best_ci & 3;
+    }
+    lcd[x] = px;
+  }
+  if (show_win) {
+    win->win_line++;
+  }
+}
+
+// Renders a frame of g's memory with ref_line.
+static void ref_frame(const Gameboy *g,
+                      uint8_t lcd[SCREEN_HEIGHT][SCREEN_WIDTH]) {
+  RefWindow win = {};
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    ref_line(g, y, &win, lcd[y]);
+  }
+}
+
+static uint32_t xorshift(uint32_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+// Fills VRAM, OAM and the PPU registers of g with random values.
+static void random_scene(Gameboy *g, uint32_t *seed) {
+  for (int a = MEM_VRAM_START; a <= MEM_VRAM_END; a++) {
+    g->mem[a] = xorshift(seed);
+  }
+  for (int a = MEM_OAM_START; a <= MEM_OAM_END; a += 4) {
+    g->mem[a] = xorshift(seed) % 176;
+    g->mem[a + 1] = xorshift(seed) % 176;
+    g->mem[a + 2] = xorshift(seed);
+    g->mem[a + 3] = xorshift(seed);
+  }
+  g->mem[MEM_LCDC] =
+      LCDC_ENABLED | xorshift(seed) & (LCDC_OBJ_SIZE | LCDC_BG_TILE_MAP |
+                                        LCDC_TILE_DATA | LCDC_WIN_ENABLED |
+                                        LCDC_WIN_TILE_MAP);
+  g->mem[MEM_SCX] = xorshift(seed);
+  g->mem[MEM_SCY] = xorshift(seed);
+  g->mem[MEM_WY] = xorshift(seed) % SCREEN_HEIGHT;
+  g->mem[MEM_WX] = xorshift(seed) % 176;
+  g->mem[MEM_BGP] = xorshift(seed);
+  g->mem[MEM_OBP0] = xorshift(seed);
+  g->mem[MEM_OBP1] = xorshift(seed);
+}
+
+static const char *model_names[] = {
+    [PPU_SCANLINE] = "PPU_SCANLINE",
+    [PPU_FIFO] = "PPU_FIFO",
+};
+
+// Checks that the LCD of g matches the reference rendering of its memory.
+static void check_frame(const char *name, int scene, const Gameboy *g) {
+  static uint8_t want[SCREEN_HEIGHT][SCREEN_WIDTH];
+  ref_frame(g, want);
+  static Gameboy ref;
+  memcpy(ref.lcd, want, sizeof(want));
+  if (lcd_hash(g) == lcd_hash(&ref)) {
+    return;
+  }
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      if (g->lcd[y][x] != want[y][x]) {
+        FAIL("%s %s scene %d: pixel %d,%d is %d, wanted %d",
+             model_names[g->ppu_model], name, scene, x, y, g->lcd[y][x],
+             want[y][x]);
+      }
+    }
+  }
+}
+
+// Runs the PPU of g for a frame, from when it is enabled,
+// checking each line against the reference renderer as it is drawn.
+// If toggle_win, the window is switched on or off at random between lines,
+// which pauses the window line counter.
+static void check_lines(Gameboy *g, int scene, uint32_t *seed,
+                        bool toggle_win) {
+  RefWindow win = {};
+  uint8_t want[SCREEN_WIDTH];
+  ppu_enable(g);
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    while (ppu_mode(g) != HBLANK) {
+      ppu_tcycle(g);
+    }
+    ref_line(g, y, &win, want);
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      if (g->lcd[y][x] != want[x]) {
+        FAIL("%s scene %d: pixel %d,%d is %d, wanted %d",
+             model_names[g->ppu_model], scene, x, y, g->lcd[y][x], want[x]);
+      }
+    }
+    if (toggle_win && xorshift(seed) % 4 == 0) {
+      g->mem[MEM_LCDC] ^= LCDC_WIN_ENABLED;
+    }
+    while (ppu_mode(g) == HBLANK) {
+      ppu_tcycle(g);
+    }
+  }
+}
+
+// Turns off the LCD, rewrites tile block 0, and turns the LCD back on
+// with the LCDC value at byte 15.
+static const uint8_t retile_program[] = {
+    0xAF,             // XOR A
+    0xE0, 0x40,       // LDH [LCDC], A
+    0x21, 0x00, 0x80, // LD HL, $8000
+    0x7D,             // LD A, L
+    0xEE, 0x5A,       // XOR $5A
+    0x22,             // LD [HL+], A
+    0xCB, 0x5C,       // BIT 3, H
+    0x28, 0xF8,       // JR Z, -8
+    0x3E, 0x00,       // LD A, lcdc
+    0xE0, 0x40,       // LDH [LCDC], A
+    0x18, 0xFE,       // JR -2
+};
+
+static void run_render_test(PpuModel model) {
+  enum { NUM_SCENES = 20 };
+  uint32_t seed = 1;
+  static Gameboy g;
+  for (int scene = 0; scene < NUM_SCENES; scene++) {
+    g = (Gameboy){.ppu_model = model};
+    random_scene(&g, &seed);
+    check_lines(&g, scene, &seed, scene % 2 == 1);
+
+    // Tiles changed through the CPU are decoded again.
+    memcpy(g.mem, retile_program, sizeof(retile_program));
+    g.mem[15] = g.mem[MEM_LCDC];
+    while (g.cpu.pc < sizeof(retile_program) - 2) {
+      mcycle(&g);
+    }
+    run_frame(&g, INT_MAX);
+    run_frame(&g, INT_MAX);
+    check_frame("retiled frame", scene, &g);
+  }
+}
+
+// Runs the PPU of g to the start of the next drawing mode,
+// and returns the number of T cycles that drawing takes.
+static int drawing_tcycles(Gameboy *g) {
+  while (ppu_mode(g) == DRAWING) {
+    ppu_tcycle(g);
+  }
+  while (ppu_mode(g) != DRAWING) {
+    ppu_tcycle(g);
+  }
+  int n = 0;
+  while (ppu_mode(g) == DRAWING) {
+    ppu_tcycle(g);
+    n++;
+  }
+  return n;
+}
+
+static void run_fifo_timing_test() {
+  static Gameboy g;
+  g = (Gameboy){
+      .ppu_model = PPU_FIFO,
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_SCX] = 3,
+              // Two objects on lines 1-8.
+              [MEM_OAM_START] = 17,
+              [MEM_OAM_START + 1] = 50,
+              [MEM_OAM_START + 4] = 17,
+              [MEM_OAM_START + 5] = 90,
+          },
+  };
+  ppu_enable(&g);
+  // Drawing takes longer by SCX%8 for the pixels scrolled off,
+  int n = drawing_tcycles(&g);
+  if (n != 171 + 3) {
+    FAIL("line 0: drawing took %d T cycles, wanted %d", n, 171 + 3);
+  }
+  // by 6 for each object,
+  n = drawing_tcycles(&g);
+  if (n != 171 + 3 + 2 * 6) {
+    FAIL("line 1: drawing took %d T cycles, wanted %d", n, 171 + 3 + 2 * 6);
+  }
+  // and by 6 to start fetching the window.
+  g.mem[MEM_LCDC] |= LCDC_WIN_ENABLED;
+  g.mem[MEM_WX] = 87;
+  n = drawing_tcycles(&g);
+  if (n != 171 + 3 + 2 * 6 + 6) {
+    FAIL("line 2: drawing took %d T cycles, wanted %d", n,
+         171 + 3 + 2 * 6 + 6);
+  }
+
+  // HBLANK is shorter to make up for it, so frames take the same time.
+  static Gameboy scanline;
+  scanline = g;
+  scanline.ppu_model = PPU_SCANLINE;
+  for (int t = 0; t < 2 * 154 * 456; t++) {
+    ppu_tcycle(&g);
+    ppu_tcycle(&scanline);
+    bool still_drawing =
+        ppu_mode(&g) == DRAWING && ppu_mode(&scanline) == HBLANK;
+    if (ppu_mode(&g) != ppu_mode(&scanline) && !still_drawing ||
+        g.mem[MEM_LY] != scanline.mem[MEM_LY]) {
+      FAIL("T cycle %d: PPU_FIFO in mode %d LY %d, PPU_SCANLINE in mode %d "
+           "LY %d",
+           t, ppu_mode(&g), g.mem[MEM_LY], ppu_mode(&scanline),
+           scanline.mem[MEM_LY]);
+    }
+  }
+}
+
+static void run_fifo_mid_line_test() {
+  enum { SPLIT_X = 80 };
+  uint32_t seed = 2;
+  static Gameboy g;
+  g = (Gameboy){.ppu_model = PPU_FIFO};
+  random_scene(&g, &seed);
+  g.mem[MEM_LCDC] &= ~LCDC_WIN_ENABLED;
+  ppu_enable(&g);
+  while (ppu_mode(&g) != DRAWING || g.ppu.fifo.x < SPLIT_X) {
+    ppu_tcycle(&g);
+  }
+  // Change the background pallet part way through the line.
+  RefWindow win = {};
+  uint8_t before[SCREEN_WIDTH], after[SCREEN_WIDTH];
+  ref_line(&g, 0, &win, before);
+  g.mem[MEM_BGP] = ~g.mem[MEM_BGP];
+  ref_line(&g, 0, &win, after);
+  while (ppu_mode(&g) == DRAWING) {
+    ppu_tcycle(&g);
+  }
+  for (int x = 0; x < SCREEN_WIDTH; x++) {
+    int want = x < SPLIT_X ? before[x] : after[x];
+    if (g.lcd[0][x] != want) {
+      FAIL("pixel %d is %d, wanted %d", x, g.lcd[0][x], want);
+    }
+  }
+}
+
+static void run_decode_tile_rows_test() {
+  // Every pair of low and high bytes.
+  enum { NUM_ROWS = 1 << 16 };
+  static uint8_t data[2 * NUM_ROWS];
+  for (int i = 0; i < NUM_ROWS; i++) {
+    data[2 * i] = i;
+    data[2 * i + 1] = i >> 8;
+  }
+  static uint8_t out[NUM_ROWS][TILE_WIDTH];
+  const uint8_t pallets[] = {PALLET_IDENTITY, 0x1B, 0x00, 0xFF, 0x9C};
+  for (int p = 0; p < ARRAY_SIZE(pallets); p++) {
+    // Leave an odd number of rows to decode after any vectorized ones.
+    for (int n = NUM_ROWS - 3; n <= NUM_ROWS; n += 3) {
+      memset(out, 0xFF, sizeof(out));
+      decode_tile_rows(data, n, pallets[p], out[0]);
+      for (int i = 0; i < NUM_ROWS; i++) {
+        for (int x = 0; x < TILE_WIDTH; x++) {
+          int ci = tile_px(data[2 * i], data[2 * i + 1], x);
+          int want = i < n ? pallets[p] >> 2 * ci & 0x3 : 0xFF;
+          if (out[i][x] != want) {
+            FAIL("pallet %02X, %d rows: row %04X pixel %d is %d, wanted %d",
+                 pallets[p], n, i, x, out[i][x], want);
+          }
+        }
+      }
+    }
+  }
+}
+
 int main() {
   run_stopped_test();
   run_cycle_count_tests();
+  run_advance_test(PPU_SCANLINE);
+  run_advance_test(PPU_FIFO);
+  run_render_test(PPU_SCANLINE);
+  run_render_test(PPU_FIFO);
+  run_fifo_timing_test();
+  run_fifo_mid_line_test();
+  run_decode_tile_rows_test();
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "gameboy.h"
+
+#include "buf/buffer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  INIT_COUNTS_CAP = 1024,
+  INIT_NODES_CAP = 64,
+  // The longest routine name, BBB:AAAA, with its \0.
+  MAX_NAME = 9,
+};
+
+static uint32_t hash(uint64_t x) {
+  return (x * 0x9E3779B97F4A7C15) >> 32;
+}
+
+uint32_t profile_key(const Gameboy *g, uint16_t addr) {
+  if (addr > MEM_ROM_END) {
+    return addr;
+  }
+  int bank = addr < MEM_ROM_N_START ? g->mbc.rom_bank0 : g->mbc.rom_bank;
+  return (uint32_t)(bank + 1) << 16 | addr;
+}
+
+static void key_name(char name[MAX_NAME], uint32_t key) {
+  if (key >> 16 == 0) {
+    snprintf(name, MAX_NAME, "%04X", key);
+  } else {
+    snprintf(name, MAX_NAME, "%02X:%04X", (key >> 16) - 1, key & 0xFFFF);
+  }
+}
+
+Profile init_profile(const Gameboy *g) {
+  Profile p = {
+      .counts = calloc(INIT_COUNTS_CAP, sizeof(ProfileCount)),
+      .counts_cap = INIT_COUNTS_CAP,
+      .nodes = malloc(INIT_NODES_CAP * sizeof(ProfileNode)),
+      .nnodes = 1,
+      .nodes_cap = INIT_NODES_CAP,
+      .slots = calloc(2 * INIT_NODES_CAP, sizeof(int)),
+      .slots_cap = 2 * INIT_NODES_CAP,
+      // The next instruction has been fetched into IR,
+      // so PC is one past it.
+      .start = profile_key(g, g->cpu.pc - 1),
+      .start_sp = g->cpu.sp,
+  };
+  if (p.counts == NULL || p.nodes == NULL || p.slots == NULL) {
+    fail("failed to allocate profile");
+  }
+  p.nodes[0] = (ProfileNode){.parent = -1};
+  return p;
+}
+
+void free_profile(Profile *p) {
+  free(p->counts);
+  free(p->nodes);
+  free(p->slots);
+  *p = (Profile){};
+}
+
+static void grow_counts(Profile *p) {
+  ProfileCount *old = p->counts;
+  int old_cap = p->counts_cap;
+  p->counts_cap *= 2;
+  p->counts = calloc(p->counts_cap, sizeof(ProfileCount));
+  if (p->counts == NULL) {
+    fail("failed to allocate profile");
+  }
+  int mask = p->counts_cap - 1;
+  for (int i = 0; i < old_cap; i++) {
+    if (old[i].key == 0) {
+      continue;
+    }
+    int j = hash(old[i].key) & mask;
+    while (p->counts[j].key != 0) {
+      j = (j + 1) & mask;
+    }
+    p->counts[j] = old[i];
+  }
+  free(old);
+}
+
+// Returns the count for key, adding it if it is new.
+static ProfileCount *find_count(Profile *p, uint32_t key) {
+  int mask = p->counts_cap - 1;
+  int i = hash(key) & mask;
+  while (p->counts[i].key != key) {
+    if (p->counts[i].key == 0) {
+      // Keep the table at most half full.
+      if (2 * (p->ncounts + 1) > p->counts_cap) {
+        grow_counts(p);
+        return find_count(p, key);
+      }
+      p->counts[i].key = key;
+      p->ncounts++;
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return &p->counts[i];
+}
+
+static int node_slot(const Profile *p, int parent, uint32_t key) {
+  int mask = p->slots_cap - 1;
+  int i = hash((uint64_t)parent << 32 | key) & mask;
+  for (;;) {
+    int n = p->slots[i];
+    if (n == 0 ||
+        p->nodes[n - 1].parent == parent && p->nodes[n - 1].key == key) {
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static void grow_nodes(Profile *p) {
+  p->nodes_cap *= 2;
+  p->nodes = realloc(p->nodes, p->nodes_cap * sizeof(ProfileNode));
+  free(p->slots);
+  p->slots_cap = 2 * p->nodes_cap;
+  p->slots = calloc(p->slots_cap, sizeof(int));
+  if (p->nodes == NULL || p->slots == NULL) {
+    fail("failed to allocate profile");
+  }
+  // The root is not called from anywhere, so it has no slot.
+  for (int i = 1; i < p->nnodes; i++) {
+    const ProfileNode *n = &p->nodes[i];
+    p->slots[node_slot(p, n->parent, n->key)] = i + 1;
+  }
+}
+
+// Returns the index of the node for a call to key from parent,
+// adding it if it is new.
+static int find_node(Profile *p, int parent, uint32_t key) {
+  int i = node_slot(p, parent, key);
+  if (p->slots[i] != 0) {
+    return p->slots[i] - 1;
+  }
+  if (p->nnodes == p->nodes_cap) {
+    grow_nodes(p);
+    i = node_slot(p, parent, key);
+  }
+  p->nodes[p->nnodes] = (ProfileNode){.key = key, .parent = parent};
+  p->slots[i] = ++p->nnodes;
+  return p->nnodes - 1;
+}
+
+static void enter(Profile *p, uint32_t key) {
+  if (p->depth == PROFILE_MAX_DEPTH) {
+    p->lost++;
+    return;
+  }
+  p->node = find_node(p, p->node, key);
+  p->depth++;
+}
+
+static void leave(Profile *p) {
+  if (p->lost > 0) {
+    p->lost--;
+  } else if (p->depth > 0) {
+    p->node = p->nodes[p->node].parent;
+    p->depth--;
+  }
+}
+
+// Returns whether op_code is that of an instruction,
+// rather than an interrupt dispatch, and is not 0xCB-prefixed.
+static bool unprefixed(int op_code) {
+  return op_code >= 0 && op_code < 0x100;
+}
+
+// CALL, CALL cc, and RST.
+static bool is_call(int op_code) {
+  return unprefixed(op_code) && (op_code == 0xCD || (op_code & 0xE7) == 0xC4 ||
+                                 (op_code & 0xC7) == 0xC7);
+}
+
+// RET, RETI, and RET cc.
+static bool is_ret(int op_code) {
+  return unprefixed(op_code) && (op_code == 0xC9 || op_code == 0xD9 ||
+                                 (op_code & 0xE7) == 0xC0);
+}
+
+void profile_instruction(Profile *p, const Gameboy *g, int op_code,
+                         int mcycles) {
+  const Cpu *cpu = &g->cpu;
+  uint32_t next = profile_key(g, cpu->pc - 1);
+  if (op_code < 0) {
+    // The dispatch counts as part of the handler,
+    // which is called from the interrupted code.
+    enter(p, next);
+    p->start = next;
+  }
+  find_count(p, p->start)->mcycles += mcycles;
+  p->nodes[p->node].self += mcycles;
+  // Conditional calls and returns are taken if they moved SP.
+  if (is_call(op_code) && cpu->sp == (uint16_t)(p->start_sp - 2)) {
+    enter(p, next);
+  } else if (is_ret(op_code) && cpu->sp == (uint16_t)(p->start_sp + 2)) {
+    leave(p);
+  }
+  p->start = next;
+  p->start_sp = cpu->sp;
+}
+
+// Returns the disassembly of the instruction at key,
+// using mem, of MEM_SIZE bytes, for scratch space.
+static Disasm disassemble_key(const Gameboy *g, uint32_t key, uint8_t *mem) {
+  uint16_t addr = key & 0xFFFF;
+  int bank = (int)(key >> 16) - 1;
+  bool has_cart = g->rom != NULL && g->rom->data != NULL;
+  // Instructions are at most 3 bytes, and disassemble wants one more.
+  for (int i = 0; i < 4 && addr + i < MEM_SIZE; i++) {
+    long offs = (long)bank * ROM_BANK_SIZE + (addr + i) % ROM_BANK_SIZE;
+    if (bank < 0 || !has_cart) {
+      mem[addr + i] = gameboy_peek(g, addr + i);
+    } else if (offs < g->rom->size) {
+      mem[addr + i] = g->rom->data[offs];
+    } else {
+      mem[addr + i] = 0xFF;
+    }
+  }
+  return disassemble(mem, MEM_SIZE, addr);
+}
+
+// A routine's M cycles, summed over the nodes calling it.
+typedef struct {
+  uint32_t key;
+  long total;
+  long self;
+} Routine;
+
+static int count_cmp(const void *a, const void *b) {
+  const ProfileCount *x = a, *y = b;
+  if (x->mcycles != y->mcycles) {
+    return x->mcycles < y->mcycles ? 1 : -1;
+  }
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int routine_key_cmp(const void *a, const void *b) {
+  const Routine *x = a, *y = b;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int routine_total_cmp(const void *a, const void *b) {
+  const Routine *x = a, *y = b;
+  if (x->total != y->total) {
+    return x->total < y->total ? 1 : -1;
+  }
+  return routine_key_cmp(a, b);
+}
+
+// Returns whether a caller of node i calls the same routine,
+// in which case its M cycles are already counted for the caller.
+static bool recursive(const Profile *p, int i) {
+  for (int j = p->nodes[i].parent; j > 0; j = p->nodes[j].parent) {
+    if (p->nodes[j].key == p->nodes[i].key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the routines called in p sorted by decreasing total M cycles,
+// and sets *n to their number.
+// The returned array must be freed by the caller.
+static Routine *routines(const Profile *p, int *n) {
+  long *totals = calloc(p->nnodes, sizeof(long));
+  Routine *rs = calloc(p->nnodes, sizeof(Routine));
+  if (totals == NULL || rs == NULL) {
+    fail("failed to allocate profile report");
+  }
+  // Callees are always added after their callers.
+  for (int i = p->nnodes - 1; i > 0; i--) {
+    totals[i] += p->nodes[i].self;
+    totals[p->nodes[i].parent] += totals[i];
+  }
+  for (int i = 1; i < p->nnodes; i++) {
+    rs[i - 1] = (Routine){
+        .key = p->nodes[i].key,
+        .total = recursive(p, i) ? 0 : totals[i],
+        .self = p->nodes[i].self,
+    };
+  }
+  free(totals);
+  qsort(rs, p->nnodes - 1, sizeof(Routine), routine_key_cmp);
+  *n = 0;
+  for (int i = 0; i < p->nnodes - 1; i++) {
+    if (*n > 0 && rs[*n - 1].key == rs[i].key) {
+      rs[*n - 1].total += rs[i].total;
+      rs[*n - 1].self += rs[i].self;
+    } else {
+      rs[(*n)++] = rs[i];
+    }
+  }
+  qsort(rs, *n, sizeof(Routine), routine_total_cmp);
+  return rs;
+}
+
+static double percent(long x, long total) {
+  return total == 0 ? 0 : 100.0 * x / total;
+}
+
+char *profile_report(const Profile *p, const Gameboy *g, int n) {
+  ProfileCount *counts = malloc((p->ncounts + 1) * sizeof(ProfileCount));
+  if (counts == NULL) {
+    fail("failed to allocate profile report");
+  }
+  long total = 0;
+  int ncounts = 0;
+  for (int i = 0; i < p->counts_cap; i++) {
+    if (p->counts[i].key != 0) {
+      counts[ncounts++] = p->counts[i];
+      total += p->counts[i].mcycles;
+    }
+  }
+  qsort(counts, ncounts, sizeof(ProfileCount), count_cmp);
+
+  uint8_t *mem = malloc(MEM_SIZE);
+  if (mem == NULL) {
+    fail("failed to allocate profile report");
+  }
+  Buffer buf = {};
+  char name[MAX_NAME];
+  bprintf(&buf, "%ld M cycles profiled\n\n", total);
+  bprintf(&buf, "   mcycles       %%  address  instruction\n");
+  for (int i = 0; i < ncounts && i < n; i++) {
+    key_name(name, counts[i].key);
+    bprintf(&buf, "%10ld  %5.1f%%  %7s  %s\n", counts[i].mcycles,
+            percent(counts[i].mcycles, total), name,
+            disassemble_key(g, counts[i].key, mem).instr);
+  }
+  free(counts);
+  free(mem);
+
+  int nrs = 0;
+  Routine *rs = routines(p, &nrs);
+  bprintf(&buf, "\n     total       %%        self  routine\n");
+  bprintf(&buf, "%10ld  %5.1f%%  %10ld  root\n", total, percent(total, total),
+          p->nodes[0].self);
+  for (int i = 0; i < nrs && i < n; i++) {
+    key_name(name, rs[i].key);
+    bprintf(&buf, "%10ld  %5.1f%%  %10ld  %s\n", rs[i].total,
+            percent(rs[i].total, total), rs[i].self, name);
+  }
+  free(rs);
+  return buf.data;
+}
+
+void write_profile_stacks(const Profile *p, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fail("failed to create %s", path);
+  }
+  for (int i = 0; i < p->nnodes; i++) {
+    if (p->nodes[i].self == 0) {
+      continue;
+    }
+    uint32_t keys[PROFILE_MAX_DEPTH];
+    int depth = 0;
+    for (int j = i; j > 0; j = p->nodes[j].parent) {
+      keys[depth++] = p->nodes[j].key;
+    }
+    fprintf(f, "root");
+    char name[MAX_NAME];
+    while (depth > 0) {
+      key_name(name, keys[--depth]);
+      fprintf(f, ";%s", name);
+    }
+    fprintf(f, " %ld\n", p->nodes[i].self);
+  }
+  if (fclose(f) != 0) {
+    fail("failed to write %s", path);
+  }
+}
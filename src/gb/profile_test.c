@@ -0,0 +1,189 @@
+// Needed for mkstemp.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gameboy.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+// Calls a routine that calls another, forever,
+// with the VBLANK interrupt enabled.
+static const uint8_t call_program[] = {
+    0x31, 0xFE, 0xFF, // $0000: LD SP, $FFFE
+    0x3E, 0x01,       // $0003: LD A, $01
+    0xE0, 0xFF,       // $0005: LDH [IE], A
+    0xFB,             // $0007: EI
+    0xCD, 0x10, 0x00, // $0008: CALL $0010
+    0x18, 0xFB,       // $000B: JR -5
+};
+
+// The routines at $0010 and $0020, and the VBLANK handler at $0040.
+static const uint8_t call_routine[] = {0xCD, 0x20, 0x00, 0xC9};
+static const uint8_t nops_routine[] = {0x00, 0x00, 0xC9};
+static const uint8_t vblank_handler[] = {0xD9};
+
+static void run_profile_test(Engine engine) {
+  enum { FRAMES = 3 };
+  static GameboyStats stats;
+  stats = (GameboyStats){};
+  static Gameboy g;
+  g = (Gameboy){
+      .engine = engine,
+      .mem =
+          {
+              [MEM_LCDC] = LCDC_ENABLED,
+              [MEM_STAT] = OAM_SCAN,
+          },
+      .stats = &stats,
+  };
+  memcpy(g.mem, call_program, sizeof(call_program));
+  memcpy(g.mem + 0x10, call_routine, sizeof(call_routine));
+  memcpy(g.mem + 0x20, nops_routine, sizeof(nops_routine));
+  memcpy(g.mem + 0x40, vblank_handler, sizeof(vblank_handler));
+  Profile p = init_profile(&g);
+  stats.profile = &p;
+  for (int i = 0; i < FRAMES; i++) {
+    run_frame(&g, LONG_MAX);
+  }
+
+  long total = 0;
+  for (int i = 0; i < p.counts_cap; i++) {
+    total += p.counts[i].mcycles;
+  }
+  if (total != stats.mcycles) {
+    FAIL("profiled %ld M cycles, wanted %ld", total, stats.mcycles);
+  }
+  ProfileCount *call = NULL;
+  for (int i = 0; i < p.counts_cap; i++) {
+    if (p.counts[i].key == profile_key(&g, 0x0008)) {
+      call = &p.counts[i];
+    }
+  }
+  if (call == NULL || call->mcycles % 6 != 0) {
+    FAIL("CALL at $0008 has %ld M cycles, wanted a multiple of 6",
+         call == NULL ? 0 : call->mcycles);
+  }
+
+  char path[] = "/tmp/profile_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    FAIL("failed to create temp file");
+  }
+  write_profile_stacks(&p, path);
+  FILE *f = fopen(path, "r");
+  char line[256];
+  long folded = 0;
+  bool callee = false, interrupt = false;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char stack[200];
+    long n;
+    if (sscanf(line, "%199s %ld", stack, &n) != 2 ||
+        strncmp(stack, "root", 4) != 0) {
+      FAIL("bad folded stack line: %s", line);
+    }
+    folded += n;
+    callee |= strcmp(stack, "root;00:0010;00:0020") == 0;
+    interrupt |= strstr(stack, ";00:0040") != NULL;
+    // Every CALL and interrupt was matched by a RET or RETI.
+    int depth = 0;
+    for (const char *s = stack; *s != '\0'; s++) {
+      depth += *s == ';';
+    }
+    if (depth > 3) {
+      FAIL("stack is too deep: %s", stack);
+    }
+  }
+  fclose(f);
+  unlink(path);
+  if (folded != total) {
+    FAIL("folded stacks have %ld M cycles, wanted %ld", folded, total);
+  }
+  if (!callee) {
+    FAIL("no stack for $0020 called from $0010");
+  }
+  if (!interrupt) {
+    FAIL("no stack for the VBLANK handler");
+  }
+
+  char *report = profile_report(&p, &g, 10);
+  if (strstr(report, "CALL") == NULL || strstr(report, "RETI") == NULL) {
+    FAIL("report is missing disassembly:\n%s", report);
+  }
+  free(report);
+  free_profile(&p);
+}
+
+// Calls deeper than the tree is kept,
+// then returns from every call.
+static void run_profile_depth_test() {
+  enum { CALLS = PROFILE_MAX_DEPTH + 10, PCS = 3000 };
+  static Gameboy g;
+  g = (Gameboy){};
+  g.cpu.pc = MEM_WRAM_START + 1;
+  g.cpu.sp = 0xFFFE;
+  Profile p = init_profile(&g);
+  for (int i = 0; i < CALLS; i++) {
+    g.cpu.sp -= 2;
+    g.cpu.pc = MEM_WRAM_START + 1 + i;
+    profile_instruction(&p, &g, 0xCD, 6);
+  }
+  if (p.depth != PROFILE_MAX_DEPTH || p.lost != CALLS - PROFILE_MAX_DEPTH) {
+    FAIL("got depth %d and %d lost, wanted %d and %d", p.depth, p.lost,
+         PROFILE_MAX_DEPTH, CALLS - PROFILE_MAX_DEPTH);
+  }
+  for (int i = 0; i < CALLS; i++) {
+    g.cpu.sp += 2;
+    profile_instruction(&p, &g, 0xC9, 4);
+  }
+  if (p.node != 0 || p.depth != 0 || p.lost != 0) {
+    FAIL("got node %d depth %d and %d lost after returning, wanted 0",
+         p.node, p.depth, p.lost);
+  }
+  if (p.nnodes != PROFILE_MAX_DEPTH + 1) {
+    FAIL("got %d nodes, wanted %d", p.nnodes, PROFILE_MAX_DEPTH + 1);
+  }
+  // A RET not matching a CALL leaves the root alone.
+  g.cpu.sp += 2;
+  profile_instruction(&p, &g, 0xC9, 4);
+  // A 0xCB-prefixed instruction is not an RST.
+  profile_instruction(&p, &g, 0x100 + 0xFF, 2);
+  if (p.node != 0) {
+    FAIL("got node %d, wanted the root", p.node);
+  }
+  // An interrupt dispatch is a single call.
+  g.cpu.sp -= 2;
+  profile_instruction(&p, &g, -1, 5);
+  if (p.depth != 1) {
+    FAIL("got depth %d after an interrupt, wanted 1", p.depth);
+  }
+  g.cpu.sp += 2;
+  profile_instruction(&p, &g, 0xD9, 4);
+  if (p.node != 0) {
+    FAIL("got node %d after RETI, wanted the root", p.node);
+  }
+  // Each instruction is counted at the address fetched by the one before.
+  for (int i = 0; i <= PCS; i++) {
+    g.cpu.pc = MEM_WRAM_START + 1 + i;
+    profile_instruction(&p, &g, 0x00, 1);
+  }
+  if (p.ncounts < PCS) {
+    FAIL("got %d instructions, wanted at least %d", p.ncounts, PCS);
+  }
+  free_profile(&p);
+}
+
+int main() {
+  run_profile_test(ENGINE_MCYCLE);
+  run_profile_test(ENGINE_INSTRUCTION);
+  run_profile_depth_test();
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include "gameboy.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  // Runs of non-zero bytes are extended over runs of fewer zero bytes
+  // than this, which would cost about as much to encode as to store.
+  MIN_ZERO_RUN = 8,
+
+  // The most bytes a varint takes.
+  MAX_VARINT_SIZE = 5,
+};
+
+static uint8_t *put_varint(uint8_t *p, uint32_t x) {
+  while (x >= 0x80) {
+    *p++ = x | 0x80;
+    x >>= 7;
+  }
+  *p++ = x;
+  return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint32_t *x) {
+  *x = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = *p++;
+    *x |= (uint32_t)(b & 0x7F) << shift;
+    if (b < 0x80) {
+      return p;
+    }
+  }
+}
+
+// Returns the size of the buffer needed to encode n bytes with encode_delta.
+static int encode_cap(int n) {
+  // Every pair but the last covers at least MIN_ZERO_RUN unencoded bytes.
+  return n + (n / MIN_ZERO_RUN + 1) * 2 * MAX_VARINT_SIZE;
+}
+
+static inline uint8_t xor_at(const uint8_t *cur, const uint8_t *base, int i) {
+  return base == NULL ? cur[i] : cur[i] ^ base[i];
+}
+
+// Encodes the n bytes of cur XOR base into dst,
+// which must hold encode_cap(n) bytes, and returns the encoded size.
+// If base is NULL, cur itself is encoded.
+// The encoding is a sequence of pairs of varints,
+// a count of zero bytes and a count of non-zero bytes,
+// each followed by the non-zero bytes.
+static int encode_delta(uint8_t *dst, const uint8_t *cur, const uint8_t *base,
+                        int n) {
+  uint8_t *p = dst;
+  int i = 0;
+  while (i < n) {
+    int zeros_start = i;
+    if (base != NULL) {
+      // Most of a delta is zeros, so skip them a word at a time.
+      while (i + 8 <= n && memcmp(cur + i, base + i, 8) == 0) {
+        i += 8;
+      }
+    }
+    while (i < n && xor_at(cur, base, i) == 0) {
+      i++;
+    }
+    int start = i;
+    for (;;) {
+      while (i < n && xor_at(cur, base, i) != 0) {
+        i++;
+      }
+      int j = i;
+      while (j < n && j - i < MIN_ZERO_RUN && xor_at(cur, base, j) == 0) {
+        j++;
+      }
+      if (j == n || j - i == MIN_ZERO_RUN) {
+        break;
+      }
+      i = j;
+    }
+    p = put_varint(p, start - zeros_start);
+    p = put_varint(p, i - start);
+    for (int k = start; k < i; k++) {
+      *p++ = xor_at(cur, base, k);
+    }
+  }
+  return p - dst;
+}
+
+// XORs the bytes encoded in f into snap.
+static void apply_delta(uint8_t *snap, const RewindFrame *f) {
+  const uint8_t *p = f->data;
+  const uint8_t *end = p + f->size;
+  while (p < end) {
+    uint32_t zeros, n;
+    p = get_varint(p, &zeros);
+    p = get_varint(p, &n);
+    snap += zeros;
+    for (uint32_t i = 0; i < n; i++) {
+      snap[i] ^= p[i];
+    }
+    snap += n;
+    p += n;
+  }
+}
+
+Rewind init_rewind(const Gameboy *g, int max_frames, int key_interval) {
+  if (max_frames < 1 || key_interval < 1) {
+    fail("bad rewind size: %d frames, keyframe every %d", max_frames,
+         key_interval);
+  }
+  int ext_ram_size = g->ext_ram == NULL ? 0 : g->rom->ram_size;
+  Rewind r = {
+      .max_frames = max_frames,
+      .key_interval = key_interval,
+      .frames = calloc(max_frames, sizeof(RewindFrame)),
+      .snap_size = sizeof(Gameboy) + ext_ram_size,
+  };
+  r.key = malloc(r.snap_size);
+  r.snap = malloc(r.snap_size);
+  r.enc = malloc(encode_cap(r.snap_size));
+  if (r.frames == NULL || r.key == NULL || r.snap == NULL || r.enc == NULL) {
+    fail("failed to allocate rewind");
+  }
+  return r;
+}
+
+static RewindFrame *frame_at(const Rewind *r, int i) {
+  return &r->frames[(r->start + i) % r->max_frames];
+}
+
+static void drop_frame(Rewind *r, RewindFrame *f) {
+  r->bytes -= f->size;
+  free(f->data);
+  *f = (RewindFrame){};
+  r->n--;
+}
+
+void free_rewind(Rewind *r) {
+  while (r->n > 0) {
+    drop_frame(r, frame_at(r, r->n - 1));
+  }
+  free(r->frames);
+  free(r->key);
+  free(r->snap);
+  free(r->enc);
+  *r = (Rewind){};
+}
+
+// Drops the oldest keyframe and the frames that depend on it.
+static void drop_oldest(Rewind *r) {
+  do {
+    drop_frame(r, frame_at(r, 0));
+    r->start = (r->start + 1) % r->max_frames;
+  } while (r->n > 0 && !frame_at(r, 0)->key);
+}
+
+void rewind_record(Rewind *r, Gameboy *g) {
+  gameboy_sync(g);
+  if (r->n == r->max_frames) {
+    drop_oldest(r);
+  }
+  memcpy(r->snap, g, sizeof(Gameboy));
+  // The memory map is a cache of pointers that changes with the banks,
+  // and is rebuilt after restoring, so it is left out.
+  memset(r->snap + offsetof(Gameboy, mem_map), 0, sizeof(MemMap));
+  if (r->snap_size > sizeof(Gameboy)) {
+    memcpy(r->snap + sizeof(Gameboy), g->ext_ram,
+           r->snap_size - sizeof(Gameboy));
+  }
+  RewindFrame f = {.key = r->n == 0 || r->since_key + 1 >= r->key_interval};
+  if (f.key) {
+    memcpy(r->key, r->snap, r->snap_size);
+    f.size = encode_delta(r->enc, r->snap, NULL, r->snap_size);
+    r->since_key = 0;
+  } else {
+    f.size = encode_delta(r->enc, r->snap, r->key, r->snap_size);
+    r->since_key++;
+  }
+  f.data = malloc(f.size);
+  if (f.data == NULL) {
+    fail("failed to allocate rewind frame");
+  }
+  memcpy(f.data, r->enc, f.size);
+  *frame_at(r, r->n) = f;
+  r->n++;
+  r->bytes += f.size;
+}
+
+bool rewind_back(Rewind *r, Gameboy *g, int n) {
+  if (n < 0 || n >= r->n) {
+    return false;
+  }
+  int i = r->n - 1 - n;
+  int k = i;
+  while (!frame_at(r, k)->key) {
+    k--;
+  }
+  // The newest keyframe is already decoded.
+  if (k != r->n - 1 - r->since_key) {
+    memset(r->key, 0, r->snap_size);
+    apply_delta(r->key, frame_at(r, k));
+  }
+  memcpy(r->snap, r->key, r->snap_size);
+  if (i != k) {
+    apply_delta(r->snap, frame_at(r, i));
+  }
+  while (r->n > i + 1) {
+    drop_frame(r, frame_at(r, r->n - 1));
+  }
+  r->since_key = i - k;
+
+  // Keep g's own external RAM, in case it was remapped since the snapshot.
+  uint8_t *ext_ram = g->ext_ram;
+  bool ext_ram_mapped = g->ext_ram_mapped;
+  memcpy(g, r->snap, sizeof(Gameboy));
+  // The snapshot's memory map is zeroed,
+  // so it is rebuilt before the next access.
+  g->ext_ram = ext_ram;
+  g->ext_ram_mapped = ext_ram_mapped;
+  if (r->snap_size > sizeof(Gameboy)) {
+    memcpy(g->ext_ram, r->snap + sizeof(Gameboy),
+           r->snap_size - sizeof(Gameboy));
+  }
+  return true;
+}
+
+long rewind_bytes_per_minute(const Rewind *r) {
+  if (r->n == 0) {
+    return 0;
+  }
+  // The Gameboy clock is 2²² Hz.
+  double frames_per_minute = 60.0 * (1 << 22) / (4 * MCYCLES_PER_FRAME);
+  return r->bytes * frames_per_minute / r->n;
+}
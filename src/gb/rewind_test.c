@@ -0,0 +1,111 @@
+#include "count_rom_test.h"
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+static void run_rewind_test(Engine engine) {
+  enum {
+    FRAMES = 20,
+    MAX_FRAMES = 16,
+    KEY_INTERVAL = 5,
+  };
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  Rewind r = init_rewind(&g, MAX_FRAMES, KEY_INTERVAL);
+  uint64_t hashes[FRAMES];
+  for (int i = 0; i < FRAMES; i++) {
+    run_frame(&g, MCYCLES_PER_FRAME);
+    rewind_record(&r, &g);
+    hashes[i] = state_hash(&g);
+  }
+  // Frames 0-4 were dropped together when the ring filled.
+  if (r.n != FRAMES - KEY_INTERVAL) {
+    FAIL("got %d frames, wanted %d", r.n, FRAMES - KEY_INTERVAL);
+  }
+  if (rewind_back(&r, &g, r.n)) {
+    FAIL("stepped back past the oldest frame");
+  }
+  if (!rewind_back(&r, &g, 3)) {
+    FAIL("failed to step back 3 frames");
+  }
+  int i = FRAMES - 1 - 3;
+  if (state_hash(&g) != hashes[i]) {
+    FAIL("frame %d: got state hash %016llx, wanted %016llx", i,
+         (unsigned long long)state_hash(&g), (unsigned long long)hashes[i]);
+  }
+  // Running on from the restored frame repeats the same frames.
+  for (i++; i < FRAMES; i++) {
+    run_frame(&g, MCYCLES_PER_FRAME);
+    rewind_record(&r, &g);
+    if (state_hash(&g) != hashes[i]) {
+      FAIL("frame %d: got state hash %016llx, wanted %016llx", i,
+           (unsigned long long)state_hash(&g), (unsigned long long)hashes[i]);
+    }
+  }
+  // Step back to each frame, oldest last, crossing keyframes.
+  for (i = FRAMES - 2; i >= KEY_INTERVAL; i--) {
+    if (!rewind_back(&r, &g, 1)) {
+      FAIL("failed to step back to frame %d", i);
+    }
+    if (state_hash(&g) != hashes[i]) {
+      FAIL("frame %d: got state hash %016llx, wanted %016llx", i,
+           (unsigned long long)state_hash(&g), (unsigned long long)hashes[i]);
+    }
+  }
+  if (r.n != 1) {
+    FAIL("got %d frames, wanted 1", r.n);
+  }
+  free_rewind(&r);
+  free_gameboy(&g);
+}
+
+static void run_rewind_size_test() {
+  enum { FRAMES = 60 };
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  Rewind r = init_rewind(&g, FRAMES, FRAMES);
+  for (int i = 0; i < FRAMES; i++) {
+    run_frame(&g, MCYCLES_PER_FRAME);
+    rewind_record(&r, &g);
+  }
+  long bytes = 0;
+  for (int i = 1; i < r.n; i++) {
+    bytes += r.frames[i].size;
+  }
+  // Each frame changes little more than the registers, counters,
+  // and a byte of RAM, so deltas are small.
+  if (bytes / (r.n - 1) > 256) {
+    FAIL("got %ld bytes per delta, wanted at most 256", bytes / (r.n - 1));
+  }
+  if (r.frames[0].size >= r.snap_size) {
+    FAIL("keyframe of %d bytes is not compressed (%d bytes)",
+         r.frames[0].size, r.snap_size);
+  }
+  long want = (long)(r.bytes * 3583.6 / r.n);
+  if (labs(rewind_bytes_per_minute(&r) - want) > want / 100) {
+    FAIL("got %ld bytes per minute, wanted about %ld",
+         rewind_bytes_per_minute(&r), want);
+  }
+  free_rewind(&r);
+  free_gameboy(&g);
+}
+
+int main() {
+  run_rewind_test(ENGINE_MCYCLE);
+  run_rewind_test(ENGINE_INSTRUCTION);
+  run_rewind_size_test();
+  return 0;
+}
@@ -0,0 +1,318 @@
+// Needed for strtok_r.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gameboy.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs a frame as run_frame, playing movie before each instruction
+// if it is not NULL.
+static long run_frame_playing(Movie *movie, Gameboy *g, long max_mcycles) {
+  gameboy_sync(g);
+  int t = ppu_irq_tcycles(g, IF_VBLANK);
+  long m = t == INT_MAX ? MCYCLES_PER_FRAME : (t + 3) / 4;
+  if (m > max_mcycles) {
+    m = max_mcycles;
+  }
+  long n = 0;
+  if (movie == NULL) {
+    while (n < m) {
+      n += mcycle(g);
+    }
+  } else {
+    while (n < m && !movie_done(movie, g)) {
+      movie_play(movie, g);
+      n += mcycle(g);
+    }
+  }
+  gameboy_sync(g);
+  return n;
+}
+
+long run_frame(Gameboy *g, long max_mcycles) {
+  return run_frame_playing(NULL, g, max_mcycles);
+}
+
+long run_movie_frame(Movie *m, Gameboy *g, long max_mcycles) {
+  return run_frame_playing(m, g, max_mcycles);
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001B3;
+  }
+  return h;
+}
+
+static const uint64_t FNV_OFFSET = 0xCBF29CE484222325;
+
+uint64_t lcd_hash(const Gameboy *g) {
+  return fnv1a(FNV_OFFSET, g->lcd, sizeof(g->lcd));
+}
+
+uint64_t state_hash(const Gameboy *g) {
+  const Cpu *cpu = &g->cpu;
+  uint8_t regs[] = {
+      cpu->registers[REG_A], cpu->registers[REG_B], cpu->registers[REG_C],
+      cpu->registers[REG_D], cpu->registers[REG_E], cpu->registers[REG_H],
+      cpu->registers[REG_L], cpu->flags,            cpu->ir,
+      cpu->sp & 0xFF,        cpu->sp >> 8,          cpu->pc & 0xFF,
+      cpu->pc >> 8,          cpu->ime,              cpu->state,
+  };
+  uint64_t h = fnv1a(FNV_OFFSET, regs, sizeof(regs));
+  Mem mem;
+  gameboy_mem_view(g, mem);
+  h = fnv1a(h, mem, sizeof(mem));
+  if (g->ext_ram != NULL) {
+    h = fnv1a(h, g->ext_ram, g->rom->ram_size);
+  }
+  return h;
+}
+
+static const struct {
+  const char *name;
+  uint8_t button;
+  bool dpad;
+} button_names[] = {
+    {"A", BUTTON_A, false},         {"B", BUTTON_B, false},
+    {"START", BUTTON_START, false}, {"SELECT", BUTTON_SELECT, false},
+    {"UP", BUTTON_UP, true},        {"DOWN", BUTTON_DOWN, true},
+    {"LEFT", BUTTON_LEFT, true},    {"RIGHT", BUTTON_RIGHT, true},
+};
+
+// Sets the button named by tok in in, and returns whether it is a button.
+static bool parse_button(Input *in, const char *tok) {
+  for (int i = 0; i < sizeof(button_names) / sizeof(button_names[0]); i++) {
+    if (strcmp(tok, button_names[i].name) != 0) {
+      continue;
+    }
+    if (button_names[i].dpad) {
+      in->dpad |= button_names[i].button;
+    } else {
+      in->buttons |= button_names[i].button;
+    }
+    return true;
+  }
+  return false;
+}
+
+InputScript read_input_script(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fail("failed to open %s", path);
+  }
+  InputScript s = {};
+  int cap = 0;
+  char line[256];
+  for (int lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++) {
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    if (tok == NULL || tok[0] == '#') {
+      continue;
+    }
+    if (s.n == cap) {
+      cap = cap == 0 ? 16 : cap * 2;
+      s.inputs = realloc(s.inputs, cap * sizeof(Input));
+      if (s.inputs == NULL) {
+        fail("failed to allocate inputs");
+      }
+    }
+    Input *in = &s.inputs[s.n];
+    *in = (Input){};
+    char *end = NULL;
+    in->frame = strtol(tok, &end, 10);
+    if (*end != '\0' || in->frame < 0 ||
+        s.n > 0 && in->frame <= s.inputs[s.n - 1].frame) {
+      fail("%s:%d: bad frame number %s", path, lineno, tok);
+    }
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      if (!parse_button(in, tok)) {
+        fail("%s:%d: unknown button %s", path, lineno, tok);
+      }
+    }
+    s.n++;
+  }
+  fclose(f);
+  return s;
+}
+
+void free_input_script(InputScript *s) {
+  free(s->inputs);
+  *s = (InputScript){};
+}
+
+void apply_input_script(InputScript *s, Gameboy *g, long frame) {
+  while (s->next < s->n && s->inputs[s->next].frame <= frame) {
+    g->buttons = s->inputs[s->next].buttons;
+    g->dpad = s->inputs[s->next].dpad;
+    s->next++;
+  }
+}
+
+static const char MOVIE_MAGIC[] = "gbmovie";
+enum { MOVIE_VERSION = 1 };
+
+Movie init_movie(Gameboy *g) {
+  gameboy_sync(g);
+  return (Movie){.start_hash = state_hash(g)};
+}
+
+void free_movie(Movie *m) {
+  free(m->inputs);
+  *m = (Movie){};
+}
+
+static void add_movie_input(Movie *m, MovieInput in) {
+  if (m->n == m->cap) {
+    m->cap = m->cap == 0 ? 16 : m->cap * 2;
+    m->inputs = realloc(m->inputs, m->cap * sizeof(MovieInput));
+    if (m->inputs == NULL) {
+      fail("failed to allocate movie inputs");
+    }
+  }
+  m->inputs[m->n++] = in;
+}
+
+void movie_record(Movie *m, const Gameboy *g) {
+  const MovieInput *last = m->n == 0 ? NULL : &m->inputs[m->n - 1];
+  uint8_t buttons = last == NULL ? 0 : last->buttons;
+  uint8_t dpad = last == NULL ? 0 : last->dpad;
+  if (g->buttons == buttons && g->dpad == dpad) {
+    return;
+  }
+  MovieInput in = {
+      .tcycle = gameboy_tcycles(g),
+      .buttons = g->buttons,
+      .dpad = g->dpad,
+  };
+  // Only the last change before an instruction is seen.
+  if (last != NULL && last->tcycle == in.tcycle) {
+    m->n--;
+  }
+  add_movie_input(m, in);
+}
+
+void movie_truncate(Movie *m, const Gameboy *g) {
+  uint64_t t = gameboy_tcycles(g);
+  while (m->n > 0 && m->inputs[m->n - 1].tcycle > t) {
+    m->n--;
+  }
+}
+
+void movie_end(Movie *m, Gameboy *g) {
+  // A replay stops between instructions, and ENGINE_INSTRUCTION skips over
+  // halted M cycles, so end where the CPU starts its next instruction.
+  long n = 0;
+  while (g->cpu.state != DONE && n < MCYCLES_PER_FRAME) {
+    n += mcycle(g);
+  }
+  gameboy_sync(g);
+  m->has_end = true;
+  m->end_tcycle = g->tcycles;
+  m->end_hash = state_hash(g);
+}
+
+// Writes the names of the buttons of in to f, each preceded by a space.
+static void print_buttons(FILE *f, const MovieInput *in) {
+  for (int i = 0; i < sizeof(button_names) / sizeof(button_names[0]); i++) {
+    uint8_t mask = button_names[i].dpad ? in->dpad : in->buttons;
+    if (mask & button_names[i].button) {
+      fprintf(f, " %s", button_names[i].name);
+    }
+  }
+}
+
+void write_movie(const Movie *m, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fail("failed to create %s", path);
+  }
+  fprintf(f, "%s %d\n", MOVIE_MAGIC, MOVIE_VERSION);
+  fprintf(f, "start %016llx\n", (unsigned long long)m->start_hash);
+  for (int i = 0; i < m->n; i++) {
+    fprintf(f, "%llu", (unsigned long long)m->inputs[i].tcycle);
+    print_buttons(f, &m->inputs[i]);
+    fprintf(f, "\n");
+  }
+  if (m->has_end) {
+    fprintf(f, "end %llu %016llx\n", (unsigned long long)m->end_tcycle,
+            (unsigned long long)m->end_hash);
+  }
+  if (fclose(f) != 0) {
+    fail("failed to write %s", path);
+  }
+}
+
+Movie read_movie(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fail("failed to open %s", path);
+  }
+  Movie m = {};
+  char line[256];
+  int version = 0;
+  unsigned long long x = 0, y = 0;
+  if (fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "gbmovie %d", &version) != 1) {
+    fail("%s: not a movie file", path);
+  }
+  if (version != MOVIE_VERSION) {
+    fail("%s: unsupported movie version %d", path, version);
+  }
+  if (fgets(line, sizeof(line), f) == NULL ||
+      sscanf(line, "start %llx", &x) != 1) {
+    fail("%s:2: expected start", path);
+  }
+  m.start_hash = x;
+  for (int lineno = 3; fgets(line, sizeof(line), f) != NULL; lineno++) {
+    if (m.has_end) {
+      fail("%s:%d: input after end", path, lineno);
+    }
+    if (sscanf(line, "end %llu %llx", &x, &y) == 2) {
+      m.has_end = true;
+      m.end_tcycle = x;
+      m.end_hash = y;
+      continue;
+    }
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    char *end = NULL;
+    x = tok == NULL ? 0 : strtoull(tok, &end, 10);
+    if (tok == NULL || *end != '\0' ||
+        m.n > 0 && x <= m.inputs[m.n - 1].tcycle) {
+      fail("%s:%d: bad T cycle", path, lineno);
+    }
+    Input in = {};
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      if (!parse_button(&in, tok)) {
+        fail("%s:%d: unknown button %s", path, lineno, tok);
+      }
+    }
+    add_movie_input(&m, (MovieInput){x, in.buttons, in.dpad});
+  }
+  fclose(f);
+  return m;
+}
+
+void movie_play(Movie *m, Gameboy *g) {
+  uint64_t t = gameboy_tcycles(g);
+  // g may have been rewound.
+  while (m->next > 0 && m->inputs[m->next - 1].tcycle > t) {
+    m->next--;
+  }
+  while (m->next < m->n && m->inputs[m->next].tcycle <= t) {
+    m->next++;
+  }
+  const MovieInput *in = m->next == 0 ? NULL : &m->inputs[m->next - 1];
+  g->buttons = in == NULL ? 0 : in->buttons;
+  g->dpad = in == NULL ? 0 : in->dpad;
+}
+
+bool movie_done(const Movie *m, const Gameboy *g) {
+  return m->has_end && gameboy_tcycles(g) >= m->end_tcycle;
+}
@@ -0,0 +1,338 @@
+// Needed for writev and readv.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gameboy.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static const char STATE_MAGIC[4] = {'G', 'B', 'S', 'S'};
+
+// The fixed-size start of a save state,
+// holding everything but the large arrays that follow it.
+// Fields are fixed-width, and in native byte order.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+
+  // Identifies the ROM that the state is for.
+  uint8_t rom_header_checksum;
+  uint8_t rom_cart_type;
+  uint16_t rom_global_checksum;
+  uint32_t ext_ram_size;
+  // The first address of Gameboy.mem that follows.
+  // Memory below it is ROM, which is not saved.
+  uint32_t mem_start;
+  uint32_t serial_len;
+
+  uint64_t tcycles;
+  uint16_t counter;
+  uint8_t tima_bit;
+  uint8_t buttons;
+  uint8_t dpad;
+  int32_t dma_ticks_remaining;
+
+  uint8_t registers[8];
+  uint8_t flags, ir;
+  uint16_t sp, pc;
+  uint8_t ime, ei_pend, cpu_state;
+  // Cpu.bank and Cpu.instr are saved as whether the bank is cb_instructions,
+  // and whether instr is set. If set, it is the instruction for ir.
+  uint8_t cb_bank, has_instr;
+  uint8_t w, z;
+  int32_t cycle;
+
+  int32_t ppu_ticks;
+  int32_t nobjs;
+  uint8_t objs[MAX_SCANLINE_OBJS][4];
+  uint8_t wy_hit;
+  int32_t win_line;
+  int32_t mode3_extra;
+  PixelFifo fifo;
+
+  uint8_t ram_enabled, ram_bank_reg, mode, latch;
+  uint16_t rom_bank_reg;
+  int32_t rom_bank0, rom_bank, ram_bank, rtc_reg;
+  uint8_t rtc_regs[NUM_RTC_REGS];
+  uint8_t rtc_latched[NUM_RTC_REGS];
+  uint64_t rtc_synced;
+  int32_t rtc_subsecond;
+} StateHeader;
+
+// Fills the ROM identity fields of h for the Rom of g.
+static void set_rom_id(StateHeader *h, const Gameboy *g) {
+  if (g->rom != NULL) {
+    h->rom_header_checksum = g->rom->header_checksum;
+    h->rom_cart_type = g->rom->cart_type;
+    h->rom_global_checksum = g->rom->global_checksum;
+    h->ext_ram_size = g->ext_ram == NULL ? 0 : g->rom->ram_size;
+  }
+  bool has_cart = g->rom != NULL && g->rom->data != NULL;
+  h->mem_start = has_cart ? MEM_VRAM_START : 0;
+}
+
+// Sets iov to h followed by the arrays of g that h describes,
+// and returns the number of iovecs used, at most 5.
+static int state_iov(StateHeader *h, Gameboy *g, struct iovec iov[5]) {
+  int n = 0;
+  iov[n++] = (struct iovec){h, sizeof(*h)};
+  iov[n++] = (struct iovec){g->mem + h->mem_start, sizeof(Mem) - h->mem_start};
+  iov[n++] = (struct iovec){g->lcd, sizeof(g->lcd)};
+  if (h->ext_ram_size > 0) {
+    iov[n++] = (struct iovec){g->ext_ram, h->ext_ram_size};
+  }
+  if (h->serial_len > 0) {
+    iov[n++] = (struct iovec){g->serial_out, h->serial_len};
+  }
+  return n;
+}
+
+// Calls writev, or readv if read is true, until all of iov is transferred.
+// Returns false with errno set on error,
+// and with errno set to 0 on end of file.
+static bool transfer_all(int fd, struct iovec *iov, int n, bool read) {
+  while (n > 0) {
+    ssize_t m = read ? readv(fd, iov, n) : writev(fd, iov, n);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m <= 0) {
+      if (m == 0) {
+        errno = 0;
+      }
+      return false;
+    }
+    while (n > 0 && m >= iov->iov_len) {
+      m -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + m;
+      iov->iov_len -= m;
+    }
+  }
+  return true;
+}
+
+const char *save_state(Gameboy *g, int fd) {
+  gameboy_sync(g);
+  const Cpu *cpu = &g->cpu;
+  const Mbc *mbc = &g->mbc;
+  StateHeader h = {
+      .version = STATE_VERSION,
+      .serial_len = g->serial_len,
+      .tcycles = g->tcycles,
+      .counter = g->counter,
+      .tima_bit = g->tima_bit,
+      .buttons = g->buttons,
+      .dpad = g->dpad,
+      .dma_ticks_remaining = g->dma_ticks_remaining,
+      .flags = cpu->flags,
+      .ir = cpu->ir,
+      .sp = cpu->sp,
+      .pc = cpu->pc,
+      .ime = cpu->ime,
+      .ei_pend = cpu->ei_pend,
+      .cpu_state = cpu->state,
+      .cb_bank = cpu->bank == cb_instructions,
+      .has_instr = cpu->instr != NULL,
+      .w = cpu->w,
+      .z = cpu->z,
+      .cycle = cpu->cycle,
+      .ppu_ticks = g->ppu.ticks,
+      .nobjs = g->ppu.nobjs,
+      .wy_hit = g->ppu.wy_hit,
+      .win_line = g->ppu.win_line,
+      .mode3_extra = g->ppu.mode3_extra,
+      .fifo = g->ppu.fifo,
+      .ram_enabled = mbc->ram_enabled,
+      .ram_bank_reg = mbc->ram_bank_reg,
+      .mode = mbc->mode,
+      .latch = mbc->latch,
+      .rom_bank_reg = mbc->rom_bank_reg,
+      .rom_bank0 = mbc->rom_bank0,
+      .rom_bank = mbc->rom_bank,
+      .ram_bank = mbc->ram_bank,
+      .rtc_reg = mbc->rtc_reg,
+      .rtc_synced = mbc->rtc.synced,
+      .rtc_subsecond = mbc->rtc.subsecond,
+  };
+  memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+  set_rom_id(&h, g);
+  memcpy(h.registers, cpu->registers, sizeof(h.registers));
+  memcpy(h.objs, g->ppu.objs, sizeof(h.objs));
+  memcpy(h.rtc_regs, mbc->rtc.regs, sizeof(h.rtc_regs));
+  memcpy(h.rtc_latched, mbc->rtc.latched, sizeof(h.rtc_latched));
+
+  struct iovec iov[5];
+  int n = state_iov(&h, g, iov);
+  if (!transfer_all(fd, iov, n, false)) {
+    return "failed to write save state";
+  }
+  return NULL;
+}
+
+// Returns an error if h is not a valid header for a state of g.
+static const char *check_header(const StateHeader *h, const Gameboy *g) {
+  if (memcmp(h->magic, STATE_MAGIC, sizeof(h->magic)) != 0) {
+    return "not a save state";
+  }
+  if (h->version != STATE_VERSION) {
+    return "unsupported save state version";
+  }
+  StateHeader want = {};
+  set_rom_id(&want, g);
+  if (h->rom_header_checksum != want.rom_header_checksum ||
+      h->rom_cart_type != want.rom_cart_type ||
+      h->rom_global_checksum != want.rom_global_checksum ||
+      h->ext_ram_size != want.ext_ram_size || h->mem_start != want.mem_start) {
+    return "save state is for a different ROM";
+  }
+  if (h->serial_len > SERIAL_OUT_SIZE || h->nobjs < 0 ||
+      h->nobjs > MAX_SCANLINE_OBJS || h->cpu_state > HALTED) {
+    return "corrupt save state";
+  }
+  // The window has a line for each line of the screen.
+  // Drawing a line under PPU_FIFO takes no less time than under PPU_SCANLINE,
+  // and no more than that plus the 203 T cycles of HBLANK.
+  if (h->win_line < 0 || h->win_line > SCREEN_HEIGHT || h->mode3_extra < 0 ||
+      h->mode3_extra > 203) {
+    return "corrupt save state";
+  }
+  if (h->fifo.x > SCREEN_WIDTH || h->fifo.bg_n > TILE_WIDTH ||
+      h->fifo.next_obj > MAX_SCANLINE_OBJS) {
+    return "corrupt save state";
+  }
+  // The MBC only maps banks that exist, though RAM banks wrap around.
+  bool has_cart = g->rom != NULL && g->rom->data != NULL;
+  if (has_cart &&
+      (h->rom_bank0 < 0 || h->rom_bank0 >= g->rom->num_rom_banks ||
+       h->rom_bank < 0 || h->rom_bank >= g->rom->num_rom_banks)) {
+    return "corrupt save state";
+  }
+  if (h->ram_bank < 0 || h->ram_bank > 0xF ||
+      h->rtc_reg != 0 && (h->rtc_reg < RTC_S || h->rtc_reg > RTC_DH)) {
+    return "corrupt save state";
+  }
+  // No instruction takes more than 6 M cycles, including an interrupt.
+  if (h->cycle < 0 || h->cycle >= 6) {
+    return "corrupt save state";
+  }
+  return NULL;
+}
+
+// Returns an error if the PixelFifo of h is not valid
+// for a state with the STAT register stat.
+static const char *check_fifo(const StateHeader *h, uint8_t stat) {
+  // The FIFO is reset on the first T cycle of drawing a line,
+  // and drawing ends once x reaches SCREEN_WIDTH.
+  // Otherwise, the FIFO is left from the last line,
+  // whose objects may be more than those of the current line.
+  if ((stat & STAT_PPU_STATE) != DRAWING || h->ppu_ticks == 0) {
+    return NULL;
+  }
+  if (h->fifo.x >= SCREEN_WIDTH || h->fifo.next_obj > h->nobjs) {
+    return "corrupt save state";
+  }
+  return NULL;
+}
+
+const char *load_state(Gameboy *g, int fd) {
+  StateHeader h;
+  struct iovec iov = {&h, sizeof(h)};
+  if (!transfer_all(fd, &iov, 1, true)) {
+    return "failed to read save state";
+  }
+  const char *err = check_header(&h, g);
+  if (err != NULL) {
+    return err;
+  }
+  struct iovec iovs[5];
+  int n = state_iov(&h, g, iovs);
+  // The arrays are read into scratch and copied to g only once all are read,
+  // so that g is unchanged on a read error.
+  // The header is already read.
+  size_t size = 0;
+  for (int i = 1; i < n; i++) {
+    size += iovs[i].iov_len;
+  }
+  uint8_t *scratch = malloc(size);
+  if (scratch == NULL) {
+    fail("failed to allocate %zu bytes", size);
+  }
+  struct iovec reads[5];
+  for (int i = 1, off = 0; i < n; off += iovs[i].iov_len, i++) {
+    reads[i] = (struct iovec){scratch + off, iovs[i].iov_len};
+  }
+  if (!transfer_all(fd, reads + 1, n - 1, true)) {
+    free(scratch);
+    return "failed to read save state";
+  }
+  if ((err = check_fifo(&h, scratch[MEM_STAT - h.mem_start])) != NULL) {
+    free(scratch);
+    return err;
+  }
+  for (int i = 1, off = 0; i < n; off += iovs[i].iov_len, i++) {
+    memcpy(iovs[i].iov_base, scratch + off, iovs[i].iov_len);
+  }
+  free(scratch);
+
+  Cpu *cpu = &g->cpu;
+  memcpy(cpu->registers, h.registers, sizeof(h.registers));
+  cpu->flags = h.flags;
+  cpu->ir = h.ir;
+  cpu->sp = h.sp;
+  cpu->pc = h.pc;
+  cpu->ime = h.ime;
+  cpu->ei_pend = h.ei_pend;
+  cpu->state = h.cpu_state;
+  cpu->bank = h.cb_bank ? cb_instructions : instructions;
+  cpu->instr = h.has_instr ? find_instruction(cpu->bank, cpu->ir) : NULL;
+  cpu->w = h.w;
+  cpu->z = h.z;
+  cpu->cycle = h.cycle;
+
+  g->ppu.ticks = h.ppu_ticks;
+  g->ppu.nobjs = h.nobjs;
+  memcpy(g->ppu.objs, h.objs, sizeof(h.objs));
+  g->ppu.wy_hit = h.wy_hit;
+  g->ppu.win_line = h.win_line;
+  g->ppu.mode3_extra = h.mode3_extra;
+  g->ppu.fifo = h.fifo;
+
+  Mbc *mbc = &g->mbc;
+  mbc->ram_enabled = h.ram_enabled;
+  mbc->ram_bank_reg = h.ram_bank_reg;
+  mbc->mode = h.mode;
+  mbc->latch = h.latch;
+  mbc->rom_bank_reg = h.rom_bank_reg;
+  mbc->rom_bank0 = h.rom_bank0;
+  mbc->rom_bank = h.rom_bank;
+  mbc->ram_bank = h.ram_bank;
+  mbc->rtc_reg = h.rtc_reg;
+  memcpy(mbc->rtc.regs, h.rtc_regs, sizeof(h.rtc_regs));
+  memcpy(mbc->rtc.latched, h.rtc_latched, sizeof(h.rtc_latched));
+  mbc->rtc.synced = h.rtc_synced;
+  mbc->rtc.subsecond = h.rtc_subsecond;
+
+  g->serial_len = h.serial_len;
+  g->tcycles = h.tcycles;
+  g->counter = h.counter;
+  g->tima_bit = h.tima_bit;
+  g->buttons = h.buttons;
+  g->dpad = h.dpad;
+  g->dma_ticks_remaining = h.dma_ticks_remaining;
+
+  // The state was saved synced.
+  g->lag = 0;
+  g->mid_mcycle = false;
+  g->next_event = 0;
+  mem_map_invalidate(g);
+  ppu_tiles_changed(g);
+  return NULL;
+}
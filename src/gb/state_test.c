@@ -0,0 +1,201 @@
+// Needed for fileno.
+#define _POSIX_C_SOURCE 200809L
+
+#include "count_rom_test.h"
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FAIL(...)                                                              \
+  do {                                                                         \
+    fprintf(stderr, "%s: ", __func__);                                         \
+    fail(__VA_ARGS__);                                                         \
+  } while (0)
+
+static void run_mcycles(Gameboy *g, long n) {
+  while (n > 0) {
+    n -= mcycle(g);
+  }
+  gameboy_sync(g);
+}
+
+static void run_state_round_trip_test(Engine engine, PpuModel ppu_model) {
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  g.ppu_model = ppu_model;
+  run_mcycles(&g, 3 * MCYCLES_PER_FRAME);
+
+  FILE *f = tmpfile();
+  const char *err = save_state(&g, fileno(f));
+  if (err != NULL) {
+    FAIL("save_state failed: %s", err);
+  }
+  run_mcycles(&g, MCYCLES_PER_FRAME);
+  uint64_t want = state_hash(&g);
+
+  static Gameboy h;
+  h = init_gameboy(&rom);
+  h.engine = engine;
+  h.ppu_model = ppu_model;
+  rewind(f);
+  if ((err = load_state(&h, fileno(f))) != NULL) {
+    FAIL("load_state failed: %s", err);
+  }
+  run_mcycles(&h, MCYCLES_PER_FRAME);
+  char *diff = gameboy_diff(&g, &h);
+  if (diff != NULL) {
+    FAIL("restored Gameboy differs:\n%s", diff);
+  }
+  if (state_hash(&h) != want) {
+    FAIL("got state hash %016llx, wanted %016llx",
+         (unsigned long long)state_hash(&h), (unsigned long long)want);
+  }
+  fclose(f);
+  free_gameboy(&g);
+  free_gameboy(&h);
+}
+
+static void run_state_wrong_rom_test() {
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  run_mcycles(&g, 100);
+  FILE *f = tmpfile();
+  const char *err = save_state(&g, fileno(f));
+  if (err != NULL) {
+    FAIL("save_state failed: %s", err);
+  }
+
+  Rom other = rom;
+  other.header_checksum++;
+  static Gameboy h;
+  h = init_gameboy(&other);
+  uint16_t pc = h.cpu.pc;
+  rewind(f);
+  if (load_state(&h, fileno(f)) == NULL) {
+    FAIL("loaded a state for a different ROM");
+  }
+  if (h.cpu.pc != pc) {
+    FAIL("failed load changed the Gameboy");
+  }
+  fclose(f);
+  free_gameboy(&g);
+  free_gameboy(&h);
+}
+
+static void run_state_truncated_test() {
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  run_mcycles(&g, 100);
+  FILE *f = tmpfile();
+  const char *err = save_state(&g, fileno(f));
+  if (err != NULL) {
+    FAIL("save_state failed: %s", err);
+  }
+  // Cut off the last byte, so that all but the end of external RAM is read.
+  off_t size = lseek(fileno(f), 0, SEEK_CUR);
+  if (ftruncate(fileno(f), size - 1) != 0) {
+    FAIL("failed to truncate the save state");
+  }
+
+  static Gameboy h;
+  h = init_gameboy(&rom);
+  uint64_t want = state_hash(&h);
+  rewind(f);
+  if (load_state(&h, fileno(f)) == NULL) {
+    FAIL("loaded a truncated state");
+  }
+  if (state_hash(&h) != want) {
+    FAIL("failed load changed the Gameboy");
+  }
+  fclose(f);
+  free_gameboy(&g);
+  free_gameboy(&h);
+}
+
+// Saves states with fields out of range, which load_state must reject
+// instead of drawing, or mapping memory, out of bounds.
+static void run_state_corrupt_test() {
+  static uint8_t data[4 * ROM_BANK_SIZE];
+  Rom rom = count_rom(data, sizeof(data));
+  static Gameboy g, h;
+  for (int i = 0;; i++) {
+    g = init_gameboy(&rom);
+    g.ppu_model = PPU_FIFO;
+    // Stop part way through drawing a line.
+    while (ppu_mode(&g) != DRAWING || g.ppu.ticks < 20) {
+      run_mcycles(&g, 1);
+    }
+    switch (i) {
+    case 0:
+      g.ppu.fifo.x = SCREEN_WIDTH;
+      break;
+    case 1:
+      g.ppu.fifo.bg_n = TILE_WIDTH + 1;
+      break;
+    case 2:
+      g.ppu.fifo.next_obj = g.ppu.nobjs + 1;
+      break;
+    case 3:
+      g.ppu.win_line = SCREEN_HEIGHT + 1;
+      break;
+    case 4:
+      g.ppu.mode3_extra = -1;
+      break;
+    case 5:
+      g.mbc.ram_bank = -3;
+      break;
+    case 6:
+      g.mbc.rom_bank = -1;
+      break;
+    case 7:
+      g.mbc.rom_bank0 = rom.num_rom_banks;
+      break;
+    case 8:
+      g.mbc.rtc_reg = RTC_DH + 1;
+      break;
+    case 9:
+      g.cpu.cycle = 6;
+      break;
+    default:
+      free_gameboy(&g);
+      return;
+    }
+    FILE *f = tmpfile();
+    const char *err = save_state(&g, fileno(f));
+    if (err != NULL) {
+      FAIL("save_state failed: %s", err);
+    }
+    h = init_gameboy(&rom);
+    uint64_t want = state_hash(&h);
+    rewind(f);
+    if (load_state(&h, fileno(f)) == NULL) {
+      FAIL("case %d: loaded a corrupt state", i);
+    }
+    if (state_hash(&h) != want) {
+      FAIL("case %d: failed load changed the Gameboy", i);
+    }
+    fclose(f);
+    free_gameboy(&g);
+    free_gameboy(&h);
+  }
+}
+
+int main() {
+  run_state_round_trip_test(ENGINE_MCYCLE, PPU_SCANLINE);
+  run_state_round_trip_test(ENGINE_INSTRUCTION, PPU_SCANLINE);
+  run_state_round_trip_test(ENGINE_MCYCLE, PPU_FIFO);
+  run_state_wrong_rom_test();
+  run_state_truncated_test();
+  run_state_corrupt_test();
+  return 0;
+}
@@ -0,0 +1,271 @@
+// Needed for open.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gb/gameboy.h"
+#include "time_ns.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const double NS_PER_S = 1e9;
+static const double MCYCLES_PER_S = (1 << 22) / 4;
+
+// Writes the LCD to path as a binary PGM image.
+static void dump_lcd(const Gameboy *g, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    fail("failed to create %s", path);
+  }
+  fprintf(f, "P5\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    uint8_t row[SCREEN_WIDTH];
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      // Color 0 is the lightest.
+      row[x] = 255 - 85 * (g->lcd[y][x] & 0x3);
+    }
+    fwrite(row, 1, sizeof(row), f);
+  }
+  if (fclose(f) != 0) {
+    fail("failed to write %s", path);
+  }
+}
+
+static void load_state_file(Gameboy *g, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fail("failed to open %s", path);
+  }
+  const char *err = load_state(g, fd);
+  if (err != NULL) {
+    fail("%s: %s", path, err);
+  }
+  close(fd);
+}
+
+static void save_state_file(Gameboy *g, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fail("failed to create %s", path);
+  }
+  const char *err = save_state(g, fd);
+  if (err != NULL || close(fd) != 0) {
+    fail("%s: %s", path, err != NULL ? err : "failed to close");
+  }
+}
+
+static void write_stats_file(const GameboyStats *stats, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fail("failed to create %s", path);
+  }
+  char *report = stats_report(stats);
+  fputs(report, f);
+  free(report);
+  if (fclose(f) != 0) {
+    fail("failed to write %s", path);
+  }
+}
+
+static void write_profile_file(const Profile *p, const Gameboy *g,
+                               const char *path) {
+  enum { PROFILE_LINES = 50 };
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fail("failed to create %s", path);
+  }
+  char *report = profile_report(p, g, PROFILE_LINES);
+  fputs(report, f);
+  free(report);
+  if (fclose(f) != 0) {
+    fail("failed to write %s", path);
+  }
+}
+
+static void usage() {
+  printf("Usage: headless [-frames N] [-mcycles N] [-engine E] [-ppu P]\n"
+         "                [-input FILE] [-dump FILE.pgm] [-hashes]\n"
+         "                [-loadstate FILE] [-savestate FILE] [-movie FILE]\n"
+         "                [-stats FILE] [-profile FILE] [-stacks FILE]\n"
+         "                <rom-file-name>\n"
+         "E is one of mcycle, instruction or lockstep.\n"
+         "P is one of scanline or fifo.\n");
+  exit(1);
+}
+
+int main(int argc, const char *argv[]) {
+  long max_frames = 600;
+  long max_mcycles = LONG_MAX;
+  Engine engine = ENGINE_INSTRUCTION;
+  PpuModel ppu_model = PPU_SCANLINE;
+  const char *dump_path = NULL;
+  const char *load_path = NULL;
+  const char *save_path = NULL;
+  const char *stats_path = NULL;
+  const char *profile_path = NULL;
+  const char *stacks_path = NULL;
+  bool print_hashes = false;
+  bool limited = false;
+  Movie *movie = NULL;
+  Movie m = {};
+  const char *rom_name = NULL;
+  InputScript script = {};
+  for (int i = 1; i < argc; i++) {
+    bool has_arg = i + 1 < argc;
+    if (strcmp(argv[i], "-frames") == 0 && has_arg) {
+      max_frames = atol(argv[++i]);
+      max_mcycles = LONG_MAX;
+      limited = true;
+    } else if (strcmp(argv[i], "-mcycles") == 0 && has_arg) {
+      max_mcycles = atol(argv[++i]);
+      max_frames = LONG_MAX;
+      limited = true;
+    } else if (strcmp(argv[i], "-engine") == 0 && has_arg) {
+      const char *e = argv[++i];
+      if (strcmp(e, "mcycle") == 0) {
+        engine = ENGINE_MCYCLE;
+      } else if (strcmp(e, "instruction") == 0) {
+        engine = ENGINE_INSTRUCTION;
+      } else if (strcmp(e, "lockstep") == 0) {
+        engine = ENGINE_LOCKSTEP;
+      } else {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-ppu") == 0 && has_arg) {
+      const char *p = argv[++i];
+      if (strcmp(p, "scanline") == 0) {
+        ppu_model = PPU_SCANLINE;
+      } else if (strcmp(p, "fifo") == 0) {
+        ppu_model = PPU_FIFO;
+      } else {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-input") == 0 && has_arg) {
+      script = read_input_script(argv[++i]);
+    } else if (strcmp(argv[i], "-movie") == 0 && has_arg) {
+      m = read_movie(argv[++i]);
+      movie = &m;
+    } else if (strcmp(argv[i], "-dump") == 0 && has_arg) {
+      dump_path = argv[++i];
+    } else if (strcmp(argv[i], "-loadstate") == 0 && has_arg) {
+      load_path = argv[++i];
+    } else if (strcmp(argv[i], "-savestate") == 0 && has_arg) {
+      save_path = argv[++i];
+    } else if (strcmp(argv[i], "-stats") == 0 && has_arg) {
+      stats_path = argv[++i];
+    } else if (strcmp(argv[i], "-profile") == 0 && has_arg) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "-stacks") == 0 && has_arg) {
+      stacks_path = argv[++i];
+    } else if (strcmp(argv[i], "-hashes") == 0) {
+      print_hashes = true;
+    } else if (rom_name == NULL && argv[i][0] != '-') {
+      rom_name = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (rom_name == NULL) {
+    usage();
+  }
+
+  Rom rom = read_rom(rom_name);
+  static Gameboy g;
+  g = init_gameboy(&rom);
+  g.engine = engine;
+  g.ppu_model = ppu_model;
+  static GameboyStats stats;
+  bool profiling = profile_path != NULL || stacks_path != NULL;
+  if (stats_path != NULL || profiling) {
+    g.stats = &stats;
+  }
+  if (load_path != NULL) {
+    load_state_file(&g, load_path);
+  }
+  Profile profile = {};
+  if (profiling) {
+    profile = init_profile(&g);
+    stats.profile = &profile;
+  }
+  if (movie != NULL) {
+    if (state_hash(&g) != movie->start_hash) {
+      fail("movie starts from a different state");
+    }
+    // Run the whole movie unless told otherwise.
+    if (movie->has_end && !limited) {
+      max_frames = LONG_MAX;
+    }
+  }
+
+  long frames = 0;
+  long mcycles = 0;
+  double start = monoclock_time_ns();
+  while (frames < max_frames && mcycles < max_mcycles &&
+         (movie == NULL || !movie_done(movie, &g))) {
+    apply_input_script(&script, &g, frames);
+    double frame_start = g.stats == NULL ? 0 : monoclock_time_ns();
+    if (movie == NULL) {
+      mcycles += run_frame(&g, max_mcycles - mcycles);
+    } else {
+      mcycles += run_movie_frame(movie, &g, max_mcycles - mcycles);
+    }
+    if (g.stats != NULL) {
+      stats_add_frame_ns(g.stats, monoclock_time_ns() - frame_start);
+    }
+    frames++;
+    if (print_hashes) {
+      printf("frame %ld: %016llx\n", frames, (unsigned long long)lcd_hash(&g));
+    }
+  }
+  double secs = (monoclock_time_ns() - start) / NS_PER_S;
+
+  printf("frames: %ld\n", frames);
+  printf("M cycles: %ld\n", mcycles);
+  printf("time: %.3f s\n", secs);
+  printf("frames/s: %.1f\n", frames / secs);
+  printf("speed: %.1fx\n", mcycles / secs / MCYCLES_PER_S);
+  printf("lcd hash: %016llx\n", (unsigned long long)lcd_hash(&g));
+  printf("state hash: %016llx\n", (unsigned long long)state_hash(&g));
+  if (g.serial_len > 0) {
+    printf("serial: %.*s\n", g.serial_len, (const char *)g.serial_out);
+  }
+  bool movie_ok = true;
+  if (movie != NULL && movie_done(movie, &g)) {
+    if (g.tcycles > movie->end_tcycle) {
+      // The end is not at an instruction boundary,
+      // or ENGINE_INSTRUCTION skipped over it while halted,
+      // so the end state cannot be checked.
+      movie_ok = false;
+      printf("movie: ran %llu T cycles past the end\n",
+             (unsigned long long)(g.tcycles - movie->end_tcycle));
+    } else {
+      movie_ok = state_hash(&g) == movie->end_hash;
+      printf("movie: %s\n", movie_ok ? "matches" : "differs at end");
+    }
+  }
+  if (dump_path != NULL) {
+    dump_lcd(&g, dump_path);
+  }
+  if (save_path != NULL) {
+    save_state_file(&g, save_path);
+  }
+  if (stats_path != NULL) {
+    write_stats_file(&stats, stats_path);
+  }
+  if (profile_path != NULL) {
+    write_profile_file(&profile, &g, profile_path);
+  }
+  if (stacks_path != NULL) {
+    write_profile_stacks(&profile, stacks_path);
+  }
+  free_profile(&profile);
+  free_gameboy(&g);
+  free_rom(&rom);
+  free_input_script(&script);
+  free_movie(&m);
+  return movie_ok ? 0 : 1;
+}
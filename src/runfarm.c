@@ -0,0 +1,65 @@
+// Needed for sysconf.
+#define _POSIX_C_SOURCE 200809L
+
+#include "farm/farm.h"
+#include "gb/gameboy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const double NS_PER_S = 1e9;
+
+static void usage() {
+  printf("Usage: runfarm [-workers N] [-o FILE] <jobs-file>\n"
+         "Each line of the jobs file is:\n"
+         "  <rom-file> <frames> [input=<script-file>] [capture=<frames>]\n");
+  exit(1);
+}
+
+int main(int argc, const char *argv[]) {
+  int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *out_path = NULL;
+  const char *jobs_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    bool has_arg = i + 1 < argc;
+    if (strcmp(argv[i], "-workers") == 0 && has_arg) {
+      nworkers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && has_arg) {
+      out_path = argv[++i];
+    } else if (jobs_path == NULL && argv[i][0] != '-') {
+      jobs_path = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (jobs_path == NULL || nworkers < 1) {
+    usage();
+  }
+  // Turn off trap messages; they would interleave between workers.
+  extern bool shhhh;
+  shhhh = true;
+
+  int njobs = 0;
+  FarmJob *jobs = read_farm_jobs(jobs_path, &njobs);
+  FILE *out = stdout;
+  if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+    fail("failed to create %s", out_path);
+  }
+  FarmStats stats = run_farm(jobs, njobs, nworkers, out);
+  if (out != stdout && fclose(out) != 0) {
+    fail("failed to write %s", out_path);
+  }
+
+  double secs = stats.wall_ns / NS_PER_S;
+  fprintf(stderr, "%d jobs, %ld frames in %.3f s: %.1f frames/s\n", njobs,
+          stats.frames, secs, stats.frames / secs);
+  for (int i = 0; i < stats.nworkers; i++) {
+    FarmWorkerStats *w = &stats.workers[i];
+    fprintf(stderr, "worker %d: %ld jobs (%ld stolen), %.1f%% busy\n", i,
+            w->jobs, w->steals, 100 * w->busy_ns / stats.wall_ns);
+  }
+  free_farm_stats(&stats);
+  free_farm_jobs(jobs, njobs);
+  return 0;
+}
@@ -16,7 +16,7 @@ void sleep_ns(long ns) {
   long s = ns / NS_PER_S;
   struct timespec ts = {
       .tv_sec = s,
-      .tv_nsec = ns - s,
+      .tv_nsec = ns - s * NS_PER_S,
   };
   nanosleep(&ts, NULL);
 }